@@ -1,11 +1,9 @@
 
-#include <avr/eeprom.h>
-#include <avr/io.h>
-#include <util/crc16.h>
-
+#include "hal.h"
 #include "config.h"
 #include "shared.h"
 #include "comm.h"
+#include "trace.h"
 
 ////////////////////////////////////////////
 /// Macros
@@ -13,6 +11,16 @@
 
 #define SOM_BYTE 0xFF
 
+// Escaped framing (ESCAPED_FRAMING)
+#define FRAME_END     0xC0
+#define FRAME_ESC     0xDB
+#define FRAME_ESC_END 0xDC
+#define FRAME_ESC_ESC 0xDD
+#define ESCAPED_FLAG  0x04
+
+// upcomingPage when no PAGE_NUM message precedes the page data
+#define NO_PAGE 0xFF
+
 ////////////////////////////////////////////
 /// Globals Variables
 ////////////////////////////////////////////
@@ -28,11 +36,29 @@ uint8_t readyForPages = 0;
 uint8_t msgType = 0;
 uint8_t msgLen = 0;
 
-uint8_t upcomingPage = 0;
+uint8_t upcomingPage = NO_PAGE;
 uint8_t nextPageNumber;
 
 uint16_t msgCRC;
 
+// The rest of the current message is lost (it took too long
+// to arrive or the next message started)
+uint8_t msgAbandoned = 0;
+
+#if ESCAPED_FRAMING == 1
+// A FRAME_END cut the last message short, so the next one has started
+uint8_t frameStarted = 0;
+#endif
+
+#if USE_IMAGE_DIGEST == 1
+uint8_t imageDigest[IMAGE_DIGEST_LEN];
+#endif
+
+#if EARLY_RELEASE == 1
+// Number of pages announced in START (0 if unknown)
+uint8_t imagePages = 0;
+#endif
+
 
 ////////////////////////////////////////////
 /// Local Prototypes
@@ -43,14 +69,67 @@ static void error();
 static void reset();
 static uint8_t readAndParse();
 static uint8_t processMessage();
+static uint8_t endSession();
+#if USE_IMAGE_DIGEST == 1
+static uint8_t isCurrentImage();
+static void saveImageDigest();
+#endif
 
 
 ////////////////////////////////////////////
 /// Methods
 ////////////////////////////////////////////
 
+// Receive the next byte of the current message off the line.
+// Once a byte takes too long, the rest of the message is abandoned
+// and this returns 0 right away.
+static uint8_t commReceiveTimed() {
+  if (msgAbandoned) {
+    return 0;
+  }
+#if COMM_TIMEOUT_BITS > 0
+  commTimeoutReset();
+  while (!commAvailable()) {
+    if (commTimeoutExpired()) {
+      TRACE(TRACE_TIMEOUT);
+      msgAbandoned = 1;
+      return 0;
+    }
+  }
+  return commRead();
+#else
+  return commReceive();
+#endif
+}
+
+// Receive the next byte of the current message
+static uint8_t commReceiveInMessage() {
+  uint8_t b = commReceiveTimed();
+
+#if ESCAPED_FRAMING == 1
+  if (b == FRAME_ESC) {
+    b = commReceiveTimed();
+    if (b == FRAME_ESC_END) {
+      return FRAME_END;
+    }
+    if (b == FRAME_ESC_ESC) {
+      return FRAME_ESC;
+    }
+  }
+
+  // The next message is starting, abandon this one
+  if (b == FRAME_END) {
+    frameStarted = 1;
+    msgAbandoned = 1;
+    return 0;
+  }
+#endif
+
+  return b;
+}
+
 static inline uint8_t commReceiveWithCRC() {
-  uint8_t b = commReceive();
+  uint8_t b = commReceiveInMessage();
   msgCRC = _crc16_update(msgCRC, b);
   return b;
 }
@@ -58,8 +137,9 @@ static inline uint8_t commReceiveWithCRC() {
 // Inform master an error occured while reading the message
 static void error() {
   if (readyForPages) {
+    TRACE(TRACE_ERROR);
     signalEnable();
-    upcomingPage = 0;
+    upcomingPage = NO_PAGE;
   }
 }
 
@@ -67,6 +147,7 @@ static void error() {
 static void reset() {
   msgCRC = ~0;
   msgLen = 0;
+  msgAbandoned = 0;
 }
 
 // Watch the serial line for the next message
@@ -75,6 +156,14 @@ uint8_t watchSerial(uint8_t pagesRead) {
 
   nextPageNumber = pagesRead;
   reset();
+  TRACE(TRACE_WAIT);
+
+#if EARLY_RELEASE == 1
+  // We have the whole program, don't wait for the END message
+  if (readyForPages && imagePages && pagesRead == imagePages) {
+    return endSession();
+  }
+#endif
 
   while (1) {
     status = readAndParse();
@@ -87,18 +176,39 @@ uint8_t watchSerial(uint8_t pagesRead) {
 
 // Read from the serial line and parse the bytes as they come in
 static uint8_t readAndParse() {
-  uint8_t b = commReceive();
+#if ESCAPED_FRAMING == 1
+  // Start of message (which might have arrived in the last one)
+  uint8_t start = frameStarted || commReceive() == FRAME_END;
+  frameStarted = 0;
+#else
+  uint8_t start = commReceive() == SOM_BYTE && commReceiveInMessage() == SOM_BYTE;
+#endif
 
-  // Start of message
-  if (b == SOM_BYTE && commReceive() == SOM_BYTE) {
+  if (start) {
+    TRACE(TRACE_MESSAGE);
 
     // Header
+#if ESCAPED_FRAMING == 1
+    // Not an escaped message, so it can't be read
+    if (!(commReceiveWithCRC() & ESCAPED_FLAG)) {
+      msgAbandoned = 1;
+    }
+#else
     commReceiveWithCRC(); // flags (ignored)
+#endif
     commReceiveWithCRC(); // addr (ignored)
     msgType = commReceiveWithCRC();
     commReceiveWithCRC(); // len per section (ignored)
     msgLen = commReceiveWithCRC();
 
+    // Too long to be one of our messages, so this was not really
+    // the start of a message (and it would overflow pageData)
+    if (msgLen > SPM_PAGESIZE) {
+      error();
+      reset();
+      return STATUS_NONE;
+    }
+
     // Data
     uint8_t dataReceived = 0;
     while (dataReceived < msgLen) {
@@ -106,16 +216,19 @@ static uint8_t readAndParse() {
     }
 
     // CRC Validation
-    uint8_t crc1 = commReceive();
-    uint8_t crc2 = commReceive();
+    TRACE(TRACE_RECEIVED);
+    uint8_t crc1 = commReceiveInMessage();
+    uint8_t crc2 = commReceiveInMessage();
     uint16_t fullCrc = (crc1 << 8 ) | (crc2 & 0xff);
-    if (fullCrc != msgCRC){
+    if (msgAbandoned || fullCrc != msgCRC){
+      TRACE(TRACE_CRC_ERROR);
       error();
       reset();
       return STATUS_NONE;
     }
 
     // Message received
+    TRACE(TRACE_CRC_OK);
     return processMessage();
   }
   else {
@@ -129,29 +242,37 @@ static uint8_t readAndParse() {
 // Do something with the received message
 static uint8_t processMessage() {
 
-  // Let master node know we're ready by disabling signal
   if (msgType == MSG_CMD_PROG_START) {
-    signalDisable();
 
-    // Check version number
-#if USE_VERSIONING == 1
-    uint8_t vmaj = eeprom_read_byte(VERSION_MAJOR);
-    uint8_t vmin = eeprom_read_byte(VERSION_MAJOR);
-    if ((vmaj == 0xFF || pageData[0] == vmaj)
-        && (vmin == 0xFF || pageData[1] == vmin) ) {
-      readyForPages = 1;
+#if USE_IMAGE_DIGEST == 1
+    // Already running this program, release the signal line
+    // and leave the session
+    if (isCurrentImage()) {
+      reset();
+      return STATUS_CURRENT;
     }
+
+    // Invalidate the stored digest before the flash is touched.
+    // Master never sends a digest starting with 0xFF, so this stays
+    // invalid if START is sent again.
+    // The signal line stays enabled until the first page is received,
+    // which tells master at least one node needs the program.
+    eeprom_update_byte(EEPROM_IMAGE_DIGEST, 0xFF);
 #else
-    readyForPages = 1;
+    // Let master node know we're ready by disabling signal
+    signalDisable();
 #endif
 
+#if EARLY_RELEASE == 1
+    imagePages = (msgLen > IMAGE_DIGEST_LEN) ? pageData[IMAGE_DIGEST_LEN] : 0;
+#endif
+
+    readyForPages = 1;
   }
 
   // We're done programming
   else if (msgType == MSG_CMD_PROG_END) {
-    readyForPages = 0;
-    reset();
-    return STATUS_DONE;
+    return endSession();
   }
 
   else if (readyForPages == 1) {
@@ -163,10 +284,17 @@ static uint8_t processMessage() {
 
     // Load the next page
     else if (msgType == MSG_CMD_PAGE_DATA) {
+      uint8_t pageNum = upcomingPage;
+      upcomingPage = NO_PAGE;
 
+      // We already have this page, it's being resent for another node.
+      // Release the signal line in case a corrupt message enabled it.
+      if (pageNum < nextPageNumber) {
+        signalDisable();
+      }
       // Length and page size do not match up
       // or this is not the page we were expecting
-      if (msgLen > SPM_PAGESIZE || upcomingPage != nextPageNumber) {
+      else if (msgLen > SPM_PAGESIZE || pageNum != nextPageNumber) {
         error();
       }
       // Valid page
@@ -177,6 +305,7 @@ static uint8_t processMessage() {
 					pageData[msgLen++] = 0xFF;
         }
 
+        TRACE(TRACE_PAGE_READY);
         signalDisable();
         reset();
         return STATUS_PAGE_READY;
@@ -186,4 +315,52 @@ static uint8_t processMessage() {
 
   reset();
   return STATUS_NONE;
-}
\ No newline at end of file
+}
+
+// Leave the programming session
+static uint8_t endSession() {
+#if USE_IMAGE_DIGEST == 1
+  if (readyForPages) {
+    saveImageDigest();
+  }
+#endif
+  readyForPages = 0;
+  reset();
+  return STATUS_DONE;
+}
+
+#if USE_IMAGE_DIGEST == 1
+
+// Compare the digest in the START message with the one in EEPROM
+// Returns 1 if this node is already running the incoming program.
+static uint8_t isCurrentImage() {
+  uint8_t current = 1;
+
+  // No digest (older master), so program the node and don't save one.
+  // A digest never starts with 0xFF.
+  if (msgLen < IMAGE_DIGEST_LEN) {
+    imageDigest[0] = 0xFF;
+    return 0;
+  }
+
+  for (uint8_t i = 0; i < IMAGE_DIGEST_LEN; i++) {
+    imageDigest[i] = pageData[i];
+    if (eeprom_read_byte(EEPROM_IMAGE_DIGEST + i) != pageData[i]) {
+      current = 0;
+    }
+  }
+  return current;
+}
+
+// Store the digest of the program that was just written
+// (the stored one was invalidated at START, so leave it if there's none)
+static void saveImageDigest() {
+  if (imageDigest[0] == 0xFF) {
+    return;
+  }
+  for (uint8_t i = 0; i < IMAGE_DIGEST_LEN; i++) {
+    eeprom_update_byte(EEPROM_IMAGE_DIGEST + i, imageDigest[i]);
+  }
+}
+
+#endif
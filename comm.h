@@ -12,6 +12,7 @@
 #define STATUS_NONE 0
 #define STATUS_PAGE_READY 1
 #define STATUS_DONE 2
+#define STATUS_CURRENT 3
 
 // The data for a single page of the program
 extern uint8_t pageData[SPM_PAGESIZE];
@@ -0,0 +1,12 @@
+#include "digest.h"
+
+uint32_t digestImage(const uint8_t *image, uint32_t len) {
+  uint32_t hash = 2166136261UL;
+  for (uint32_t i = 0; i < len; i++) {
+    hash = (hash ^ image[i]) * 16777619UL;
+  }
+  if ((hash & 0xFF) == 0xFF) {
+    hash ^= 1;
+  }
+  return hash;
+}
@@ -0,0 +1,26 @@
+/*****************************************************************************
+*
+* The image digest sent in the START message. The simulator and the host
+* tools both use this, so they always agree with each other.
+*
+****************************************************************************/
+
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 32-bit FNV-1a of the page padded image. The first IMAGE_DIGEST_LEN
+// bytes (little endian) are sent in the START message.
+// The first byte is never 0xFF, since the nodes use that to mark an invalid digest.
+uint32_t digestImage(const uint8_t *image, uint32_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
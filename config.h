@@ -26,21 +26,80 @@
 
 
 ////////////////////////////////////////////
-/// Versioning
+/// Image Digest
 ////////////////////////////////////////////
 
-// The version stored in EEPROM will be compared to the
-// version sent to the bootloader. If they're the same, the
-// device will skip programming.
+// The START message carries a digest of the incoming program. It's
+// compared against the digest this node stored the last time it was
+// programmed. If they're the same, the node releases the signal line
+// and starts its program right away, without receiving any pages.
+
+// Set to 1 to enable
+#ifndef USE_IMAGE_DIGEST
+#define USE_IMAGE_DIGEST 0
+#endif
+
+// Number of digest bytes at the start of the START message
+#define IMAGE_DIGEST_LEN 4
+
+// The EEPROM address where the digest is stored (IMAGE_DIGEST_LEN bytes).
+// The bootloader writes these locations when programming completes,
+// your program should not write to them.
+#define EEPROM_IMAGE_DIGEST (uint8_t*) 0x01
+
+
+////////////////////////////////////////////
+/// Early Release
+////////////////////////////////////////////
+
+// The START message also carries the number of pages in the program,
+// after the digest. With early release, a node that has written all of
+// them starts its program right away instead of waiting for the END
+// message while pages are resent to other nodes. Your program must
+// ignore the bootloader messages and leave the signal line alone.
+
+// Set to 1 to enable
+#ifndef EARLY_RELEASE
+#define EARLY_RELEASE 0
+#endif
 
-// Comment this out to disable
-#define USE_VERSIONING 0
 
-// The EEPROM address of where the major and minimum version numbers
-// are stored. These need to be stored by your program, the bootloader
-// does not write to these locations.
-#define VERSION_MAJOR (uint8_t*) 0x01
-#define VERSION_MINOR (uint8_t*) 0x02
+////////////////////////////////////////////
+/// Tracing
+////////////////////////////////////////////
+
+// Record events in the receive loop (see trace.h for the event codes)
+//   0 - Off, compiled out
+//   1 - Toggle TRACE_PIN_BIT on each event in TRACE_GPIO_EVENTS,
+//       for a logic analyzer or simavr VCD
+//   2 - Record events with a Timer1 timestamp in a RAM ring,
+//       which is dumped when programming finishes
+#ifndef TRACE_MODE
+#define TRACE_MODE 0
+#endif
+
+// Debug pin for mode 1
+#define TRACE_PIN_BIT PD4
+#define TRACE_PIN_DDR DDRD
+#define TRACE_PIN_REG PIND
+
+// Bit mask of the events that toggle the debug pin
+#ifndef TRACE_GPIO_EVENTS
+#define TRACE_GPIO_EVENTS 0xFFFF
+#endif
+
+// Number of events kept in the ring (power of 2, up to 128)
+// Timestamps are Timer1 counts, at TIMER1_CLOCK
+#define TRACE_RING_SIZE 32
+
+// Where the ring is dumped at the end of programming
+//   0 - To EEPROM, starting at TRACE_EEPROM_ADDR
+//   1 - Out of the UART TX pin. The RS485 transceiver is not
+//       enabled, so only use this with a single node.
+#ifndef TRACE_DUMP
+#define TRACE_DUMP 0
+#endif
+#define TRACE_EEPROM_ADDR (uint8_t*) 0x10
 
 
 ////////////////////////////////////////////
@@ -49,17 +108,44 @@
 
 #define SIGNAL_BIT PD7
 #define SIGNAL_DDR_REG DDRD
-#define SIGNAL_PIN_REG PIND
+#define SIGNAL_PORT_REG PORTD
 
 
 ////////////////////////////////////////////
 /// Communications
 ////////////////////////////////////////////
 
+#ifndef SERIAL_BAUD
 #define SERIAL_BAUD 115200
+#endif
+
+// Abandon a message if the next byte doesn't arrive within this many bit
+// times, and go back to looking for the start of a message (0 to disable).
+// The master must send each message back to back, so this only has to cover jitter.
+#ifndef COMM_TIMEOUT_BITS
+#define COMM_TIMEOUT_BITS 100
+#endif
+
+// Frame messages with escape stuffing instead of the 0xFF 0xFF start of message.
+// Every message starts with FRAME_END (0xC0), which is escaped everywhere else,
+// so after an error the bootloader is back in step by the next message.
+// Master must send escaped messages with the escaped flag (0x04) set.
+#ifndef ESCAPED_FRAMING
+#define ESCAPED_FRAMING 0
+#endif
+
+// Timer1 runs free for the receive timeout and trace timestamps (F_CPU / 64)
+#define TIMER1_CLOCK ((1 << CS11) | (1 << CS10))
+#define TIMER1_PRESCALE 64
+
+// Timer1 ticks in the receive timeout
+#define COMM_TIMEOUT_TICKS ((F_CPU) / TIMER1_PRESCALE * COMM_TIMEOUT_BITS / (SERIAL_BAUD) + 1)
+#if COMM_TIMEOUT_BITS > 0 && COMM_TIMEOUT_TICKS > 0xFFFF
+#error "COMM_TIMEOUT_BITS is too long for Timer1 at this baud rate"
+#endif
 
 // Setup the communication channel (by default using the UART and a RS485 transciever)
-inline void commSetup() {
+static inline void commSetup() {
   PORTD |= (1 << PD0); // Enable pull-up on RX pin
 
   UCSR0B = (1<<RXEN0); // Enable RX
@@ -67,14 +153,40 @@ inline void commSetup() {
 
   // Set baud
   UBRR0 =  (unsigned char) (((F_CPU) + 8UL * (SERIAL_BAUD)) / (16UL * (SERIAL_BAUD)) - 1UL);
+
+#if COMM_TIMEOUT_BITS > 0
+  TCCR1A = 0;
+  TCCR1B = TIMER1_CLOCK;
+#endif
 }
 
-// Receive the next byte of data
-inline uint8_t commReceive() {
-  while (!(UCSR0A & (1<<RXC0))); // wait for data
+// Is a received byte waiting
+static inline uint8_t commAvailable() {
+  return UCSR0A & (1<<RXC0);
+}
+
+// Read the received byte
+static inline uint8_t commRead() {
   return UDR0;
 }
 
+// Receive the next byte of data
+static inline uint8_t commReceive() {
+  while (!commAvailable()); // wait for data
+  return commRead();
+}
+
+// Start timing the wait for the next byte
+static inline void commTimeoutReset() {
+  OCR1A = TCNT1 + COMM_TIMEOUT_TICKS;
+  TIFR1 = (1 << OCF1A);
+}
+
+// Has the next byte taken too long
+static inline uint8_t commTimeoutExpired() {
+  return TIFR1 & (1 << OCF1A);
+}
+
 
 ////////////////////////////////////////////
 /// Bus Message Commands
@@ -0,0 +1,31 @@
+/*****************************************************************************
+*
+* Hardware abstraction for the bootloader.
+*
+* On the device this pulls in the avr-libc headers. When compiled with
+* SIMULATOR defined, the same registers and functions are provided by the
+* host simulator in sim/ so the bootloader can run natively.
+*
+****************************************************************************/
+
+#ifndef HAL_H
+#define HAL_H
+
+#ifdef SIMULATOR
+
+#include "sim/sim_avr.h"
+
+#else
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/boot.h>
+#include <avr/wdt.h>
+#include <util/crc16.h>
+
+// Jump to the start of the main program
+#define startApplication() asm("jmp 0000")
+
+#endif
+
+#endif
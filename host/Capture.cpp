@@ -0,0 +1,172 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Capture.h"
+
+static uint64_t clockNs(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint8_t writeAll(int fd, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t*)data;
+  while (len) {
+    ssize_t n = ::write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return 0;
+    }
+    p += n;
+    len -= n;
+  }
+  return 1;
+}
+
+CaptureWriter::CaptureWriter() {
+  fd = -1;
+  startNs = 0;
+  buffered = 0;
+}
+
+CaptureWriter::~CaptureWriter() {
+  close();
+}
+
+uint8_t CaptureWriter::open(const char *path, uint32_t baud) {
+  close();
+
+  fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror(path);
+    return 0;
+  }
+
+  captureHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+  header.version = CAPTURE_VERSION;
+  header.recordSize = sizeof(uint64_t);
+  header.baud = baud;
+  header.startRealtimeNs = clockNs(CLOCK_REALTIME);
+  startNs = clockNs(CLOCK_MONOTONIC);
+
+  if (!writeAll(fd, &header, sizeof(header))) {
+    perror(path);
+    ::close(fd);
+    fd = -1;
+    return 0;
+  }
+  return 1;
+}
+
+void CaptureWriter::close() {
+  if (fd < 0) return;
+  flush();
+  ::close(fd);
+  fd = -1;
+}
+
+uint8_t CaptureWriter::isOpen() {
+  return fd >= 0;
+}
+
+void CaptureWriter::record(uint8_t event, uint8_t data, uint64_t monotonicNs) {
+  if (fd < 0) return;
+  if (!monotonicNs) {
+    monotonicNs = clockNs(CLOCK_MONOTONIC);
+  }
+
+  uint64_t ns = (monotonicNs > startNs) ? monotonicNs - startNs : 0;
+  buffer[buffered++] = captureRecord(event, data, ns);
+  if (buffered == sizeof(buffer) / sizeof(buffer[0])) {
+    flush();
+  }
+}
+
+void CaptureWriter::flush() {
+  if (fd < 0 || buffered == 0) return;
+  if (!writeAll(fd, buffer, buffered * sizeof(buffer[0]))) {
+    perror("Writing the capture");
+  }
+  buffered = 0;
+}
+
+CaptureReader::CaptureReader() {
+  map = NULL;
+  mapSize = 0;
+}
+
+CaptureReader::~CaptureReader() {
+  if (map) {
+    munmap((void*)map, mapSize);
+  }
+}
+
+uint8_t CaptureReader::open(const char *path) {
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < CAPTURE_HEADER_SIZE) {
+    fprintf(stderr, "%s: not a capture file\n", path);
+    ::close(fd);
+    return 0;
+  }
+
+  void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (m == MAP_FAILED) {
+    perror(path);
+    return 0;
+  }
+  map = (const uint8_t*)m;
+  mapSize = st.st_size;
+
+  // Records are read front to back
+  madvise(m, mapSize, MADV_SEQUENTIAL);
+
+  const captureHeader &h = header();
+  if (memcmp(h.magic, CAPTURE_MAGIC, sizeof(h.magic)) != 0 ||
+      h.version != CAPTURE_VERSION || h.recordSize != sizeof(uint64_t)) {
+    fprintf(stderr, "%s: not a version %u capture file\n", path, CAPTURE_VERSION);
+    return 0;
+  }
+  return 1;
+}
+
+const captureHeader& CaptureReader::header() const {
+  return *(const captureHeader*)map;
+}
+
+size_t CaptureReader::count() const {
+  return (mapSize - CAPTURE_HEADER_SIZE) / sizeof(uint64_t);
+}
+
+const uint64_t* CaptureReader::records() const {
+  return (const uint64_t*)(map + CAPTURE_HEADER_SIZE);
+}
+
+size_t CaptureReader::find(uint64_t ns) const {
+  const uint64_t *r = records();
+  size_t lo = 0, hi = count();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (captureTime(r[mid]) < ns) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
@@ -0,0 +1,77 @@
+#ifndef Capture_H
+#define Capture_H
+
+/************************************************************************************
+ *  Records bus traffic to a capture file and reads it back (the format is in
+ *  capture_format.h).
+ *
+ *  DiscobusDataPosix writes to a CaptureWriter as it sends and receives, so a
+ *  slow session can be looked at afterwards byte by byte instead of guessing
+ *  from scope traces. CaptureReader maps the whole file read-only.
+ *
+ ************************************************************************************/
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "capture_format.h"
+
+class CaptureWriter {
+public:
+  CaptureWriter();
+  ~CaptureWriter();
+
+  // Create the capture file. Returns 0 if it can't be created.
+  uint8_t open(const char *path, uint32_t baud);
+
+  // Write out anything buffered and close the file
+  void close();
+
+  uint8_t isOpen();
+
+  // Add an event at `monotonicNs` (CLOCK_MONOTONIC), or now if it's 0
+  void record(uint8_t event, uint8_t data, uint64_t monotonicNs=0);
+
+  // Write out anything buffered
+  void flush();
+
+private:
+  int fd;
+  uint64_t startNs;
+
+  uint64_t buffer[8192];
+  uint32_t buffered;
+
+  // Not copyable
+  CaptureWriter(const CaptureWriter&);
+  CaptureWriter& operator=(const CaptureWriter&);
+};
+
+class CaptureReader {
+public:
+  CaptureReader();
+  ~CaptureReader();
+
+  // Map a capture file. Returns 0, after printing why, if it isn't valid.
+  uint8_t open(const char *path);
+
+  const captureHeader& header() const;
+
+  // Number of records
+  size_t count() const;
+
+  // All of the records
+  const uint64_t* records() const;
+
+  // Index of the first record at or after `ns`
+  size_t find(uint64_t ns) const;
+
+private:
+  const uint8_t *map;
+  size_t mapSize;
+
+  CaptureReader(const CaptureReader&);
+  CaptureReader& operator=(const CaptureReader&);
+};
+
+#endif
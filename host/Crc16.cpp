@@ -0,0 +1,195 @@
+
+#include "Crc16.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define CRC16_CLMUL 1
+  #include <wmmintrin.h>
+#else
+  #define CRC16_CLMUL 0
+#endif
+
+// The polynomial as x^16 + x^15 + x^2 + 1 (0xA001 is this bit reversed)
+#define CRC16_POLY 0x18005
+
+// Slice-by-8 tables. table[k][b] is the CRC of byte `b` followed by k zero bytes.
+struct Crc16Tables {
+  uint16_t table[8][256];
+
+  Crc16Tables() {
+    for (uint16_t b = 0; b < 256; b++) {
+      uint8_t byte = b;
+      table[0][b] = crc16Bitwise(0, &byte, 1);
+    }
+    for (uint8_t k = 1; k < 8; k++) {
+      for (uint16_t b = 0; b < 256; b++) {
+        uint16_t prev = table[k - 1][b];
+        table[k][b] = (prev >> 8) ^ table[0][prev & 0xFF];
+      }
+    }
+  }
+};
+
+static const Crc16Tables& tables() {
+  static Crc16Tables tables;
+  return tables;
+}
+
+uint16_t crc16Bitwise(uint16_t crc, const uint8_t *data, size_t len) {
+  for (size_t n = 0; n < len; n++) {
+    crc ^= data[n];
+    for (uint8_t i = 0; i < 8; i++) {
+      if (crc & 1) {
+        crc = (crc >> 1) ^ 0xA001;
+      } else {
+        crc = (crc >> 1);
+      }
+    }
+  }
+  return crc;
+}
+
+uint16_t crc16Slice8(uint16_t crc, const uint8_t *data, size_t len) {
+  const uint16_t (*t)[256] = tables().table;
+
+  while (len >= 8) {
+    crc ^= data[0] | (data[1] << 8);
+    crc = t[7][crc & 0xFF] ^ t[6][crc >> 8] ^
+          t[5][data[2]] ^ t[4][data[3]] ^ t[3][data[4]] ^
+          t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    data += 8;
+    len -= 8;
+  }
+  while (len--) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+  }
+  return crc;
+}
+
+#if CRC16_CLMUL
+
+/**
+ * Folding, as in Intel's "Fast CRC Computation Using PCLMULQDQ Instruction".
+ *
+ * The CRC is bit reflected, so in a 128-bit block bit i is the coefficient of
+ * x^(127 - i). A block X = H·x^64 + L is moved n bits further down the message
+ * by multiplying H by x^(n+64) mod P and L by x^n mod P, which leaves a 128-bit
+ * result to add to the block n bits later. (Multiplying reflected values adds
+ * an extra factor of x, which the constants take back out.)
+ *
+ * The last block is reduced to the CRC with the tables.
+ */
+
+// x^n mod P
+static uint16_t xPowMod(uint32_t n) {
+  uint32_t r = 1;
+  while (n--) {
+    r <<= 1;
+    if (r & 0x10000) {
+      r ^= CRC16_POLY;
+    }
+  }
+  return r;
+}
+
+// A polynomial as a reflected 64-bit lane (the coefficient of x^d in bit 63 - d)
+static uint64_t reflect64(uint16_t poly) {
+  uint64_t r = 0;
+  for (uint8_t d = 0; d < 16; d++) {
+    if (poly & (1 << d)) {
+      r |= 1ULL << (63 - d);
+    }
+  }
+  return r;
+}
+
+struct Crc16FoldConstants {
+  uint64_t by128[2],  // Fold one block into the next
+           by512[2];  // Fold across four blocks
+
+  Crc16FoldConstants() {
+    by128[0] = reflect64(xPowMod(128 + 63));
+    by128[1] = reflect64(xPowMod(128 - 1));
+    by512[0] = reflect64(xPowMod(512 + 63));
+    by512[1] = reflect64(xPowMod(512 - 1));
+  }
+};
+
+static const Crc16FoldConstants& foldConstants() {
+  static Crc16FoldConstants constants;
+  return constants;
+}
+
+__attribute__((target("pclmul,sse2")))
+static inline __m128i fold(__m128i x, __m128i k, __m128i next) {
+  __m128i h = _mm_clmulepi64_si128(x, k, 0x00);
+  __m128i l = _mm_clmulepi64_si128(x, k, 0x11);
+  return _mm_xor_si128(_mm_xor_si128(h, l), next);
+}
+
+__attribute__((target("pclmul,sse2")))
+static uint16_t crc16Fold(uint16_t crc, const uint8_t *data, size_t len) {
+  const Crc16FoldConstants &c = foldConstants();
+  const __m128i k128 = _mm_loadu_si128((const __m128i*)c.by128);
+  const __m128i k512 = _mm_loadu_si128((const __m128i*)c.by512);
+
+  // Four blocks at a time, so the multiplies overlap
+  __m128i x0 = _mm_loadu_si128((const __m128i*)(data));
+  __m128i x1 = _mm_loadu_si128((const __m128i*)(data + 16));
+  __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 32));
+  __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 48));
+  x0 = _mm_xor_si128(x0, _mm_cvtsi32_si128(crc));
+  data += 64;
+  len -= 64;
+
+  while (len >= 64) {
+    x0 = fold(x0, k512, _mm_loadu_si128((const __m128i*)(data)));
+    x1 = fold(x1, k512, _mm_loadu_si128((const __m128i*)(data + 16)));
+    x2 = fold(x2, k512, _mm_loadu_si128((const __m128i*)(data + 32)));
+    x3 = fold(x3, k512, _mm_loadu_si128((const __m128i*)(data + 48)));
+    data += 64;
+    len -= 64;
+  }
+
+  __m128i x = fold(x0, k128, x1);
+  x = fold(x, k128, x2);
+  x = fold(x, k128, x3);
+  while (len >= 16) {
+    x = fold(x, k128, _mm_loadu_si128((const __m128i*)data));
+    data += 16;
+    len -= 16;
+  }
+
+  uint8_t last[16];
+  _mm_storeu_si128((__m128i*)last, x);
+  crc = crc16Slice8(0, last, sizeof(last));
+  return crc16Slice8(crc, data, len);
+}
+
+uint8_t crc16HasClmul() {
+  static const uint8_t supported = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2");
+  return supported;
+}
+
+uint16_t crc16Clmul(uint16_t crc, const uint8_t *data, size_t len) {
+  // Short buffers are quicker with the tables
+  if (len < 128 || !crc16HasClmul()) {
+    return crc16Slice8(crc, data, len);
+  }
+  return crc16Fold(crc, data, len);
+}
+
+#else
+
+uint8_t crc16HasClmul() {
+  return 0;
+}
+
+uint16_t crc16Clmul(uint16_t crc, const uint8_t *data, size_t len) {
+  return crc16Slice8(crc, data, len);
+}
+
+#endif
+
+uint16_t crc16(uint16_t crc, const uint8_t *data, size_t len) {
+  return crc16Clmul(crc, data, len);
+}
@@ -0,0 +1,33 @@
+#ifndef Crc16_H
+#define Crc16_H
+
+/************************************************************************************
+ *  The bootloader's message CRC (avr-libc's _crc16_update: polynomial 0xA001,
+ *  started at ~0) over whole buffers, for encoding messages on the host.
+ *
+ *  crc16() picks the fastest version the CPU supports. The others are here so
+ *  they can be checked against each other and timed (see host/frame_bench.cpp).
+ *  Every version returns exactly what calling _crc16_update on each byte would.
+ *
+ ************************************************************************************/
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Continue `crc` over `len` bytes, with the fastest version available
+uint16_t crc16(uint16_t crc, const uint8_t *data, size_t len);
+
+// One bit at a time, like _crc16_update
+uint16_t crc16Bitwise(uint16_t crc, const uint8_t *data, size_t len);
+
+// Eight bytes at a time, with lookup tables
+uint16_t crc16Slice8(uint16_t crc, const uint8_t *data, size_t len);
+
+// 64 bytes at a time, with carry-less multiplication (x86 PCLMULQDQ).
+// Falls back to crc16Slice8() if the CPU doesn't have it.
+uint16_t crc16Clmul(uint16_t crc, const uint8_t *data, size_t len);
+
+// Can crc16Clmul() use carry-less multiplication on this CPU
+uint8_t crc16HasClmul();
+
+#endif
@@ -0,0 +1,371 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Crc16.h"
+#include "DiscobusDataPosix.h"
+#include "serial_baud.h"
+
+static uint64_t monotonicNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleepUntil(uint64_t ns) {
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000ULL;
+  ts.tv_nsec = ns % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static int modemBit(DiscobusDataPosix::ModemLine line) {
+  switch (line) {
+    case DiscobusDataPosix::LINE_RTS: return TIOCM_RTS;
+    case DiscobusDataPosix::LINE_DTR: return TIOCM_DTR;
+    case DiscobusDataPosix::LINE_CTS: return TIOCM_CTS;
+    case DiscobusDataPosix::LINE_DSR: return TIOCM_DSR;
+    case DiscobusDataPosix::LINE_DCD: return TIOCM_CD;
+    case DiscobusDataPosix::LINE_RI:  return TIOCM_RI;
+    default: return 0;
+  }
+}
+
+// The termios constant for a standard baud rate, or B0
+static speed_t standardBaud(uint32_t baud) {
+  switch (baud) {
+    case 9600:    return B9600;
+    case 19200:   return B19200;
+    case 38400:   return B38400;
+    case 57600:   return B57600;
+    case 115200:  return B115200;
+    case 230400:  return B230400;
+#ifdef B460800
+    case 460800:  return B460800;
+#endif
+#ifdef B500000
+    case 500000:  return B500000;
+#endif
+#ifdef B1000000
+    case 1000000: return B1000000;
+#endif
+    default:      return B0;
+  }
+}
+
+DiscobusDataPosix::DiscobusDataPosix(const char *_device,
+                                     ModemLine _deLine,
+                                     ModemLine _signalLine,
+                                     uint8_t _signalInverted) {
+  device = _device;
+  deLine = _deLine;
+  signalLine = _signalLine;
+  signalInverted = _signalInverted;
+
+  fd = -1;
+  signalFd = -1;
+  deAsserted = false;
+  deReleasePending = false;
+  lastSignal = false;
+  capture = NULL;
+  byteNs = 0;
+  idleAt = 0;
+  txLen = 0;
+  rxPos = 0;
+  rxLen = 0;
+}
+
+DiscobusDataPosix::~DiscobusDataPosix() {
+  if (fd >= 0) {
+    flush();
+    close(fd);
+  }
+  if (signalFd >= 0) {
+    close(signalFd);
+  }
+}
+
+void DiscobusDataPosix::begin(uint32_t baud) {
+  // Don't wait for carrier detect while opening
+  fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    perror(device);
+    return;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+  struct termios tio;
+  if (tcgetattr(fd, &tio) < 0) {
+    perror(device);
+    close(fd);
+    fd = -1;
+    return;
+  }
+
+  // 8N1, no flow control, reads never block
+  cfmakeraw(&tio);
+  tio.c_cflag |= CLOCAL | CREAD;
+  tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+
+  speed_t speed = standardBaud(baud);
+  if (speed != B0) {
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+  }
+
+  if (tcsetattr(fd, TCSANOW, &tio) < 0 || (speed == B0 && !setCustomBaud(fd, baud))) {
+    fprintf(stderr, "%s: can't set %u baud\n", device, baud);
+    close(fd);
+    fd = -1;
+    return;
+  }
+
+  // Make sure the modem lines we were given exist (a pty doesn't have any)
+  int status;
+  if ((deLine != LINE_NONE || signalLine != LINE_NONE) && ioctl(fd, TIOCMGET, &status) < 0) {
+    fprintf(stderr, "%s: no modem control lines (%s)\n", device, strerror(errno));
+    close(fd);
+    fd = -1;
+    return;
+  }
+
+  // Start and stop bits
+  byteNs = (10ULL * 1000000000ULL + baud / 2) / baud;
+  idleAt = monotonicNs();
+
+  setModemLine(deLine, false);
+  tcflush(fd, TCIOFLUSH);
+}
+
+uint8_t DiscobusDataPosix::isOpen() {
+  return fd >= 0;
+}
+
+uint8_t DiscobusDataPosix::available() {
+  releaseDE();
+  if (rxPos == rxLen) {
+    receive();
+  }
+  uint16_t count = rxLen - rxPos;
+  return (count > 255) ? 255 : count;
+}
+
+uint8_t DiscobusDataPosix::read() {
+  if (!available()) {
+    return 0;
+  }
+  return rxBuffer[rxPos++];
+}
+
+void DiscobusDataPosix::write(uint8_t b) {
+  if (txLen == sizeof(txBuffer)) {
+    sendBuffer();
+  }
+  txBuffer[txLen++] = b;
+}
+
+void DiscobusDataPosix::writeBytes(const uint8_t *data, uint32_t len) {
+  while (len) {
+    if (txLen == sizeof(txBuffer)) {
+      sendBuffer();
+    }
+    uint32_t n = sizeof(txBuffer) - txLen;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(&txBuffer[txLen], data, n);
+    txLen += n;
+    data += n;
+    len -= n;
+  }
+}
+
+uint8_t DiscobusDataPosix::read(uint8_t *buff, uint8_t max, uint16_t *crc) {
+  uint8_t n = available();
+  if (n > max) {
+    n = max;
+  }
+  memcpy(buff, &rxBuffer[rxPos], n);
+  rxPos += n;
+  if (crc) {
+    *crc = crc16(*crc, buff, n);
+  }
+  return n;
+}
+
+void DiscobusDataPosix::write(const uint8_t *data, uint16_t len, uint16_t *crc) {
+  writeBytes(data, len);
+  if (crc) {
+    *crc = crc16(*crc, data, len);
+  }
+}
+
+void DiscobusDataPosix::flush() {
+  sendBuffer();
+  if (fd >= 0) {
+    tcdrain(fd);
+  }
+  releaseDE();
+}
+
+void DiscobusDataPosix::clear() {
+  rxPos = 0;
+  rxLen = 0;
+  if (fd >= 0) {
+    tcflush(fd, TCIFLUSH);
+  }
+}
+
+void DiscobusDataPosix::enable_write() {
+  deReleasePending = false;
+  if (!deAsserted) {
+    setModemLine(deLine, true);
+    deAsserted = true;
+    if (capture) {
+      capture->record(CAPTURE_DE, 1);
+    }
+  }
+}
+
+void DiscobusDataPosix::enable_read() {
+  sendBuffer();
+  deReleasePending = deAsserted;
+}
+
+uint8_t DiscobusDataPosix::setSignalFile(const char *path) {
+  signalFd = open(path, O_RDONLY);
+  if (signalFd < 0) {
+    perror(path);
+    return 0;
+  }
+  return 1;
+}
+
+void DiscobusDataPosix::setCapture(CaptureWriter *_capture) {
+  capture = _capture;
+}
+
+void DiscobusDataPosix::mark(uint8_t code) {
+  if (capture) {
+    capture->record(CAPTURE_MARK, code);
+  }
+}
+
+uint8_t DiscobusDataPosix::hasSignalLine() {
+  return signalLine != LINE_NONE || signalFd >= 0;
+}
+
+uint8_t DiscobusDataPosix::isSignalEnabled() {
+  uint8_t enabled = 0;
+  int status = 0;
+
+  if (signalFd >= 0) {
+    char level = '0';
+    enabled = pread(signalFd, &level, 1, 0) == 1 && level == '1';
+  }
+  else if (fd >= 0 && signalLine != LINE_NONE && ioctl(fd, TIOCMGET, &status) == 0) {
+    uint8_t asserted = (status & modemBit(signalLine)) != 0;
+    enabled = asserted != signalInverted;
+  }
+
+  if (capture && enabled != lastSignal) {
+    capture->record(CAPTURE_SIGNAL, enabled);
+  }
+  lastSignal = enabled;
+  return enabled;
+}
+
+void DiscobusDataPosix::waitAfterWrite(uint32_t us) {
+  sendBuffer();
+  sleepUntil(idleAt + us * 1000ULL);
+}
+
+uint8_t DiscobusDataPosix::parseModemLine(const char *name, ModemLine *line) {
+  static const char *names[] = { "none", "rts", "dtr", "cts", "dsr", "dcd", "ri" };
+  for (uint8_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcasecmp(name, names[i]) == 0) {
+      *line = (ModemLine)i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void DiscobusDataPosix::sendBuffer() {
+  if (fd < 0 || txLen == 0) {
+    txLen = 0;
+    return;
+  }
+
+  // The bytes start going out once the ones before them have
+  uint64_t now = monotonicNs();
+  if (idleAt < now) {
+    idleAt = now;
+  }
+  if (capture) {
+    for (uint16_t i = 0; i < txLen; i++) {
+      capture->record(CAPTURE_TX, txBuffer[i], idleAt + (i + 1) * byteNs);
+    }
+  }
+  idleAt += txLen * byteNs;
+
+  uint16_t sent = 0;
+  while (sent < txLen) {
+    ssize_t n = ::write(fd, &txBuffer[sent], txLen - sent);
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      perror(device);
+      break;
+    }
+    sent += n;
+  }
+  txLen = 0;
+}
+
+void DiscobusDataPosix::receive() {
+  rxPos = 0;
+  rxLen = 0;
+  if (fd < 0) return;
+
+  ssize_t n = ::read(fd, rxBuffer, sizeof(rxBuffer));
+  if (n > 0) {
+    rxLen = n;
+    if (capture) {
+      for (uint16_t i = 0; i < rxLen; i++) {
+        capture->record(CAPTURE_RX, rxBuffer[i]);
+      }
+    }
+  }
+}
+
+void DiscobusDataPosix::setModemLine(ModemLine line, uint8_t value) {
+  int bit = modemBit(line);
+  if (fd < 0 || bit == 0) return;
+  ioctl(fd, value ? TIOCMBIS : TIOCMBIC, &bit);
+}
+
+void DiscobusDataPosix::releaseDE() {
+  if (!deReleasePending) return;
+  deReleasePending = false;
+
+  // USB adapters can still be sending after tcdrain() returns
+  sendBuffer();
+  if (fd >= 0) {
+    tcdrain(fd);
+  }
+  sleepUntil(idleAt);
+  setModemLine(deLine, false);
+  deAsserted = false;
+  if (capture) {
+    capture->record(CAPTURE_DE, 0);
+  }
+}
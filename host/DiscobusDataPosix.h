@@ -0,0 +1,142 @@
+#ifndef DiscobusDataPosix_H
+#define DiscobusDataPosix_H
+
+/************************************************************************************
+ *  Connects the DiscoBus library to a serial port on a POSIX host (for example
+ *  a USB to RS485 adapter), so DiscobusMaster can drive the bus from a PC.
+ *
+ *  The RS485 driver enable (DE) and the bootloader's signal line are optional,
+ *  and can each be wired to one of the port's modem control lines. Adapters
+ *  that switch direction on their own don't need a DE line.
+ *
+ *  Bytes are buffered and handed to the kernel at the end of each message,
+ *  and the time each byte will leave the wire is tracked from the baud rate.
+ *  So the caller can pace messages without relying on tcdrain(), which only
+ *  knows about the kernel's buffer.
+ *
+ ************************************************************************************/
+
+#include <stdint.h>
+#include "Capture.h"
+#include "DiscobusData.h"
+
+class DiscobusDataPosix : public DiscobusData {
+public:
+  enum ModemLine {
+    LINE_NONE,
+    LINE_RTS,  // outputs
+    LINE_DTR,
+    LINE_CTS,  // inputs
+    LINE_DSR,
+    LINE_DCD,
+    LINE_RI
+  };
+
+  // `deLine` must be an output and `signalLine` an input (or LINE_NONE).
+  // Set `signalInverted` if the line reads as asserted when the signal line is high.
+  DiscobusDataPosix(const char *device,
+                    ModemLine deLine=LINE_NONE,
+                    ModemLine signalLine=LINE_NONE,
+                    uint8_t signalInverted=false);
+  ~DiscobusDataPosix();
+
+  // Open the port in raw mode at `baud` (any rate the driver supports)
+  void begin(uint32_t baud);
+
+  // Did begin() succeed
+  uint8_t isOpen();
+
+  // How many bytes are available to read
+  uint8_t available();
+
+  // Read a byte (0 if none are available)
+  uint8_t read();
+
+  // Queue a byte to send
+  void write(uint8_t);
+
+  // Queue several bytes to send
+  void writeBytes(const uint8_t *data, uint32_t len);
+
+  // Read or queue several bytes at once (see DiscobusData.h)
+  uint8_t read(uint8_t *buff, uint8_t max, uint16_t *crc=0);
+  void write(const uint8_t *data, uint16_t len, uint16_t *crc=0);
+
+  // Send everything queued and wait for the kernel to finish transmitting it
+  void flush();
+
+  // Throw away everything received so far
+  void clear();
+
+  // Assert DE
+  void enable_write();
+
+  // Hand the queued bytes to the kernel. DE is released the next time
+  // we flush or read, so a message isn't broken up by the calls in DiscobusMaster.
+  void enable_read();
+
+  // Read the signal line from a file instead of a modem control line. The file
+  // holds '1' while the line is enabled (see --bridge in sim/multidrop_sim.c).
+  // Returns 0 if the file can't be opened.
+  uint8_t setSignalFile(const char *path);
+
+  // Record everything sent and received, DE and the signal line to a capture
+  // (see Capture.h). Pass NULL to stop.
+  void setCapture(CaptureWriter *capture);
+
+  // Add a marker to the capture (CAPTURE_MARK_*)
+  void mark(uint8_t code);
+
+  // Can we read the signal line
+  uint8_t hasSignalLine();
+
+  // Is a node holding the signal line low
+  uint8_t isSignalEnabled();
+
+  // Hand the queued bytes to the kernel, then sleep until `us` microseconds
+  // after the last of them will have left the wire
+  void waitAfterWrite(uint32_t us);
+
+  // Parse a modem line name ("none", "rts", "dtr", "cts", "dsr", "dcd" or "ri").
+  // Returns 0 if the name isn't valid.
+  static uint8_t parseModemLine(const char *name, ModemLine *line);
+
+private:
+  const char *device;
+  int fd,
+      signalFd;
+
+  ModemLine deLine,
+            signalLine;
+  uint8_t signalInverted,
+          deAsserted,
+          deReleasePending,
+          lastSignal;
+
+  CaptureWriter *capture;
+
+  // Nanoseconds to send one byte, and when the line will be idle (CLOCK_MONOTONIC)
+  uint64_t byteNs,
+           idleAt;
+
+  uint8_t txBuffer[256];
+  uint16_t txLen;
+
+  uint8_t rxBuffer[256];
+  uint16_t rxPos,
+           rxLen;
+
+  // Write the TX buffer out to the kernel
+  void sendBuffer();
+
+  // Fill the RX buffer with whatever the kernel has received
+  void receive();
+
+  // Set or clear an output modem line
+  void setModemLine(ModemLine line, uint8_t value);
+
+  // Release DE once everything has been transmitted
+  void releaseDE();
+};
+
+#endif
@@ -0,0 +1,60 @@
+
+#include <string.h>
+
+#include "Crc16.h"
+#include "Discobus.h"
+#include "FrameEncoder.h"
+
+// Copy bytes into the frame, escaping FRAME_END and FRAME_ESC
+static uint32_t putEscaped(uint8_t *out, const uint8_t *data, uint32_t len) {
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < len; i++) {
+    uint8_t b = data[i];
+    if (b == FRAME_END) {
+      out[n++] = FRAME_ESC;
+      out[n++] = FRAME_ESC_END;
+    }
+    else if (b == FRAME_ESC) {
+      out[n++] = FRAME_ESC;
+      out[n++] = FRAME_ESC_ESC;
+    }
+    else {
+      out[n++] = b;
+    }
+  }
+  return n;
+}
+
+static uint32_t put(uint8_t *out, const uint8_t *data, uint32_t len, uint8_t escaped) {
+  if (escaped) {
+    return putEscaped(out, data, len);
+  }
+  if (len) {
+    memcpy(out, data, len);
+  }
+  return len;
+}
+
+uint32_t encodeFrame(uint8_t *out, uint8_t command, const uint8_t *data, uint8_t len, uint8_t escaped) {
+  uint32_t n = 0;
+  uint8_t flags = Discobus::BATCH_FLAG;
+
+  if (escaped) {
+    out[n++] = FRAME_END;
+    flags |= Discobus::ESCAPED_FLAG;
+  } else {
+    out[n++] = 0xFF;
+    out[n++] = 0xFF;
+  }
+
+  uint8_t header[5] = { flags, Discobus::BROADCAST_ADDRESS, command, 1, len };
+  uint16_t crc = crc16(~0, header, sizeof(header));
+  crc = crc16(crc, data, len);
+
+  n += put(out + n, header, sizeof(header), escaped);
+  n += put(out + n, data, len, escaped);
+
+  uint8_t crcBytes[2] = { (uint8_t)(crc >> 8), (uint8_t)(crc & 0xFF) };
+  n += put(out + n, crcBytes, sizeof(crcBytes), escaped);
+  return n;
+}
@@ -0,0 +1,23 @@
+#ifndef FrameEncoder_H
+#define FrameEncoder_H
+
+/************************************************************************************
+ *  Encodes bootloader messages straight into a buffer, byte for byte the same
+ *  as DiscobusMaster frames a broadcast batch message to one node, but with the
+ *  CRC worked out over the whole message at once (see Crc16.h).
+ *
+ ************************************************************************************/
+
+#include <stdint.h>
+
+// SOM + header (flags, address, command, nodes in batch, length) + CRC
+#define FRAME_OVERHEAD 9
+
+// Largest frame encodeFrame() will write (every byte escaped)
+#define FRAME_MAX (2 * (FRAME_OVERHEAD + 255))
+
+// Encode a message into `out` (at least FRAME_MAX bytes) and return the number of bytes.
+// `escaped` selects the escaped framing (ESCAPED_FRAMING in config.h).
+uint32_t encodeFrame(uint8_t *out, uint8_t command, const uint8_t *data, uint8_t len, uint8_t escaped);
+
+#endif
@@ -0,0 +1,214 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Image.h"
+
+// Largest program we'll load
+#define IMAGE_MAX (256UL * 1024)
+
+// ELF program header values
+#define ELF_PT_LOAD 1
+
+// AVR toolchains put RAM (.data's run address) and EEPROM above this in the
+// ELF address space. Flash is below it.
+#define ELF_AVR_FLASH_END 0x800000UL
+
+static int hexValue(const char *hex, const char *end) {
+  int value = 0;
+  if (end - hex < 2) {
+    return -1;
+  }
+  for (uint8_t i = 0; i < 2; i++) {
+    char c = hex[i];
+    value <<= 4;
+    if (c >= '0' && c <= '9') value |= c - '0';
+    else if (c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+    else if (c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+    else return -1;
+  }
+  return value;
+}
+
+// Copy bytes into the image at `address`, growing it as needed
+static uint8_t placeBytes(const char *path, std::vector<uint8_t> &image,
+                          uint32_t address, const uint8_t *data, uint32_t len) {
+  if (address + len > IMAGE_MAX || address + len < address) {
+    fprintf(stderr, "%s: address 0x%X is past %lu KB\n", path, address + len, IMAGE_MAX / 1024);
+    return 0;
+  }
+  if (image.size() < address + len) {
+    image.resize(address + len, 0xFF);
+  }
+  memcpy(&image[address], data, len);
+  return 1;
+}
+
+static uint8_t loadHex(const char *path, const char *text, size_t size, std::vector<uint8_t> &image) {
+  const char *end = text + size;
+  uint32_t base = 0;
+  uint32_t lineNum = 0;
+
+  for (const char *line = text; line < end; ) {
+    const char *next = (const char*)memchr(line, '\n', end - line);
+    next = next ? next + 1 : end;
+    lineNum++;
+
+    if (line[0] != ':') {
+      line = next;
+      continue;
+    }
+
+    // Record bytes: length, address (2), type, data..., checksum
+    uint8_t record[260];
+    uint16_t count = 0;
+    const char *hex = line + 1;
+    int value;
+    while ((value = hexValue(hex, next)) >= 0 && count < sizeof(record)) {
+      record[count++] = value;
+      hex += 2;
+    }
+    line = next;
+
+    uint8_t sum = 0;
+    for (uint16_t i = 0; i < count; i++) {
+      sum += record[i];
+    }
+    if (count < 5 || count != record[0] + 5 || sum != 0) {
+      fprintf(stderr, "%s:%u: invalid record\n", path, lineNum);
+      return 0;
+    }
+
+    uint8_t len = record[0];
+    uint16_t address = (record[1] << 8) | record[2];
+    uint8_t type = record[3];
+    const uint8_t *data = &record[4];
+
+    // Data
+    if (type == 0x00) {
+      if (!placeBytes(path, image, base + address, data, len)) {
+        return 0;
+      }
+    }
+    // End of file
+    else if (type == 0x01) {
+      break;
+    }
+    // Extended segment address
+    else if (type == 0x02 && len == 2) {
+      base = ((data[0] << 8) | data[1]) << 4;
+    }
+    // Extended linear address
+    else if (type == 0x04 && len == 2) {
+      base = ((data[0] << 8) | data[1]) << 16;
+    }
+    // Start addresses don't matter to a bootloader
+  }
+  return 1;
+}
+
+static uint32_t le32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t le16(const uint8_t *p) {
+  return p[0] | (p[1] << 8);
+}
+
+// The flash contents of a 32-bit little endian ELF file (what avr-gcc links),
+// taken from its loadable segments at their load addresses
+static uint8_t loadElf(const char *path, const uint8_t *file, size_t size, std::vector<uint8_t> &image) {
+  if (size < 52 || file[4] != 1 || file[5] != 1) {
+    fprintf(stderr, "%s: not a 32-bit little endian ELF file\n", path);
+    return 0;
+  }
+
+  uint32_t phoff = le32(file + 28);
+  uint16_t phentsize = le16(file + 42);
+  uint16_t phnum = le16(file + 44);
+  if (phentsize < 32 || phoff + (uint64_t)phentsize * phnum > size) {
+    fprintf(stderr, "%s: invalid program headers\n", path);
+    return 0;
+  }
+
+  for (uint16_t i = 0; i < phnum; i++) {
+    const uint8_t *ph = file + phoff + i * phentsize;
+    uint32_t type = le32(ph);
+    uint32_t offset = le32(ph + 4);
+    uint32_t paddr = le32(ph + 12);
+    uint32_t filesz = le32(ph + 16);
+
+    if (type != ELF_PT_LOAD || filesz == 0 || paddr >= ELF_AVR_FLASH_END) {
+      continue;
+    }
+    if ((uint64_t)offset + filesz > size) {
+      fprintf(stderr, "%s: segment %u is past the end of the file\n", path, i);
+      return 0;
+    }
+    if (!placeBytes(path, image, paddr, file + offset, filesz)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+uint8_t loadImage(const char *path, std::vector<uint8_t> &image) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    perror(path);
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror(path);
+    close(fd);
+    return 0;
+  }
+
+  image.clear();
+
+  // Parse the file straight out of the page cache
+  size_t size = st.st_size;
+  const uint8_t *file = NULL;
+  if (size > 0) {
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      perror(path);
+      close(fd);
+      return 0;
+    }
+    file = (const uint8_t*)map;
+  }
+  close(fd);
+
+  uint8_t ok = 1;
+  const char *ext = strrchr(path, '.');
+  if (size >= 4 && memcmp(file, "\x7f" "ELF", 4) == 0) {
+    ok = loadElf(path, file, size, image);
+  }
+  else if (ext && strcasecmp(ext, ".hex") == 0) {
+    ok = loadHex(path, (const char*)file, size, image);
+  }
+  else if (size > IMAGE_MAX) {
+    fprintf(stderr, "%s: larger than %lu KB\n", path, IMAGE_MAX / 1024);
+    ok = 0;
+  }
+  else if (size > 0) {
+    image.assign(file, file + size);
+  }
+
+  if (file) {
+    munmap((void*)file, size);
+  }
+
+  if (ok && image.empty()) {
+    fprintf(stderr, "%s: empty program\n", path);
+    ok = 0;
+  }
+  return ok;
+}
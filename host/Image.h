@@ -0,0 +1,13 @@
+#ifndef Image_H
+#define Image_H
+
+#include <stdint.h>
+#include <vector>
+
+// Load a program from an ELF file (what avr-gcc links), an Intel HEX file (*.hex)
+// or a raw binary (anything else). The file is memory mapped and parsed in place.
+// Gaps are filled with 0xFF, which is what erased flash reads as.
+// Returns 0, after printing why, if the file can't be read.
+uint8_t loadImage(const char *path, std::vector<uint8_t> &image);
+
+#endif
@@ -0,0 +1,115 @@
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "digest.h"
+#include "FrameEncoder.h"
+#include "ImageFrames.h"
+#include "MultidropProgrammer.h"
+#include "PagePlanner.h"
+
+// Add an encoded message to the end of `bytes`
+static void appendFrame(std::vector<uint8_t> &bytes, uint8_t command,
+                        const uint8_t *data, uint8_t len, uint8_t escaped) {
+  uint8_t frame[FRAME_MAX];
+  uint32_t n = encodeFrame(frame, command, data, len, escaped);
+  bytes.insert(bytes.end(), frame, frame + n);
+}
+
+ImageFrames::ImageFrames() {
+  frames = NULL;
+  mapSize = 0;
+  pages = 0;
+}
+
+ImageFrames::~ImageFrames() {
+  if (frames) {
+    munmap(frames, mapSize);
+  }
+}
+
+uint8_t ImageFrames::encode(const std::vector<uint8_t> &image, uint16_t pageSize, uint8_t escaped) {
+  uint32_t count = (image.size() + pageSize - 1) / pageSize;
+  if (image.empty() || count > 255 || pageSize == 0 || pageSize > 255) {
+    return 0;
+  }
+  pages = count;
+
+  std::vector<uint8_t> bytes;
+  bytes.reserve(image.size() + (pages + 1) * 2 * FRAME_OVERHEAD);
+
+  // Unused flash is erased
+  std::vector<uint8_t> padded(image);
+  padded.resize(pages * pageSize, 0xFF);
+
+  uint32_t hash = digestImage(&padded[0], padded.size());
+  uint8_t startData[IMAGE_DIGEST_LEN + 1];
+  for (uint8_t i = 0; i < IMAGE_DIGEST_LEN; i++) {
+    startData[i] = hash >> (i * 8);
+  }
+  startData[IMAGE_DIGEST_LEN] = pages;
+
+  offsets.clear();
+  offsets.push_back(0);
+  appendFrame(bytes, MSG_CMD_PROG_START, startData, sizeof(startData), escaped);
+
+  for (uint16_t page = 0; page < pages; page++) {
+    uint32_t offset = page * pageSize;
+    uint32_t len = image.size() - offset;
+    if (len > pageSize) {
+      len = pageSize;
+    }
+
+    offsets.push_back(bytes.size());
+    uint8_t pageNum = page;
+    appendFrame(bytes, MSG_CMD_PAGE_NUM, &pageNum, 1, escaped);
+
+    // Nodes fill in the erased bytes at the end of the page
+    len = pageSendLength(&image[offset], len);
+    appendFrame(bytes, MSG_CMD_PAGE_DATA, &image[offset], len, escaped);
+  }
+
+  offsets.push_back(bytes.size());
+  appendFrame(bytes, MSG_CMD_PROG_END, NULL, 0, escaped);
+  offsets.push_back(bytes.size());
+
+  // Copy it into a read-only mapping
+  if (frames) {
+    munmap(frames, mapSize);
+    frames = NULL;
+  }
+  mapSize = bytes.size();
+  void *map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    return 0;
+  }
+  memcpy(map, &bytes[0], mapSize);
+  mprotect(map, mapSize, PROT_READ);
+  frames = (uint8_t*)map;
+  return 1;
+}
+
+uint16_t ImageFrames::pageCount() const {
+  return pages;
+}
+
+const uint8_t* ImageFrames::message(uint32_t index, uint32_t *len) const {
+  *len = offsets[index + 1] - offsets[index];
+  return frames + offsets[index];
+}
+
+const uint8_t* ImageFrames::start(uint32_t *len) const {
+  return message(0, len);
+}
+
+const uint8_t* ImageFrames::page(uint16_t num, uint32_t *len) const {
+  return message(num + 1, len);
+}
+
+const uint8_t* ImageFrames::end(uint32_t *len) const {
+  return message(pages + 1, len);
+}
+
+size_t ImageFrames::size() const {
+  return mapSize;
+}
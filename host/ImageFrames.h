@@ -0,0 +1,56 @@
+#ifndef ImageFrames_H
+#define ImageFrames_H
+
+/************************************************************************************
+ *  Every bootloader message for one image, encoded once up front.
+ *
+ *  The messages live in a read-only memory mapping, so any number of bus
+ *  workers can send from the same copy at once. Retransmissions just send the
+ *  same bytes again instead of encoding (and CRCing) the page again.
+ *
+ ************************************************************************************/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class ImageFrames {
+public:
+  ImageFrames();
+  ~ImageFrames();
+
+  // Encode the messages for `image`, split into `pageSize` pages.
+  // Returns 0 if the image is empty, has too many pages, or the memory can't be mapped.
+  uint8_t encode(const std::vector<uint8_t> &image, uint16_t pageSize, uint8_t escaped);
+
+  // Number of pages in the image
+  uint16_t pageCount() const;
+
+  // The START message (digest and page count)
+  const uint8_t* start(uint32_t *len) const;
+
+  // The PAGE_NUM and PAGE_DATA messages for a page
+  const uint8_t* page(uint16_t num, uint32_t *len) const;
+
+  // The END message
+  const uint8_t* end(uint32_t *len) const;
+
+  // Total bytes of all the messages
+  size_t size() const;
+
+private:
+  uint8_t *frames;
+  size_t mapSize;
+  uint16_t pages;
+
+  // Where each message starts: START, each page, END, then the total size
+  std::vector<uint32_t> offsets;
+
+  const uint8_t* message(uint32_t index, uint32_t *len) const;
+
+  // Not copyable, the mapping belongs to one object
+  ImageFrames(const ImageFrames&);
+  ImageFrames& operator=(const ImageFrames&);
+};
+
+#endif
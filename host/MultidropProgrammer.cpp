@@ -0,0 +1,202 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ImageFrames.h"
+#include "MultidropProgrammer.h"
+
+static double monotonicSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+MultidropProgrammer::MultidropProgrammer(DiscobusDataPosix *_bus, const ProgrammerSettings &_settings)
+  : bus(_bus), master(_bus), settings(_settings) {
+
+  // Bootloader messages are sent to a batch of one node
+  master.setNodeLength(1);
+  master.setEscapedFraming(settings.escaped);
+  memset(&stats, 0, sizeof(stats));
+  progressPage = 0;
+  progressRound = 0;
+}
+
+void MultidropProgrammer::defaultSettings(ProgrammerSettings *settings) {
+  settings->pageSize = 128;
+  settings->useDigest = false;
+  settings->escaped = false;
+  settings->startGapUs = 5000;
+  settings->pageGapUs = 9200;
+  settings->joinTimeoutMs = 2000;
+  settings->maxRounds = 10;
+  settings->checkpointPages = 0;
+  settings->verbose = false;
+}
+
+void MultidropProgrammer::setSettings(const ProgrammerSettings &_settings) {
+  settings = _settings;
+  master.setEscapedFraming(settings.escaped);
+}
+
+const ProgrammerSettings& MultidropProgrammer::getSettings() {
+  return settings;
+}
+
+const ProgrammerStats& MultidropProgrammer::getStats() {
+  return stats;
+}
+
+const std::vector<uint16_t>& MultidropProgrammer::getErrorPages() {
+  return errorPages;
+}
+
+void MultidropProgrammer::getProgress(uint16_t *page, uint16_t *round) {
+  *page = progressPage;
+  *round = progressRound;
+}
+
+void MultidropProgrammer::sendCommand(uint8_t command, const uint8_t *data, uint8_t len) {
+  master.startMessage(command, Discobus::BROADCAST_ADDRESS, len);
+  if (len) {
+    master.sendData((uint8_t*)data, len);
+  }
+  master.finishMessage();
+  bus->flush();
+}
+
+uint32_t MultidropProgrammer::sendFrames(const uint8_t *data, uint32_t len) {
+  bus->enable_write();
+  bus->writeBytes(data, len);
+  bus->enable_read();
+
+  stats.bytesSent += len;
+  return len;
+}
+
+void MultidropProgrammer::startSession(const ImageFrames &frames) {
+  uint32_t len;
+  const uint8_t *start = frames.start(&len);
+
+  uint32_t sent = sendFrames(start, len);
+  if (stats.rounds > 0) {
+    stats.bytesRetransmitted += sent;
+  }
+
+  // Give the nodes time to update EEPROM
+  bus->waitAfterWrite(settings.startGapUs);
+}
+
+uint8_t MultidropProgrammer::signalLine() {
+  return bus->hasSignalLine() && bus->isSignalEnabled();
+}
+
+MultidropProgrammer::result_t MultidropProgrammer::program(const ImageFrames &frames) {
+  uint16_t pages = frames.pageCount();
+  double start = monotonicSeconds();
+
+  memset(&stats, 0, sizeof(stats));
+  errorPages.clear();
+  progressPage = 0;
+  progressRound = 0;
+  bus->mark(CAPTURE_MARK_SESSION);
+
+  // Nodes enable the signal line once they're in the bootloader
+  if (bus->hasSignalLine()) {
+    double timeout = start + settings.joinTimeoutMs / 1000.0;
+    while (!signalLine()) {
+      if (monotonicSeconds() > timeout) {
+        return PROG_NO_NODES;
+      }
+      usleep(1000);
+    }
+  }
+
+  startSession(frames);
+
+  // Every node is already current
+  if (settings.useDigest && bus->hasSignalLine() && !signalLine()) {
+    stats.seconds = monotonicSeconds() - start;
+    return PROG_CURRENT;
+  }
+
+  int16_t firstError = -1;
+  uint16_t roundStart = 0;
+  uint8_t stuck = 0;
+  uint8_t errorShown = 0;  // Nodes hold the signal line until the first page, which isn't an error
+  uint16_t page = 0;
+  while (page < pages) {
+    uint32_t len;
+    const uint8_t *data = frames.page(page, &len);
+
+    progressPage = page;
+    uint32_t sent = sendFrames(data, len);
+    if (stats.rounds > 0) {
+      stats.bytesRetransmitted += sent;
+    }
+    stats.pagesSent++;
+
+    // Give the nodes time to write the page
+    bus->waitAfterWrite(settings.pageGapUs);
+    uint8_t wasClear = !errorShown;
+    errorShown = signalLine();
+    if (wasClear) {
+      stats.pagesClear++;
+      if (errorShown) {
+        stats.errors++;
+        errorPages.push_back(page);
+      }
+    }
+    if (errorShown && firstError < 0) {
+      firstError = page;
+    }
+
+    if (settings.verbose) {
+      fprintf(stderr, "\rPage %u/%u, round %u%s", page + 1, pages, stats.rounds,
+              (firstError >= 0) ? ", error" : "");
+    }
+
+    // Resend from the first error, at the end of the image or the next checkpoint
+    page++;
+    uint8_t checkpoint = page == pages ||
+                         (settings.checkpointPages && (page - roundStart) % settings.checkpointPages == 0);
+    if (checkpoint && firstError >= 0) {
+      progressRound = stats.rounds + 1;
+      if (stats.rounds++ == settings.maxRounds) {
+        stats.seconds = monotonicSeconds() - start;
+        return PROG_GAVE_UP;
+      }
+
+      // The first page of the round failed twice in a row. A node is missing
+      // the START message or earlier pages (it may have joined late), so start over.
+      stuck = (firstError == roundStart) ? stuck + 1 : 0;
+      if (stuck == 2) {
+        stats.restarts++;
+        stuck = 0;
+        bus->mark(CAPTURE_MARK_RESTART);
+        startSession(frames);
+        page = 0;
+      } else {
+        // A byte lost at the end of a page is only noticed when the next
+        // message arrives, so also resend the page before the error
+        bus->mark(CAPTURE_MARK_ROUND);
+        page = firstError ? firstError - 1 : 0;
+      }
+      roundStart = page;
+      firstError = -1;
+    }
+  }
+  if (settings.verbose) {
+    fprintf(stderr, "\n");
+  }
+
+  uint32_t len;
+  const uint8_t *end = frames.end(&len);
+  sendFrames(end, len);
+  bus->flush();
+
+  stats.seconds = monotonicSeconds() - start;
+  return PROG_DONE;
+}
@@ -0,0 +1,109 @@
+#ifndef MultidropProgrammer_H
+#define MultidropProgrammer_H
+
+/************************************************************************************
+ *  Programs every node on a bus with the bootloader protocol described in the
+ *  README (the same process as the reference programmer in sim/multidrop_sim.c).
+ *
+ *  The image's messages are encoded once (see ImageFrames.h), framed exactly as
+ *  the nodes' own DiscoBus library frames them, and can be shared by programmers
+ *  on several buses. Other commands are sent with DiscobusMaster.
+ *
+ ************************************************************************************/
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+#include "DiscobusDataPosix.h"
+#include "DiscobusMaster.h"
+
+class ImageFrames;
+
+// Bootloader commands (must match "Bus Message Commands" in config.h)
+#define MSG_CMD_PROG_START 0xF1
+#define MSG_CMD_PAGE_NUM   0xF2
+#define MSG_CMD_PAGE_DATA  0xF3
+#define MSG_CMD_PROG_END   0xF4
+
+// Digest bytes at the start of the START message (IMAGE_DIGEST_LEN in config.h)
+#define IMAGE_DIGEST_LEN 4
+
+struct ProgrammerSettings {
+  uint16_t pageSize;      // SPM_PAGESIZE of the nodes
+  uint8_t  useDigest;     // Nodes were built with USE_IMAGE_DIGEST
+  uint8_t  escaped;       // Nodes were built with ESCAPED_FRAMING (must match the ImageFrames)
+  uint32_t startGapUs;    // Wait after START (EEPROM write)
+  uint32_t pageGapUs;     // Wait after each page (flash erase + write)
+  uint32_t joinTimeoutMs; // How long to wait for the signal line before giving up
+  uint16_t maxRounds;     // Retransmission rounds before giving up
+  uint16_t checkpointPages; // Resend after this many pages if one failed (0: at the end of the image)
+  uint8_t  verbose;       // Print progress
+};
+
+struct ProgrammerStats {
+  uint32_t bytesSent,
+           bytesRetransmitted;
+  uint16_t rounds,
+           restarts;
+  uint32_t pagesSent,
+           pagesClear,  // Sent while the signal line was clear
+           errors;      // Pages the signal line came up after
+  double   seconds;
+};
+
+class MultidropProgrammer {
+public:
+  enum result_t {
+    PROG_DONE,      // Every node was programmed
+    PROG_CURRENT,   // Every node already had this image
+    PROG_NO_NODES,  // Nothing enabled the signal line
+    PROG_GAVE_UP    // Too many retransmission rounds
+  };
+
+  MultidropProgrammer(DiscobusDataPosix *bus, const ProgrammerSettings &settings);
+
+  // Fill in the default settings
+  static void defaultSettings(ProgrammerSettings *settings);
+
+  // Change the settings for the next session
+  void setSettings(const ProgrammerSettings &settings);
+
+  const ProgrammerSettings& getSettings();
+
+  // Send a single DiscoBus message, like the one that reboots nodes into the bootloader
+  void sendCommand(uint8_t command, const uint8_t *data=0, uint8_t len=0);
+
+  // Program the nodes with an encoded image
+  result_t program(const ImageFrames &frames);
+
+  const ProgrammerStats& getStats();
+
+  // Pages the signal line came up after, in the order it happened
+  const std::vector<uint16_t>& getErrorPages();
+
+  // The page being sent and the retransmission round, safe to read
+  // from another thread while program() runs
+  void getProgress(uint16_t *page, uint16_t *round);
+
+private:
+  DiscobusDataPosix *bus;
+  DiscobusMaster master;
+  ProgrammerSettings settings;
+  ProgrammerStats stats;
+  std::vector<uint16_t> errorPages;
+
+  std::atomic<uint16_t> progressPage,
+                        progressRound;
+
+  // Send encoded messages and return the number of bytes
+  uint32_t sendFrames(const uint8_t *data, uint32_t len);
+
+  // Send START and give the nodes time to update EEPROM
+  void startSession(const ImageFrames &frames);
+
+  // Is any node reporting an error (or still waiting for its first page)
+  uint8_t signalLine();
+};
+
+#endif
@@ -0,0 +1,209 @@
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unordered_map>
+
+#include "digest.h"
+#include "FrameEncoder.h"
+#include "MultidropProgrammer.h"
+#include "PagePlanner.h"
+
+uint16_t pageSendLength(const uint8_t *page, uint16_t len) {
+  while (len > 0 && page[len - 1] == 0xFF) {
+    len--;
+  }
+  return len;
+}
+
+uint64_t pageDigest(const uint8_t *page, uint16_t len, uint16_t pageSize) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (uint16_t i = 0; i < pageSize; i++) {
+    uint8_t b = (i < len) ? page[i] : 0xFF;
+    hash = (hash ^ b) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+PageDigestCache::PageDigestCache() {
+}
+
+uint8_t PageDigestCache::load(const char *path) {
+  entries.clear();
+
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    if (errno == ENOENT) {
+      return 1;
+    }
+    perror(path);
+    return 0;
+  }
+
+  char *line = NULL;
+  size_t lineSize = 0;
+  uint32_t lineNum = 0;
+  uint8_t ok = 1;
+  while (getline(&line, &lineSize, file) > 0) {
+    lineNum++;
+    if (line[0] == '#' || line[0] == '\n') {
+      continue;
+    }
+
+    char *pos = line, *next;
+    Entry entry;
+    entry.imageDigest = strtoul(pos, &next, 16);
+    entry.pageSize = (next != pos) ? strtoul(pos = next, &next, 10) : 0;
+    if (next == pos || entry.pageSize == 0) {
+      fprintf(stderr, "%s:%u: invalid entry\n", path, lineNum);
+      ok = 0;
+      break;
+    }
+
+    while (true) {
+      pos = next;
+      uint64_t digest = strtoull(pos, &next, 16);
+      if (next == pos) {
+        break;
+      }
+      entry.pages.push_back(digest);
+    }
+    entries.push_back(entry);
+  }
+
+  free(line);
+  fclose(file);
+  return ok;
+}
+
+uint8_t PageDigestCache::save(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    perror(path);
+    return 0;
+  }
+
+  fprintf(file, "# Page digests of deployed images (see host/PagePlanner.h)\n");
+  for (size_t i = 0; i < entries.size(); i++) {
+    const Entry &entry = entries[i];
+    fprintf(file, "%08X %u", entry.imageDigest, entry.pageSize);
+    for (size_t p = 0; p < entry.pages.size(); p++) {
+      fprintf(file, " %016" PRIX64, entry.pages[p]);
+    }
+    fprintf(file, "\n");
+  }
+
+  if (fclose(file) != 0) {
+    perror(path);
+    return 0;
+  }
+  return 1;
+}
+
+const std::vector<uint64_t>* PageDigestCache::find(uint32_t imageDigest, uint16_t pageSize) const {
+  for (size_t i = entries.size(); i-- > 0; ) {
+    if (entries[i].imageDigest == imageDigest && entries[i].pageSize == pageSize) {
+      return &entries[i].pages;
+    }
+  }
+  return NULL;
+}
+
+void PageDigestCache::add(uint32_t imageDigest, uint16_t pageSize, const std::vector<uint64_t> &pages) {
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (entries[i].imageDigest == imageDigest && entries[i].pageSize == pageSize) {
+      entries.erase(entries.begin() + i);
+      break;
+    }
+  }
+
+  Entry entry;
+  entry.imageDigest = imageDigest;
+  entry.pageSize = pageSize;
+  entry.pages = pages;
+  entries.push_back(entry);
+}
+
+uint8_t PageDigestCache::latest(uint32_t *imageDigest, uint16_t *pageSize) const {
+  if (entries.empty()) {
+    return 0;
+  }
+  *imageDigest = entries.back().imageDigest;
+  *pageSize = entries.back().pageSize;
+  return 1;
+}
+
+void PagePlan::plan(const std::vector<uint8_t> &image, uint16_t _pageSize, uint8_t escaped,
+                    const std::vector<uint64_t> *base) {
+  uint32_t count = (image.size() + _pageSize - 1) / _pageSize;
+  uint8_t frame[FRAME_MAX];
+  uint8_t pageNum = 0;
+
+  pageSize = _pageSize;
+  pages.resize(count);
+  pageDigests.resize(count);
+  blankPages = 0;
+  duplicatePages = 0;
+  unchangedPages = 0;
+
+  // The digest covers the padded image
+  std::vector<uint8_t> padded(image);
+  padded.resize(count * pageSize, 0xFF);
+  imageDigest = digestImage(padded.data(), padded.size());
+
+  // START and END
+  uint8_t startData[IMAGE_DIGEST_LEN + 1];
+  for (uint8_t i = 0; i < IMAGE_DIGEST_LEN; i++) {
+    startData[i] = imageDigest >> (i * 8);
+  }
+  startData[IMAGE_DIGEST_LEN] = count;
+  wireBytes = encodeFrame(frame, MSG_CMD_PROG_START, startData, sizeof(startData), escaped);
+  wireBytes += encodeFrame(frame, MSG_CMD_PROG_END, NULL, 0, escaped);
+  fullWireBytes = wireBytes;
+
+  std::unordered_map<uint64_t, uint32_t> seen;
+  seen.reserve(count);
+
+  for (uint32_t page = 0; page < count; page++) {
+    const uint8_t *data = &padded[page * pageSize];
+    uint32_t len = image.size() - page * pageSize;
+    if (len > pageSize) {
+      len = pageSize;
+    }
+
+    PagePlanEntry &entry = pages[page];
+    entry.digest = pageDigest(data, len, pageSize);
+    entry.sendLen = pageSendLength(data, len);
+    entry.sameAs = -1;
+    entry.unchanged = base && page < base->size() && (*base)[page] == entry.digest;
+    pageDigests[page] = entry.digest;
+
+    if (entry.sendLen == 0) {
+      entry.kind = PagePlanEntry::PAGE_BLANK;
+      blankPages++;
+    }
+    else {
+      // A matching digest is checked byte for byte
+      std::unordered_map<uint64_t, uint32_t>::iterator it = seen.find(entry.digest);
+      if (it != seen.end() && memcmp(data, &padded[it->second * pageSize], pageSize) == 0) {
+        entry.kind = PagePlanEntry::PAGE_DUPLICATE;
+        entry.sameAs = it->second;
+        duplicatePages++;
+      } else {
+        entry.kind = PagePlanEntry::PAGE_DATA;
+        seen[entry.digest] = page;
+      }
+    }
+    if (entry.unchanged) {
+      unchangedPages++;
+    }
+
+    // PAGE_NUM and PAGE_DATA
+    pageNum = page;
+    uint32_t numBytes = encodeFrame(frame, MSG_CMD_PAGE_NUM, &pageNum, 1, escaped);
+    wireBytes += numBytes + encodeFrame(frame, MSG_CMD_PAGE_DATA, data, entry.sendLen, escaped);
+    fullWireBytes += numBytes + encodeFrame(frame, MSG_CMD_PAGE_DATA, data, len, escaped);
+  }
+}
@@ -0,0 +1,100 @@
+#ifndef PagePlanner_H
+#define PagePlanner_H
+
+/************************************************************************************
+ *  Looks at an image page by page before it's sent.
+ *
+ *  Nodes fill the end of a short PAGE_DATA message with 0xFF, so the erased
+ *  bytes at the end of each page don't need to go on the wire, and a blank
+ *  page is just an empty message. That's the saving ImageFrames makes.
+ *
+ *  The plan also finds pages that repeat an earlier page, and pages that are
+ *  the same as in a previously deployed image (from a PageDigestCache). The
+ *  bootloader has to receive every page in order, so these are still sent,
+ *  but the plan reports how much of the image they are.
+ *
+ ************************************************************************************/
+
+#include <stdint.h>
+#include <vector>
+
+// Bytes of a page to send: everything up to the last byte that isn't 0xFF
+uint16_t pageSendLength(const uint8_t *page, uint16_t len);
+
+// 64-bit FNV-1a of a page, padded with 0xFF to `pageSize`
+uint64_t pageDigest(const uint8_t *page, uint16_t len, uint16_t pageSize);
+
+/**
+ * Page digests of deployed images, keyed by the image digest sent in START.
+ * Stored as a text file, one image per line:
+ *
+ *   IMAGE_DIGEST PAGE_SIZE PAGE_DIGEST...
+ *
+ * The last line is the most recently deployed image.
+ */
+class PageDigestCache {
+public:
+  PageDigestCache();
+
+  // Read the cache file. A file that doesn't exist yet is an empty cache.
+  // Returns 0 if it can't be read or isn't valid.
+  uint8_t load(const char *path);
+
+  // Write the cache file. Returns 0 if it can't be written.
+  uint8_t save(const char *path);
+
+  // Page digests of an image, or NULL if it's not in the cache
+  const std::vector<uint64_t>* find(uint32_t imageDigest, uint16_t pageSize) const;
+
+  // Add an image (or move it to the end as the latest one)
+  void add(uint32_t imageDigest, uint16_t pageSize, const std::vector<uint64_t> &pages);
+
+  // Digest of the most recently deployed image. Returns 0 if the cache is empty.
+  uint8_t latest(uint32_t *imageDigest, uint16_t *pageSize) const;
+
+private:
+  struct Entry {
+    uint32_t imageDigest;
+    uint16_t pageSize;
+    std::vector<uint64_t> pages;
+  };
+
+  std::vector<Entry> entries;
+};
+
+struct PagePlanEntry {
+  enum kind_t {
+    PAGE_DATA,      // Sent as is
+    PAGE_BLANK,     // All 0xFF, sent as an empty message
+    PAGE_DUPLICATE  // The same as an earlier page
+  };
+
+  kind_t   kind;
+  uint64_t digest;
+  uint16_t sendLen;    // Bytes of PAGE_DATA to send
+  int32_t  sameAs;     // The earlier page, for PAGE_DUPLICATE
+  uint8_t  unchanged;  // The same as this page in the base image
+};
+
+class PagePlan {
+public:
+  // Plan `image` split into `pageSize` pages. If `base` is set, pages are
+  // compared with the page digests of that (previously deployed) image.
+  void plan(const std::vector<uint8_t> &image, uint16_t pageSize, uint8_t escaped,
+            const std::vector<uint64_t> *base=0);
+
+  uint32_t imageDigest;  // The digest sent in START
+  uint16_t pageSize;
+  std::vector<PagePlanEntry> pages;
+  std::vector<uint64_t> pageDigests;
+
+  uint32_t blankPages,
+           duplicatePages,
+           unchangedPages;
+
+  // Bytes of every message for the image, with whole pages and as planned
+  uint32_t fullWireBytes,
+           wireBytes;
+};
+
+#endif
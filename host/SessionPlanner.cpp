@@ -0,0 +1,473 @@
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ImageFrames.h"
+#include "SessionPlanner.h"
+
+// Sessions kept in a history file
+#define HISTORY_LENGTH 200
+
+const uint16_t sessionCheckpoints[] = { 0, 1, 2, 4, 8, 16, 32 };
+const uint8_t sessionCheckpointCount = sizeof(sessionCheckpoints) / sizeof(sessionCheckpoints[0]);
+
+uint8_t SessionHistory::load(const char *path) {
+  records.clear();
+
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    if (errno == ENOENT) {
+      return 1;
+    }
+    perror(path);
+    return 0;
+  }
+
+  char *line = NULL;
+  size_t lineSize = 0;
+  uint32_t lineNum = 0;
+  uint8_t ok = 1;
+  while (getline(&line, &lineSize, file) > 0) {
+    lineNum++;
+    if (line[0] == '#' || line[0] == '\n') {
+      continue;
+    }
+
+    SessionRecord record;
+    unsigned baud, pageSize, pageGap, checkpoint, pages, sent, clear, errors, finished;
+    int used = 0;
+    if (sscanf(line, "%u %u %u %u %u %u %u %u %lf %u%n", &baud, &pageSize, &pageGap, &checkpoint,
+               &pages, &sent, &clear, &errors, &record.seconds, &finished, &used) != 10 || baud == 0) {
+      fprintf(stderr, "%s:%u: invalid session\n", path, lineNum);
+      ok = 0;
+      break;
+    }
+    record.baud = baud;
+    record.pageSize = pageSize;
+    record.pageGapUs = pageGap;
+    record.checkpointPages = checkpoint;
+    record.pages = pages;
+    record.pagesSent = sent;
+    record.pagesClear = clear;
+    record.errors = errors;
+    record.finished = finished;
+
+    char *pos = line + used, *next;
+    while (true) {
+      unsigned long page = strtoul(pos, &next, 10);
+      if (next == pos) {
+        break;
+      }
+      record.errorPages.push_back(page);
+      pos = next;
+    }
+    records.push_back(record);
+  }
+
+  free(line);
+  fclose(file);
+  return ok;
+}
+
+uint8_t SessionHistory::save(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    perror(path);
+    return 0;
+  }
+
+  fprintf(file, "# Programming sessions on this bus (see host/SessionPlanner.h)\n");
+  for (size_t i = 0; i < records.size(); i++) {
+    const SessionRecord &r = records[i];
+    fprintf(file, "%u %u %u %u %u %u %u %u %.3f %u", r.baud, r.pageSize, r.pageGapUs, r.checkpointPages,
+            r.pages, r.pagesSent, r.pagesClear, r.errors, r.seconds, r.finished);
+    for (size_t p = 0; p < r.errorPages.size(); p++) {
+      fprintf(file, " %u", r.errorPages[p]);
+    }
+    fprintf(file, "\n");
+  }
+
+  if (fclose(file) != 0) {
+    perror(path);
+    return 0;
+  }
+  return 1;
+}
+
+void SessionHistory::add(const SessionRecord &record) {
+  records.push_back(record);
+  if (records.size() > HISTORY_LENGTH) {
+    records.erase(records.begin(), records.end() - HISTORY_LENGTH);
+  }
+}
+
+// Expected cost from a state of the resend process, in terms of the cost from
+// the states with one more page left and the cost of starting over
+struct ResendCost {
+  double sent, rounds, restarts,
+         first,  // Times the cost of the first window of a round
+         stuck,  // Times the cost of the first window of a round after a stuck one
+         over;   // Times the cost of starting over
+};
+
+// `cost`, with the states it refers to put in terms of other ones
+static ResendCost substitute(const ResendCost &cost, const ResendCost &first, const ResendCost &stuck) {
+  ResendCost c;
+  c.sent = cost.sent + cost.first * first.sent + cost.stuck * stuck.sent;
+  c.rounds = cost.rounds + cost.first * first.rounds + cost.stuck * stuck.rounds;
+  c.restarts = cost.restarts + cost.first * first.restarts + cost.stuck * stuck.restarts;
+  c.first = cost.first * first.first + cost.stuck * stuck.first;
+  c.stuck = cost.first * first.stuck + cost.stuck * stuck.stuck;
+  c.over = cost.over + cost.first * first.over + cost.stuck * stuck.over;
+  return c;
+}
+
+static void addCost(ResendCost *to, const ResendCost &cost, double chance) {
+  to->sent += chance * cost.sent;
+  to->rounds += chance * cost.rounds;
+  to->restarts += chance * cost.restarts;
+  to->first += chance * cost.first;
+  to->stuck += chance * cost.stuck;
+  to->over += chance * cost.over;
+}
+
+// Without the states it refers to
+static ResendCost ownCost(const ResendCost &cost) {
+  ResendCost c = cost;
+  c.first = c.stuck = 0;
+  return c;
+}
+
+static void scaleCost(ResendCost *cost, double by) {
+  cost->sent *= by;
+  cost->rounds *= by;
+  cost->restarts *= by;
+  cost->first *= by;
+  cost->stuck *= by;
+  cost->over *= by;
+}
+
+/**
+ * Pages are sent in windows of `checkpointPages` from where the last resend
+ * started, and the signal line is checked at the end of each window. If a
+ * page in the window failed, the programmer goes back to the page before it.
+ * So with L pages left, and the first error at offset e of a W page window:
+ *
+ *   e = 0        the page before the window is sent too (L + 1 pages left,
+ *                or L at the start of the image)
+ *   e = 1        the whole window is sent again (L pages left)
+ *   e >= 2       L - e + 1 pages are left
+ *   no error     L - W pages are left
+ *
+ * Every window with an error is a round. The round is stuck if the error was
+ * on its first page, and if the round after it is stuck too, the programmer
+ * starts over from START. So there are three states for each L: the first
+ * window of a round, the same after a stuck round, and any later window.
+ *
+ * Only e = 0 goes up, and only by one, so working up from L = 1, the states
+ * at each L can be put in terms of the ones at L + 1 and the cost of starting
+ * over. With the whole image left, nothing is above, and the first window is
+ * where starting over goes, which gives the cost of the session.
+ */
+SessionCost expectedCost(const SessionModel &model, uint16_t checkpointPages) {
+  double p = model.pageErrorRate;
+  uint32_t pages = model.pages;
+  ResendCost none = { 0, 0, 0, 0, 0, 0 };
+  std::vector<ResendCost> first(pages + 1, none), stuck(pages + 1, none), later(pages + 1, none);
+
+  SessionCost cost;
+  cost.seconds = cost.pagesSent = cost.rounds = INFINITY;
+  for (uint32_t left = 1; left <= pages; left++) {
+    uint32_t window = (checkpointPages && checkpointPages < left) ? checkpointPages : left;
+    double clean = pow(1 - p, window);
+
+    // Where each state goes, other than e = 0, in terms of the states at L
+    ResendCost next = { (double)window, 1 - clean, 0, (window > 1) ? p * (1 - p) : 0, 0, 0 };
+    ResendCost throughFirst = none, throughStuck = none;
+    throughFirst.first = 1;
+    throughStuck.stuck = 1;
+    double errorAt = p * (1 - p) * (1 - p);
+    for (uint32_t e = 2; e <= window + 1; e++) {
+      uint32_t below = left - e + 1;
+      ResendCost atFirst = substitute(first[below], throughFirst, throughStuck);
+      if (e < window) {
+        addCost(&next, atFirst, errorAt);
+      } else if (e == window + 1) {
+        addCost(&next, substitute(later[below], throughFirst, throughStuck), clean);
+      }
+      throughStuck = substitute(stuck[below], throughFirst, throughStuck);
+      throughFirst = atFirst;
+      errorAt *= 1 - p;
+    }
+
+    // With e = 0, the first window goes to stuck at L + 1 (or at L at the
+    // top), stuck starts over, and a later window goes to the first at L + 1
+    ResendCost f = next, s = next, l = next;
+    s.restarts += p;
+    s.over += p;
+    double upStuck = 0, upFirst = 0;
+    if (left < pages) {
+      upStuck = upFirst = p;
+    } else {
+      f.stuck += p;
+    }
+
+    // Solve for the first window at L and then stuck, in terms of the
+    // states above and starting over
+    if (s.stuck >= 1) {
+      return cost;
+    }
+    double toStuck = 1 / (1 - s.stuck),
+           alone = 1 - f.first - f.stuck * s.first * toStuck;
+    if (alone <= 0) {
+      return cost;
+    }
+    ResendCost &firstAt = first[left], &stuckAt = stuck[left], &laterAt = later[left];
+    firstAt = ownCost(f);
+    addCost(&firstAt, ownCost(s), f.stuck * toStuck);
+    scaleCost(&firstAt, 1 / alone);
+    firstAt.stuck = upStuck / alone;
+
+    stuckAt = ownCost(s);
+    addCost(&stuckAt, firstAt, s.first);
+    scaleCost(&stuckAt, toStuck);
+
+    laterAt = ownCost(l);
+    addCost(&laterAt, firstAt, l.first);
+    addCost(&laterAt, stuckAt, l.stuck);
+    laterAt.first += upFirst;
+  }
+
+  // The session starts with the first window with every page left
+  const ResendCost &start = first[pages];
+  if (start.over >= 1) {
+    return cost;
+  }
+  double restarts = start.restarts / (1 - start.over);
+  cost.pagesSent = start.sent / (1 - start.over);
+  cost.rounds = start.rounds / (1 - start.over);
+  cost.seconds = model.startSeconds * (1 + restarts) + cost.pagesSent * model.pageSeconds;
+  return cost;
+}
+
+SessionPlanner::SessionPlanner() {
+  minPageGapUs = 0;
+  pages = 0;
+  pageWireBytes = 0;
+  startEndWireBytes = 0;
+  baud = 115200;
+  MultidropProgrammer::defaultSettings(&settings);
+}
+
+void SessionPlanner::setImage(uint16_t _pages, uint32_t _pageWireBytes, uint32_t _startEndWireBytes) {
+  pages = _pages;
+  pageWireBytes = _pageWireBytes;
+  startEndWireBytes = _startEndWireBytes;
+}
+
+void SessionPlanner::setImage(const ImageFrames &frames) {
+  uint32_t len, total = 0;
+  for (uint16_t i = 0; i < frames.pageCount(); i++) {
+    frames.page(i, &len);
+    total += len;
+  }
+  frames.start(&len);
+  uint32_t startEnd = len;
+  frames.end(&len);
+  startEnd += len;
+
+  uint16_t count = frames.pageCount();
+  setImage(count, count ? (total + count / 2) / count : 0, startEnd);
+}
+
+void SessionPlanner::setSettings(uint32_t _baud, const ProgrammerSettings &_settings) {
+  baud = _baud;
+  settings = _settings;
+}
+
+uint32_t SessionPlanner::plan(const SessionHistory &history, std::vector<SessionChoice> *choices) {
+  choices->clear();
+
+  // Bauds with history at this page size, starting with the configured one
+  std::vector<uint32_t> bauds(1, baud);
+  for (size_t i = 0; i < history.records.size(); i++) {
+    const SessionRecord &r = history.records[i];
+    uint8_t seen = r.pageSize != settings.pageSize;
+    for (size_t b = 0; b < bauds.size() && !seen; b++) {
+      seen = bauds[b] == r.baud;
+    }
+    if (!seen) {
+      bauds.push_back(r.baud);
+    }
+  }
+
+  // Time the host adds to each page (scheduling, USB latency), from the
+  // sessions that came closest to the model
+  double overhead = INFINITY;
+  for (size_t i = 0; i < history.records.size(); i++) {
+    const SessionRecord &r = history.records[i];
+    if (r.pageSize != settings.pageSize || r.pagesSent == 0 || !r.finished) continue;
+    double byteSeconds = 10.0 / r.baud;
+    double start = startEndWireBytes * byteSeconds + settings.startGapUs / 1e6;
+    double perPage = (r.seconds - start) / r.pagesSent - pageWireBytes * byteSeconds - r.pageGapUs / 1e6;
+    if (perPage < overhead) {
+      overhead = perPage;
+    }
+  }
+  if (overhead == INFINITY || overhead < 0) {
+    overhead = 0;
+  }
+
+  for (size_t b = 0; b < bauds.size(); b++) {
+    addChoices(history, bauds[b], overhead, choices);
+  }
+
+  // The best at the configured baud, out of the ones expected to use no more
+  // than half the rounds allowed if there are any
+  uint32_t best = 0;
+  for (uint32_t i = 1; i < choices->size(); i++) {
+    const SessionChoice &c = (*choices)[i], &b = (*choices)[best];
+    uint8_t fits = c.cost.rounds <= settings.maxRounds / 2.0,
+            bestFits = b.cost.rounds <= settings.maxRounds / 2.0;
+    if (c.baud == baud && (fits > bestFits || (fits == bestFits && c.cost.seconds < b.cost.seconds))) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+void SessionPlanner::addChoices(const SessionHistory &history, uint32_t forBaud, double overheadSeconds,
+                                std::vector<SessionChoice> *choices) {
+  struct GapStats {
+    uint32_t pageGapUs, errors, pagesClear, sessions;
+  };
+  std::vector<GapStats> gaps;
+
+  for (size_t i = 0; i < history.records.size(); i++) {
+    const SessionRecord &r = history.records[i];
+    if (r.baud != forBaud || r.pageSize != settings.pageSize) continue;
+
+    size_t g = 0;
+    while (g < gaps.size() && gaps[g].pageGapUs != r.pageGapUs) g++;
+    if (g == gaps.size()) {
+      GapStats stats = { r.pageGapUs, 0, 0, 0 };
+      gaps.push_back(stats);
+    }
+    gaps[g].errors += r.errors;
+    gaps[g].pagesClear += r.pagesClear;
+    gaps[g].sessions++;
+  }
+
+  // The configured page gap is always a candidate at the configured baud
+  std::vector<uint32_t> candidates;
+  for (size_t g = 0; g < gaps.size(); g++) {
+    candidates.push_back(gaps[g].pageGapUs);
+  }
+  if (forBaud == baud) {
+    candidates.push_back(settings.pageGapUs);
+  }
+
+  // Once the shortest gap has a couple of sessions with no more errors than
+  // the best one, try 10% less
+  double bestRate = INFINITY;
+  for (size_t g = 0; g < gaps.size(); g++) {
+    bestRate = fmin(bestRate, (gaps[g].errors + 0.5) / (gaps[g].pagesClear + 1));
+  }
+  int32_t shortest = -1;
+  for (size_t g = 0; g < gaps.size(); g++) {
+    double rate = (gaps[g].errors + 0.5) / (gaps[g].pagesClear + 1);
+    if (rate <= bestRate * 1.5 + 0.001 && (shortest < 0 || gaps[g].pageGapUs < gaps[shortest].pageGapUs)) {
+      shortest = g;
+    }
+  }
+  if (shortest >= 0 && gaps[shortest].sessions >= 2) {
+    uint32_t explore = gaps[shortest].pageGapUs * 9 / 10;
+    if (explore < minPageGapUs) {
+      explore = minPageGapUs;
+    }
+    candidates.push_back(explore);
+  }
+
+  double byteSeconds = 10.0 / forBaud;
+  for (size_t c = 0; c < candidates.size(); c++) {
+    uint32_t gap = candidates[c];
+
+    // Skip repeats
+    uint8_t repeat = 0;
+    for (size_t i = 0; i < choices->size() && !repeat; i++) {
+      repeat = (*choices)[i].baud == forBaud && (*choices)[i].pageGapUs == gap;
+    }
+    if (repeat) continue;
+
+    // The error rate measured at this gap, or at the closest longer one (a
+    // shorter gap is no better), or at the closest shorter one
+    const GapStats *measured = NULL;
+    for (size_t g = 0; g < gaps.size(); g++) {
+      const GapStats &s = gaps[g];
+      if (s.pageGapUs == gap) {
+        measured = &s;
+        break;
+      }
+      if (!measured ||
+          (s.pageGapUs > gap && (measured->pageGapUs < gap || s.pageGapUs < measured->pageGapUs)) ||
+          (s.pageGapUs < gap && measured->pageGapUs < gap && s.pageGapUs > measured->pageGapUs)) {
+        measured = &s;
+      }
+    }
+
+    SessionChoice choice;
+    choice.baud = forBaud;
+    choice.pageGapUs = gap;
+    if (measured) {
+      choice.pageErrorRate = (measured->errors + 0.5) / (measured->pagesClear + 1);
+      choice.sessions = (measured->pageGapUs == gap) ? measured->sessions : 0;
+    } else {
+      // No history at all: as if one session had gone through cleanly
+      choice.pageErrorRate = 0.5 / (pages + 1);
+      choice.sessions = 0;
+    }
+
+    SessionModel model;
+    model.pages = pages;
+    model.startSeconds = startEndWireBytes * byteSeconds + settings.startGapUs / 1e6;
+    model.pageSeconds = pageWireBytes * byteSeconds + gap / 1e6 + overheadSeconds;
+    model.pageErrorRate = choice.pageErrorRate;
+
+    // The quickest checkpoint interval (they all take the same rounds)
+    choice.checkpointPages = 0;
+    choice.cost = expectedCost(model, 0);
+    for (uint8_t k = 1; k < sessionCheckpointCount; k++) {
+      SessionCost cost = expectedCost(model, sessionCheckpoints[k]);
+      if (cost.seconds < choice.cost.seconds) {
+        choice.checkpointPages = sessionCheckpoints[k];
+        choice.cost = cost;
+      }
+    }
+    choices->push_back(choice);
+  }
+}
+
+void SessionPlanner::apply(const SessionChoice &choice, ProgrammerSettings *settings) {
+  settings->pageGapUs = choice.pageGapUs;
+  settings->checkpointPages = choice.checkpointPages;
+}
+
+SessionRecord sessionRecord(uint32_t baud, const ProgrammerSettings &settings, uint16_t pages,
+                            const ProgrammerStats &stats, const std::vector<uint16_t> &errorPages,
+                            uint8_t finished) {
+  SessionRecord record;
+  record.baud = baud;
+  record.pageSize = settings.pageSize;
+  record.pageGapUs = settings.pageGapUs;
+  record.checkpointPages = settings.checkpointPages;
+  record.pages = pages;
+  record.pagesSent = stats.pagesSent;
+  record.pagesClear = stats.pagesClear;
+  record.errors = stats.errors;
+  record.seconds = stats.seconds;
+  record.finished = finished;
+  record.errorPages = errorPages;
+  return record;
+}
@@ -0,0 +1,129 @@
+#ifndef SessionPlanner_H
+#define SessionPlanner_H
+
+/************************************************************************************
+ *  Tunes the settings of a programming session from how earlier sessions on the
+ *  same bus went.
+ *
+ *  Every session adds a line to the bus's history: the baud rate and settings
+ *  it used, how many pages were sent while the signal line was clear, how many
+ *  of those it came up after (the page errors, and where they were), and how
+ *  long it took. From that, the planner estimates the chance of a page error at
+ *  each page gap that's been tried, and works out the expected session time of
+ *  each page gap and checkpoint interval (see `checkpointPages` in
+ *  MultidropProgrammer.h) with a model of the resend process.
+ *
+ *  The nodes' baud rate is fixed when the bootloader is built, so the session
+ *  always runs at the configured rate. If another rate in the history would be
+ *  faster, the plan says so.
+ *
+ ************************************************************************************/
+
+#include <stdint.h>
+#include <vector>
+
+#include "MultidropProgrammer.h"
+
+class ImageFrames;
+
+struct SessionRecord {
+  uint32_t baud;
+  uint16_t pageSize;
+  uint32_t pageGapUs;
+  uint16_t checkpointPages;
+  uint16_t pages;       // In the image
+  uint32_t pagesSent,
+           pagesClear,  // Sent while the signal line was clear
+           errors;      // Pages the signal line came up after
+  double   seconds;
+  uint8_t  finished;
+  std::vector<uint16_t> errorPages;
+};
+
+/**
+ * The sessions run on one bus, as a text file with one session per line:
+ *   BAUD PAGE_SIZE PAGE_GAP_US CHECKPOINT PAGES PAGES_SENT PAGES_CLEAR ERRORS SECONDS FINISHED [ERROR_PAGE...]
+ */
+class SessionHistory {
+public:
+  // A missing file is an empty history
+  uint8_t load(const char *path);
+  uint8_t save(const char *path);
+
+  // Only the most recent sessions are kept
+  void add(const SessionRecord &record);
+
+  std::vector<SessionRecord> records;
+};
+
+// What a session costs under the model
+struct SessionCost {
+  double seconds,
+         pagesSent,
+         rounds;
+};
+
+// What the model needs to know about a session
+struct SessionModel {
+  uint16_t pages;
+  double startSeconds,  // START, END and the START gap
+         pageSeconds,   // One page's messages and the page gap
+         pageErrorRate; // Chance of the signal line coming up after a page
+};
+
+// Expected cost of a session that checks for errors every `checkpointPages`
+// pages (0 for only at the end of the image)
+SessionCost expectedCost(const SessionModel &model, uint16_t checkpointPages);
+
+// Checkpoint intervals the planner compares
+extern const uint16_t sessionCheckpoints[];
+extern const uint8_t sessionCheckpointCount;
+
+struct SessionChoice {
+  uint32_t baud;
+  uint32_t pageGapUs;
+  uint16_t checkpointPages;
+  double   pageErrorRate;
+  uint32_t sessions;  // Sessions the error rate is from (0 if it's a guess)
+  SessionCost cost;
+};
+
+class SessionPlanner {
+public:
+  SessionPlanner();
+
+  // Describe the image and how it will be sent
+  void setImage(uint16_t pages, uint32_t pageWireBytes, uint32_t startEndWireBytes);
+  void setImage(const ImageFrames &frames);
+
+  // Configured settings: the baud, page size, page gap and START gap to use
+  // without any history, and the round limit plans have to stay well inside
+  void setSettings(uint32_t baud, const ProgrammerSettings &settings);
+
+  // Never try a page gap shorter than this
+  uint32_t minPageGapUs;
+
+  // Work out the expected cost of each candidate. Returns the index of the
+  // best one at the configured baud, which is the one to use.
+  uint32_t plan(const SessionHistory &history, std::vector<SessionChoice> *choices);
+
+  // Put a choice into the settings
+  static void apply(const SessionChoice &choice, ProgrammerSettings *settings);
+
+private:
+  uint16_t pages;
+  uint32_t pageWireBytes,
+           startEndWireBytes;
+  uint32_t baud;
+  ProgrammerSettings settings;
+
+  void addChoices(const SessionHistory &history, uint32_t baud, double overheadSeconds,
+                  std::vector<SessionChoice> *choices);
+};
+
+// Describe a finished session for the history
+SessionRecord sessionRecord(uint32_t baud, const ProgrammerSettings &settings, uint16_t pages,
+                            const ProgrammerStats &stats, const std::vector<uint16_t> &errorPages,
+                            uint8_t finished);
+
+#endif
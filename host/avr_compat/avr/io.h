@@ -0,0 +1,13 @@
+/*****************************************************************************
+*
+* Lets the DiscoBus library build on the host (see "Host Programmer" in the
+* Makefile). The library only needs the integer types from here.
+*
+****************************************************************************/
+
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+
+#endif
@@ -0,0 +1,15 @@
+/*****************************************************************************
+*
+* Host version of avr-libc's atomic blocks. The host tools call the DiscoBus
+* library from one thread, so the block just runs once.
+*
+****************************************************************************/
+
+#ifndef HOST_UTIL_ATOMIC_H
+#define HOST_UTIL_ATOMIC_H
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+#define ATOMIC_BLOCK(type) for (int _atomicOnce = 1; _atomicOnce; _atomicOnce = 0)
+
+#endif
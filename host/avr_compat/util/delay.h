@@ -0,0 +1,20 @@
+/*****************************************************************************
+*
+* Host version of avr-libc's busy wait delays.
+*
+****************************************************************************/
+
+#ifndef HOST_UTIL_DELAY_H
+#define HOST_UTIL_DELAY_H
+
+#include <unistd.h>
+
+static inline void _delay_us(double us) {
+  usleep((useconds_t)us);
+}
+
+static inline void _delay_ms(double ms) {
+  usleep((useconds_t)(ms * 1000));
+}
+
+#endif
@@ -0,0 +1,64 @@
+/*****************************************************************************
+*
+* The bus capture file format, shared by the host tools (C++) and the
+* simulator (C).
+*
+* A 32 byte header followed by fixed size 8 byte records, in the order they
+* were recorded, all little endian. Each record is:
+*
+*   bits  0-7   data byte (or the new level, for DE and signal records)
+*   bits  8-15  event (CAPTURE_*)
+*   bits 16-63  time in nanoseconds since the capture started
+*
+* Fixed size records let a reader map the file and index it directly, so a
+* capture of any size can be scanned (or binary searched by time) in place.
+*
+****************************************************************************/
+
+#ifndef CAPTURE_FORMAT_H
+#define CAPTURE_FORMAT_H
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC       "MDBUSCAP"
+#define CAPTURE_VERSION     1
+#define CAPTURE_HEADER_SIZE 32
+
+// Events
+#define CAPTURE_TX     1  // Byte sent, stamped when it finished leaving the wire
+#define CAPTURE_RX     2  // Byte received, stamped when it was read
+#define CAPTURE_DE     3  // Driver enable asserted (1) or released (0)
+#define CAPTURE_SIGNAL 4  // Signal line enabled by a node (1) or released (0)
+#define CAPTURE_MARK   5  // Marker written by the programmer (CAPTURE_MARK_*)
+
+// Markers
+#define CAPTURE_MARK_SESSION 1  // Programming session started
+#define CAPTURE_MARK_ROUND   2  // Retransmission round started
+#define CAPTURE_MARK_RESTART 3  // Session restarted from START
+
+struct captureHeader {
+  char     magic[8];
+  uint16_t version;
+  uint16_t recordSize;
+  uint32_t baud;
+  uint64_t startRealtimeNs;  // Wall clock time the capture started (CLOCK_REALTIME)
+  uint8_t  reserved[8];
+};
+
+static inline uint64_t captureRecord(uint8_t event, uint8_t data, uint64_t ns) {
+  return (ns << 16) | ((uint64_t)event << 8) | data;
+}
+
+static inline uint8_t captureEvent(uint64_t record) {
+  return (record >> 8) & 0xFF;
+}
+
+static inline uint8_t captureData(uint64_t record) {
+  return record & 0xFF;
+}
+
+static inline uint64_t captureTime(uint64_t record) {
+  return record >> 16;
+}
+
+#endif
@@ -0,0 +1,263 @@
+/*****************************************************************************
+*
+* Checks the host CRC and frame encoder against the DiscoBus library, then
+* times them.
+*
+*   frame_bench --size 64 --time 0.5
+*
+* Every CRC version is compared with _crc16_update over random buffers, and
+* encodeFrame() with DiscobusMaster over random messages in both framings.
+* It exits with 1 if anything differs.
+*
+****************************************************************************/
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include <util/crc16.h>
+
+#include "Crc16.h"
+#include "DiscobusMaster.h"
+#include "FrameEncoder.h"
+#include "ImageFrames.h"
+#include "MultidropProgrammer.h"
+
+struct options {
+  uint32_t sizeMB;
+  double seconds;
+  uint32_t seed;
+};
+
+static struct options opts;
+
+// Collects what DiscobusMaster writes
+class DiscobusDataBuffer : public DiscobusData {
+public:
+  std::vector<uint8_t> bytes;
+
+  void write(uint8_t b) {
+    bytes.push_back(b);
+  }
+};
+
+static double monotonicSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void randomFill(std::vector<uint8_t> &buf) {
+  for (size_t i = 0; i < buf.size(); i++) {
+    buf[i] = rand();
+  }
+}
+
+typedef uint16_t (*crc_fn)(uint16_t crc, const uint8_t *data, size_t len);
+
+static uint8_t checkCrc(const char *name, crc_fn fn) {
+  std::vector<uint8_t> buf(4096 + 8);
+  randomFill(buf);
+
+  for (uint32_t len = 0; len <= 4096; len += (len < 300) ? 1 : 61) {
+    for (uint8_t offset = 0; offset < 8; offset++) {
+      uint16_t crc = rand();
+      uint16_t expected = crc;
+      for (uint32_t i = 0; i < len; i++) {
+        expected = _crc16_update(expected, buf[offset + i]);
+      }
+
+      uint16_t actual = fn(crc, &buf[offset], len);
+      if (actual != expected) {
+        printf("%s: 0x%04X instead of 0x%04X (%u bytes at offset %u)\n", name, actual, expected, len, offset);
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+static uint8_t checkFrames() {
+  uint8_t data[255];
+  uint8_t frame[FRAME_MAX];
+
+  for (uint16_t i = 0; i < 2000; i++) {
+    uint8_t escaped = i & 1;
+    uint8_t command = rand();
+    uint8_t len = (i < 512) ? (i / 2) : rand();
+    for (uint16_t j = 0; j < len; j++) {
+      // Plenty of bytes that need escaping
+      data[j] = (rand() & 3) ? rand() : ((rand() & 1) ? FRAME_END : FRAME_ESC);
+    }
+
+    DiscobusDataBuffer buffer;
+    DiscobusMaster master(&buffer);
+    master.setNodeLength(1);
+    master.setEscapedFraming(escaped);
+    master.startMessage(command, Discobus::BROADCAST_ADDRESS, len, true);
+    if (len) {
+      master.sendData(data, len);
+    }
+    master.finishMessage();
+
+    uint32_t n = encodeFrame(frame, command, data, len, escaped);
+    if (n != buffer.bytes.size() || memcmp(frame, &buffer.bytes[0], n)) {
+      printf("encodeFrame: differs from DiscobusMaster (command 0x%02X, %u bytes%s)\n",
+             command, len, escaped ? ", escaped" : "");
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Time `fn` over `buf`, returning GB/s
+static double timeCrc(crc_fn fn, const std::vector<uint8_t> &buf) {
+  volatile uint16_t sink = 0;
+  uint32_t runs = 0;
+  double start = monotonicSeconds(), elapsed;
+  do {
+    sink = sink ^ fn(~0, &buf[0], buf.size());
+    runs++;
+    elapsed = monotonicSeconds() - start;
+  } while (elapsed < opts.seconds);
+  return (double)buf.size() * runs / elapsed / 1e9;
+}
+
+// Time encoding a whole image's messages, returning GB/s of image data
+static double timeImage(const std::vector<uint8_t> &image, uint16_t pageSize, uint8_t escaped,
+                        size_t *encodedSize) {
+  uint32_t runs = 0;
+  double start = monotonicSeconds(), elapsed;
+  do {
+    ImageFrames frames;
+    frames.encode(image, pageSize, escaped);
+    *encodedSize = frames.size();
+    runs++;
+    elapsed = monotonicSeconds() - start;
+  } while (elapsed < opts.seconds);
+  return (double)image.size() * runs / elapsed / 1e9;
+}
+
+// The same with DiscobusMaster, one byte at a time
+static double timeImageMaster(const std::vector<uint8_t> &image, uint16_t pageSize, uint8_t escaped) {
+  uint32_t runs = 0;
+  double start = monotonicSeconds(), elapsed;
+  do {
+    DiscobusDataBuffer buffer;
+    DiscobusMaster master(&buffer);
+    master.setNodeLength(1);
+    master.setEscapedFraming(escaped);
+    for (uint32_t offset = 0; offset < image.size(); offset += pageSize) {
+      uint32_t len = image.size() - offset;
+      if (len > pageSize) {
+        len = pageSize;
+      }
+      uint8_t pageNum = offset / pageSize;
+      master.startMessage(MSG_CMD_PAGE_NUM, Discobus::BROADCAST_ADDRESS, 1, true);
+      master.sendData(&pageNum, 1);
+      master.finishMessage();
+      master.startMessage(MSG_CMD_PAGE_DATA, Discobus::BROADCAST_ADDRESS, len, true);
+      master.sendData((uint8_t*)&image[offset], len);
+      master.finishMessage();
+    }
+    runs++;
+    elapsed = monotonicSeconds() - start;
+  } while (elapsed < opts.seconds);
+  return (double)image.size() * runs / elapsed / 1e9;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "  -s, --size MB     Buffer to run the CRCs over (default 64)\n"
+    "  -t, --time S      How long to time each case (default 0.5)\n"
+    "      --seed N      Seed for the random data\n",
+    name);
+  exit(1);
+}
+
+static void parseOptions(int argc, char **argv) {
+  static struct option longOpts[] = {
+    { "size", required_argument, 0, 's' },
+    { "time", required_argument, 0, 't' },
+    { "seed", required_argument, 0, 'S' },
+    { 0, 0, 0, 0 }
+  };
+
+  opts.sizeMB = 64;
+  opts.seconds = 0.5;
+  opts.seed = 1;
+
+  int c;
+  while ((c = getopt_long(argc, argv, "s:t:", longOpts, NULL)) != -1) {
+    switch (c) {
+      case 's': opts.sizeMB = atoi(optarg); break;
+      case 't': opts.seconds = atof(optarg); break;
+      case 'S': opts.seed = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || opts.sizeMB == 0) {
+    usage(argv[0]);
+  }
+}
+
+int main(int argc, char **argv) {
+  parseOptions(argc, argv);
+  srand(opts.seed);
+
+  static const struct {
+    const char *name;
+    crc_fn fn;
+  } crcs[] = {
+    { "bitwise", crc16Bitwise },
+    { "slice-by-8", crc16Slice8 },
+    { "pclmul", crc16Clmul },
+  };
+  uint8_t numCrcs = sizeof(crcs) / sizeof(crcs[0]);
+
+  // Everything has to match the library first
+  uint8_t ok = 1;
+  for (uint8_t i = 0; i < numCrcs; i++) {
+    ok &= checkCrc(crcs[i].name, crcs[i].fn);
+  }
+  ok &= checkFrames();
+  printf("Matches _crc16_update and DiscobusMaster: %s\n", ok ? "yes" : "NO");
+  if (!ok) {
+    return 1;
+  }
+  if (!crc16HasClmul()) {
+    printf("This CPU has no carry-less multiply, pclmul is slice-by-8\n");
+  }
+
+  // CRC throughput
+  std::vector<uint8_t> buf(opts.sizeMB * 1024 * 1024);
+  randomFill(buf);
+
+  printf("\nCRC over %u MB\n", opts.sizeMB);
+  for (uint8_t i = 0; i < numCrcs; i++) {
+    printf("  %-12s %8.3f GB/s\n", crcs[i].name, timeCrc(crcs[i].fn, buf));
+  }
+
+  // Encoding whole images: the largest image the bootloader can take at each page size
+  printf("\nEncoding an image (GB/s of image data)\n");
+  printf("  %-9s %-8s %10s %14s %14s %10s\n", "Page size", "Framing", "Image", "encodeFrame", "DiscobusMaster", "Speedup");
+  static const uint16_t pageSizes[] = { 64, 128, 255 };
+  for (uint8_t p = 0; p < sizeof(pageSizes) / sizeof(pageSizes[0]); p++) {
+    for (uint8_t escaped = 0; escaped < 2; escaped++) {
+      std::vector<uint8_t> image(255 * pageSizes[p]);
+      randomFill(image);
+
+      size_t encodedSize;
+      double fast = timeImage(image, pageSizes[p], escaped, &encodedSize);
+      double slow = timeImageMaster(image, pageSizes[p], escaped);
+      printf("  %-9u %-8s %10u %14.3f %14.3f %9.1fx\n",
+             pageSizes[p], escaped ? "escaped" : "legacy", (uint32_t)image.size(),
+             fast, slow, fast / slow);
+    }
+  }
+  return 0;
+}
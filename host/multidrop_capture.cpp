@@ -0,0 +1,693 @@
+/*****************************************************************************
+*
+* Looks at a bus capture recorded with --capture (see host/Capture.h).
+*
+*   multidrop_capture analyze bus.cap
+*   multidrop_capture --from 1500 --to 2500 --frames analyze bus.cap
+*   multidrop_capture replay bus.cap
+*
+* analyze decodes the frames on the wire and reports how long they took,
+* the gaps between them, CRC failures, how quickly the signal line came up
+* after a frame, and how quickly each node answered response messages.
+*
+* replay feeds the bytes on the wire through DiscobusSlave, as node
+* --address would have seen them, as fast as it can parse them.
+*
+* Both make one pass over the mapped file, so a capture of any size is read
+* in constant memory.
+*
+****************************************************************************/
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <util/crc16.h>
+
+#include "Capture.h"
+#include "DiscobusSlave.h"
+#include "MultidropProgrammer.h"
+
+struct options {
+  const char *action;
+  const char *capturePath;
+  uint64_t fromNs;
+  uint64_t toNs;
+  uint8_t address;
+  uint8_t listFrames;
+};
+
+static struct options opts;
+
+static double monotonicSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+    "Usage: %s [options] analyze|replay CAPTURE\n"
+    "      --from MS        Start this many milliseconds into the capture\n"
+    "      --to MS          Stop this many milliseconds into the capture\n"
+    "  -l, --frames         List every frame (analyze)\n"
+    "  -a, --address N      Node address to replay as (default 1)\n",
+    name);
+  exit(1);
+}
+
+static void parseOptions(int argc, char **argv) {
+  static struct option longOpts[] = {
+    { "from",    required_argument, 0, 'F' },
+    { "to",      required_argument, 0, 'T' },
+    { "frames",  no_argument,       0, 'l' },
+    { "address", required_argument, 0, 'a' },
+    { 0, 0, 0, 0 }
+  };
+
+  opts.toNs = UINT64_MAX;
+  opts.address = 1;
+
+  int c;
+  while ((c = getopt_long(argc, argv, "la:", longOpts, NULL)) != -1) {
+    switch (c) {
+      case 'F': opts.fromNs = atof(optarg) * 1e6; break;
+      case 'T': opts.toNs = atof(optarg) * 1e6; break;
+      case 'l': opts.listFrames = true; break;
+      case 'a': opts.address = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 2 || opts.address == 0) {
+    usage(argv[0]);
+  }
+  opts.action = argv[optind];
+  opts.capturePath = argv[optind + 1];
+}
+
+static const char* commandName(uint8_t command) {
+  switch (command) {
+    case MSG_CMD_PROG_START: return "START";
+    case MSG_CMD_PAGE_NUM:   return "PAGE_NUM";
+    case MSG_CMD_PAGE_DATA:  return "PAGE_DATA";
+    case MSG_CMD_PROG_END:   return "END";
+    case CMD_RESET:          return "RESET";
+    case CMD_ADDRESS:        return "ADDRESS";
+    case CMD_NULL:           return "NULL";
+  }
+  return NULL;
+}
+
+/**
+ * Durations in nanoseconds, counted in buckets 1/8 of a power of two wide,
+ * so percentiles are within about 10% whatever the range.
+ */
+class Histogram {
+public:
+  Histogram() {
+    memset(this, 0, sizeof(*this));
+  }
+
+  void add(uint64_t ns) {
+    buckets[bucket(ns)]++;
+    if (count == 0 || ns < min) min = ns;
+    if (ns > max) max = ns;
+    sum += ns;
+    count++;
+  }
+
+  // Approximate value at fraction `p` (0 to 1)
+  uint64_t percentile(double p) const {
+    uint64_t target = ceil(p * count);
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < BUCKETS; i++) {
+      seen += buckets[i];
+      if (seen >= target && seen > 0) {
+        uint64_t value = bucketMiddle(i);
+        return (value < min) ? min : (value > max) ? max : value;
+      }
+    }
+    return max;
+  }
+
+  // Print "count, mean, p50, p99, max" in microseconds
+  void print(const char *label) const {
+    if (count == 0) {
+      printf("%-22s -\n", label);
+      return;
+    }
+    printf("%-22s %10llu %10.1f %10.1f %10.1f %10.1f\n", label, (unsigned long long)count,
+           sum / 1e3 / count, percentile(0.5) / 1e3, percentile(0.99) / 1e3, max / 1e3);
+  }
+
+  static void printHeading() {
+    printf("%-22s %10s %10s %10s %10s %10s\n", "", "Count", "Mean us", "p50 us", "p99 us", "Max us");
+  }
+
+  uint64_t count;
+
+private:
+  static const uint32_t SUB = 8;
+  static const uint32_t BUCKETS = 64 * SUB;
+
+  uint64_t buckets[BUCKETS];
+  uint64_t sum, min, max;
+
+  static uint32_t bucket(uint64_t ns) {
+    if (ns < SUB) {
+      return ns;
+    }
+    uint32_t log = 63 - __builtin_clzll(ns);
+    return (log - 2) * SUB + ((ns >> (log - 3)) & (SUB - 1));
+  }
+
+  static uint64_t bucketMiddle(uint32_t i) {
+    if (i < SUB) {
+      return i;
+    }
+    uint32_t log = i / SUB + 2;
+    uint64_t low = (uint64_t)(SUB + i % SUB) << (log - 3);
+    return low + ((1ULL << (log - 3)) >> 1);
+  }
+};
+
+/**
+ * Decodes frames from the bytes on the wire, in either framing. Bytes sent
+ * by the host and bytes from the nodes (the data of response messages) are
+ * fed in the order they were recorded.
+ */
+class FrameDecoder {
+public:
+  enum Result {
+    BYTE_CONSUMED,
+    FRAME_DONE,
+    FRAME_BAD_CRC,
+    FRAME_CUT_SHORT  // A new escaped frame started before this one ended
+  };
+
+  struct Frame {
+    uint8_t flags, address, command, nodes, length;
+    uint8_t escaped;
+    uint32_t wireBytes;    // Including framing and escapes
+    uint64_t startNs;      // When the first byte started leaving the wire
+    uint64_t headerEndNs;  // When the last header byte was on the wire
+    uint64_t endNs;
+  };
+
+  // Called for each byte of a response message's data section, with when
+  // the turn of the node it belongs to began
+  struct Listener {
+    virtual void responseByte(const Frame &frame, uint32_t index, uint8_t fromNode, uint64_t ns, uint64_t slotStartNs) = 0;
+    virtual ~Listener() {}
+  };
+
+  FrameDecoder(uint64_t _byteNs, Listener *_listener) {
+    byteNs = _byteNs;
+    listener = _listener;
+    state = IDLE;
+    escapedFraming = 0;
+    escapePending = 0;
+    memset(&frame, 0, sizeof(frame));
+  }
+
+  // The frame that just ended (when feed() returns anything but BYTE_CONSUMED)
+  Frame last;
+
+  Result feed(uint8_t b, uint8_t fromNode, uint64_t ns) {
+    // Start of an escaped frame
+    if (b == FRAME_END && (state == IDLE || frame.escaped || escapedFraming)) {
+      Result result = (state != IDLE && state != SOM2) ? FRAME_CUT_SHORT : BYTE_CONSUMED;
+      if (result == FRAME_CUT_SHORT) {
+        last = frame;
+        last.endNs = lastNs;
+      }
+      begin(ns, 1);
+      return result;
+    }
+
+    if (state == IDLE) {
+      if (b == 0xFF && !escapedFraming) {
+        begin(ns, 0);
+        state = SOM2;
+      }
+      return BYTE_CONSUMED;
+    }
+
+    frame.wireBytes++;
+    lastNs = ns;
+    if (state == SOM2) {
+      state = (b == 0xFF) ? HEADER : IDLE;
+      return BYTE_CONSUMED;
+    }
+
+    // Undo escapes
+    if (frame.escaped) {
+      if (escapePending) {
+        escapePending = 0;
+        b = (b == FRAME_ESC_END) ? FRAME_END : FRAME_ESC;
+      }
+      else if (b == FRAME_ESC) {
+        escapePending = 1;
+        return BYTE_CONSUMED;
+      }
+    }
+
+    switch (state) {
+      case HEADER:
+        crc = _crc16_update(crc, b);
+        header[headerPos++] = b;
+        if (headerPos == 4 && !(header[0] & Discobus::BATCH_FLAG)) {
+          startData(0, b);
+        }
+        else if (headerPos == 5) {
+          startData(header[3], b);
+        }
+        break;
+
+      case DATA:
+        crc = _crc16_update(crc, b);
+        if (frame.command == CMD_ADDRESS) {
+          // Addresses until two 0xFF, then a NULL message header
+          if (b == 0xFF && lastByte == 0xFF) {
+            state = ADDRESS_END;
+            crc = ~0;
+            headerPos = 0;
+          }
+        }
+        else {
+          if ((frame.flags & Discobus::RESPONSE_MESSAGE_FLAG) && listener) {
+            uint32_t slot = frame.length ? dataPos / frame.length : 0;
+            uint64_t slotStart = (slot == 0) ? frame.headerEndNs : slotEndNs;
+            listener->responseByte(frame, dataPos, fromNode, ns, slotStart);
+            if (frame.length && (dataPos + 1) % frame.length == 0) {
+              slotEndNs = ns;
+            }
+          }
+          if (++dataPos >= dataLength) {
+            state = CRC1;
+          }
+        }
+        lastByte = b;
+        break;
+
+      case ADDRESS_END:
+        crc = _crc16_update(crc, b);
+        if (++headerPos == 4) {
+          state = CRC1;
+        }
+        break;
+
+      case CRC1:
+        crcHigh = b;
+        state = CRC2;
+        break;
+
+      case CRC2:
+        state = IDLE;
+        frame.endNs = ns;
+        last = frame;
+        if (crcHigh == (crc >> 8) && b == (crc & 0xFF)) {
+          if (frame.escaped) {
+            escapedFraming = 1;
+          }
+          return FRAME_DONE;
+        }
+        return FRAME_BAD_CRC;
+
+      default:
+        break;
+    }
+    return BYTE_CONSUMED;
+  }
+
+private:
+  enum State { IDLE, SOM2, HEADER, DATA, ADDRESS_END, CRC1, CRC2 };
+
+  Frame frame;
+
+  uint64_t byteNs;
+  Listener *listener;
+  State state;
+  uint8_t escapedFraming,
+          escapePending,
+          header[5],
+          headerPos,
+          lastByte,
+          crcHigh;
+  uint16_t crc;
+  uint32_t dataPos,
+           dataLength;
+  uint64_t lastNs,
+           slotEndNs;
+
+  void begin(uint64_t ns, uint8_t escaped) {
+    memset(&frame, 0, sizeof(frame));
+    frame.escaped = escaped;
+    frame.wireBytes = 1;
+    frame.startNs = (ns > byteNs) ? ns - byteNs : 0;
+    lastNs = ns;
+    state = HEADER;
+    headerPos = 0;
+    escapePending = 0;
+    lastByte = 0;
+    dataPos = 0;
+    crc = ~0;
+  }
+
+  void startData(uint8_t nodes, uint8_t length) {
+    frame.flags = header[0];
+    frame.address = header[1];
+    frame.command = header[2];
+    frame.nodes = nodes;
+    frame.length = length;
+    frame.headerEndNs = lastNs;
+    dataLength = (frame.flags & Discobus::BATCH_FLAG) ? (uint32_t)nodes * length : length;
+
+    // The flag has to match the framing
+    if (!(frame.flags & Discobus::ESCAPED_FLAG) != !frame.escaped) {
+      state = IDLE;
+    }
+    else if (frame.command == CMD_ADDRESS) {
+      state = DATA;
+    }
+    else {
+      state = dataLength ? DATA : CRC1;
+    }
+  }
+};
+
+/**
+ * Per-node response times: from when the node's turn came (the end of the
+ * header, or of the previous node's data) to its first byte. When the host
+ * filled in a node's data itself, the node timed out.
+ */
+struct ResponseStats : public FrameDecoder::Listener {
+  struct Node {
+    uint64_t responses, timeouts, sumNs, maxNs;
+  };
+  Node nodes[256];
+  Histogram latency;
+
+  ResponseStats() {
+    memset(nodes, 0, sizeof(nodes));
+  }
+
+  void responseByte(const FrameDecoder::Frame &frame, uint32_t index, uint8_t fromNode, uint64_t ns, uint64_t slotStartNs) {
+    if (frame.length == 0 || index % frame.length != 0) {
+      return;
+    }
+
+    uint32_t slot = index / frame.length;
+    uint8_t address = (frame.address == Discobus::BROADCAST_ADDRESS) ? slot + 1 : frame.address;
+    Node &node = nodes[address];
+    if (!fromNode) {
+      node.timeouts++;
+      return;
+    }
+
+    uint64_t waited = (ns > slotStartNs) ? ns - slotStartNs : 0;
+    node.responses++;
+    node.sumNs += waited;
+    if (waited > node.maxNs) node.maxNs = waited;
+    latency.add(waited);
+  }
+};
+
+static int analyze(const CaptureReader &capture) {
+  const captureHeader &header = capture.header();
+  const uint64_t *records = capture.records();
+  size_t begin = capture.find(opts.fromNs),
+         end = capture.find(opts.toNs);
+  uint64_t byteNs = header.baud ? 10000000000ULL / header.baud : 0;
+
+  ResponseStats responses;
+  FrameDecoder decoder(byteNs, &responses);
+
+  uint64_t txBytes = 0, rxBytes = 0, frames = 0, badCrc = 0, cutShort = 0;
+  uint64_t commandCount[256] = { 0 }, commandBytes[256] = { 0 };
+  uint64_t markers[4] = { 0 };
+  uint64_t deAsserts = 0, signalAsserts = 0;
+  uint64_t lastFrameEnd = 0, deSince = 0, signalSince = 0;
+  uint8_t frameEnded = 0, signalPending = 0, deLevel = 0, signalLevel = 0;
+  Histogram frameTime, frameStretch, gapTime, deHeld, signalHeld, signalLatency;
+
+  if (opts.listFrames) {
+    printf("%-14s %-10s %-4s %-5s %5s %6s %10s %s\n", "Start ms", "Command", "Addr", "Flags", "Len", "Wire", "Time us", "Notes");
+  }
+
+  double start = monotonicSeconds();
+  for (size_t i = begin; i < end; i++) {
+    uint64_t record = records[i];
+    uint8_t event = captureEvent(record),
+            data = captureData(record);
+    uint64_t ns = captureTime(record);
+
+    switch (event) {
+      case CAPTURE_TX:
+      case CAPTURE_RX: {
+        if (event == CAPTURE_TX) txBytes++; else rxBytes++;
+
+        FrameDecoder::Result result = decoder.feed(data, event == CAPTURE_RX, ns);
+        if (result == FrameDecoder::BYTE_CONSUMED) {
+          break;
+        }
+
+        const FrameDecoder::Frame &frame = decoder.last;
+        uint64_t duration = frame.endNs - frame.startNs,
+                 ideal = frame.wireBytes * byteNs;
+        const char *note = "";
+        if (result == FrameDecoder::FRAME_DONE) {
+          frames++;
+          commandCount[frame.command]++;
+          commandBytes[frame.command] += frame.wireBytes;
+          frameTime.add(duration);
+          frameStretch.add((duration > ideal) ? duration - ideal : 0);
+          if (frameEnded && frame.startNs > lastFrameEnd) {
+            gapTime.add(frame.startNs - lastFrameEnd);
+          }
+          lastFrameEnd = frame.endNs;
+          frameEnded = 1;
+          signalPending = 1;
+        }
+        else {
+          note = (result == FrameDecoder::FRAME_BAD_CRC) ? "bad CRC" : "cut short";
+          if (result == FrameDecoder::FRAME_BAD_CRC) badCrc++; else cutShort++;
+        }
+
+        if (opts.listFrames) {
+          const char *name = commandName(frame.command);
+          char other[8];
+          if (!name) {
+            snprintf(other, sizeof(other), "0x%02X", frame.command);
+            name = other;
+          }
+          printf("%-14.3f %-10s %-4u 0x%02X  %5u %6u %10.1f %s\n", frame.startNs / 1e6, name, frame.address,
+                 frame.flags, frame.length, frame.wireBytes, duration / 1e3, note);
+        }
+        break;
+      }
+
+      case CAPTURE_DE:
+        if (data && !deLevel) {
+          deAsserts++;
+          deSince = ns;
+        }
+        else if (!data && deLevel && ns > deSince) {
+          deHeld.add(ns - deSince);
+        }
+        deLevel = data;
+        break;
+
+      case CAPTURE_SIGNAL:
+        if (data && !signalLevel) {
+          signalAsserts++;
+          signalSince = ns;
+          if (signalPending && ns > lastFrameEnd) {
+            signalLatency.add(ns - lastFrameEnd);
+          }
+          signalPending = 0;
+        }
+        else if (!data && signalLevel && ns > signalSince) {
+          signalHeld.add(ns - signalSince);
+        }
+        signalLevel = data;
+        break;
+
+      case CAPTURE_MARK:
+        if (data < 4) markers[data]++;
+        break;
+    }
+  }
+  double elapsed = monotonicSeconds() - start;
+
+  uint64_t firstNs = (begin < end) ? captureTime(records[begin]) : 0,
+           lastNs = (begin < end) ? captureTime(records[end - 1]) : 0;
+  double spanS = (lastNs - firstNs) / 1e9;
+
+  if (opts.listFrames) {
+    printf("\n");
+  }
+  printf("Capture:          %s, %llu records over %.3f s\n", opts.capturePath, (unsigned long long)(end - begin), spanS);
+  printf("Baud:             %u (%.2f us a byte)\n", header.baud, byteNs / 1e3);
+  printf("Bytes:            %llu sent, %llu from nodes", (unsigned long long)txBytes, (unsigned long long)rxBytes);
+  if (spanS > 0) {
+    printf(", bus %.1f%% busy", 100.0 * (txBytes + rxBytes) * byteNs / (spanS * 1e9));
+  }
+  printf("\n");
+  printf("Frames:           %llu, %llu bad CRC, %llu cut short\n",
+         (unsigned long long)frames, (unsigned long long)badCrc, (unsigned long long)cutShort);
+  printf("Sessions:         %llu, %llu retransmission rounds, %llu restarts\n",
+         (unsigned long long)markers[CAPTURE_MARK_SESSION], (unsigned long long)markers[CAPTURE_MARK_ROUND],
+         (unsigned long long)markers[CAPTURE_MARK_RESTART]);
+  printf("DE / signal:      asserted %llu / %llu times\n", (unsigned long long)deAsserts, (unsigned long long)signalAsserts);
+  printf("Analyzed in:      %.3f s (%.0f MB/s)\n", elapsed,
+         (end - begin) * sizeof(uint64_t) / 1e6 / (elapsed > 0 ? elapsed : 1e-9));
+
+  printf("\n%-12s %10s %12s\n", "Command", "Frames", "Wire bytes");
+  for (uint32_t c = 0; c < 256; c++) {
+    if (!commandCount[c]) continue;
+    const char *name = commandName(c);
+    if (name) {
+      printf("%-12s", name);
+    } else {
+      printf("0x%02X        ", c);
+    }
+    printf(" %10llu %12llu\n", (unsigned long long)commandCount[c], (unsigned long long)commandBytes[c]);
+  }
+
+  printf("\n");
+  Histogram::printHeading();
+  frameTime.print("Frame time");
+  frameStretch.print("Over wire time");
+  gapTime.print("Gap between frames");
+  deHeld.print("DE held");
+  signalLatency.print("Signal after frame");
+  signalHeld.print("Signal held");
+  responses.latency.print("Node response");
+
+  uint8_t anyNodes = 0;
+  for (uint32_t n = 0; n < 256; n++) {
+    const ResponseStats::Node &node = responses.nodes[n];
+    if (!node.responses && !node.timeouts) continue;
+    if (!anyNodes) {
+      printf("\n%-6s %10s %10s %10s %10s\n", "Node", "Responses", "Timeouts", "Mean us", "Max us");
+      anyNodes = 1;
+    }
+    printf("%-6u %10llu %10llu %10.1f %10.1f\n", n, (unsigned long long)node.responses,
+           (unsigned long long)node.timeouts,
+           node.responses ? node.sumNs / 1e3 / node.responses : 0.0, node.maxNs / 1e3);
+  }
+  return 0;
+}
+
+/**
+ * Plays the bytes on the wire back to a DiscobusSlave.
+ */
+class CaptureReplayData : public DiscobusData {
+public:
+  CaptureReplayData(const uint64_t *_records, size_t _pos, size_t _end) {
+    records = _records;
+    pos = _pos;
+    end = _end;
+    bytes = 0;
+    skipToByte();
+  }
+
+  void begin(uint32_t) {}
+
+  uint8_t available() {
+    return pos < end;
+  }
+
+  uint8_t read() {
+    if (pos >= end) return 0;
+    uint8_t b = captureData(records[pos++]);
+    bytes++;
+    skipToByte();
+    return b;
+  }
+
+  void write(uint8_t) {}
+  void flush() {}
+  void clear() {}
+  void enable_write() {}
+  void enable_read() {}
+
+  uint64_t bytes;
+
+private:
+  const uint64_t *records;
+  size_t pos,
+         end;
+
+  void skipToByte() {
+    while (pos < end) {
+      uint8_t event = captureEvent(records[pos]);
+      if (event == CAPTURE_TX || event == CAPTURE_RX) break;
+      pos++;
+    }
+  }
+};
+
+static int replay(const CaptureReader &capture) {
+  CaptureReplayData data(capture.records(), capture.find(opts.fromNs), capture.find(opts.toNs));
+
+  // Daisy chain lines that are never enabled, so the node stays out of addressing
+  volatile uint8_t ddr = 0, port = 0, pin = 0xFF;
+
+  DiscobusSlave node(&data);
+  node.addDaisyChain(0, &ddr, &port, &pin, 1, &ddr, &port, &pin, true);
+  node.setAddress(opts.address);
+
+  // Messages for other nodes are skipped, so each one read is for this node or a broadcast
+  uint64_t messages = 0, dataBytes = 0;
+  uint64_t commandCount[256] = { 0 };
+
+  double start = monotonicSeconds();
+  while (data.available()) {
+    if (node.read()) {
+      messages++;
+      commandCount[node.getCommand()]++;
+      dataBytes += node.getDataLen();
+    }
+  }
+  double elapsed = monotonicSeconds() - start;
+  if (elapsed <= 0) elapsed = 1e-9;
+
+  printf("Capture:          %s, %llu bytes on the wire\n", opts.capturePath, (unsigned long long)data.bytes);
+  printf("Messages:         %llu for node %u or broadcast, %llu data bytes\n", (unsigned long long)messages,
+         opts.address, (unsigned long long)dataBytes);
+  for (uint32_t c = 0; c < 256; c++) {
+    if (!commandCount[c]) continue;
+    const char *name = commandName(c);
+    if (name) {
+      printf("  %-14s %llu\n", name, (unsigned long long)commandCount[c]);
+    } else {
+      printf("  0x%02X           %llu\n", c, (unsigned long long)commandCount[c]);
+    }
+  }
+  printf("Replayed in:      %.3f s (%.0f messages/s, %.1f MB/s on the wire)\n", elapsed,
+         messages / elapsed, data.bytes / 1e6 / elapsed);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  parseOptions(argc, argv);
+
+  CaptureReader capture;
+  if (!capture.open(opts.capturePath)) {
+    return 1;
+  }
+
+  if (strcmp(opts.action, "analyze") == 0) {
+    return analyze(capture);
+  }
+  if (strcmp(opts.action, "replay") == 0) {
+    return replay(capture);
+  }
+  usage(argv[0]);
+  return 1;
+}
@@ -0,0 +1,574 @@
+/*****************************************************************************
+*
+* Programs several RS485 buses at the same time, one worker thread per
+* serial port. Each image is encoded once (see ImageFrames.h) and every
+* worker sends from that same read-only copy.
+*
+*   multidrop_daemon --bus /dev/ttyUSB0,signal=cts --bus /dev/ttyUSB1,signal=cts program.hex
+*
+* Without an image on the command line, it keeps running and reads jobs
+* from stdin, one per line: the image path followed by the bus numbers to
+* program (all of them if there are none).
+*
+*   program.hex
+*   other.hex 0 2
+*
+****************************************************************************/
+
+#include <condition_variable>
+#include <getopt.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#include "DiscobusDataPosix.h"
+#include "Image.h"
+#include "ImageFrames.h"
+#include "MultidropProgrammer.h"
+#include "SessionPlanner.h"
+
+struct BusConfig {
+  std::string device;
+  uint32_t baud;
+  DiscobusDataPosix::ModemLine deLine;
+  DiscobusDataPosix::ModemLine signalLine;
+  uint8_t signalInverted;
+  std::string signalFile;
+  std::string capturePath;
+  std::string historyPath;
+};
+
+struct options {
+  std::vector<BusConfig> buses;
+  const char *imagePath;
+  int16_t command;
+  uint32_t commandWaitMs;
+  uint32_t progressMs;
+  uint8_t tune;
+  uint32_t minPageGapUs;
+  ProgrammerSettings settings;
+};
+
+static struct options opts;
+
+/**
+ * Programs one bus. The thread lives as long as the daemon and waits
+ * for jobs, so the port stays open between them.
+ */
+class BusWorker {
+public:
+  BusWorker(const BusConfig &_config)
+    : config(_config),
+      bus(config.device.c_str(), config.deLine, config.signalLine, config.signalInverted),
+      programmer(&bus, opts.settings) {
+    busy = false;
+    quit = false;
+    opened = false;
+    result = MultidropProgrammer::PROG_NO_NODES;
+  }
+
+  // Open the port. Returns 0 if it can't be opened.
+  uint8_t open() {
+    bus.begin(config.baud);
+    if (!bus.isOpen()) {
+      return 0;
+    }
+    if (config.signalFile.size() && !bus.setSignalFile(config.signalFile.c_str())) {
+      return 0;
+    }
+    if (config.capturePath.size()) {
+      if (!capture.open(config.capturePath.c_str(), config.baud)) {
+        return 0;
+      }
+      bus.setCapture(&capture);
+    }
+    opened = true;
+    thread = std::thread(&BusWorker::run, this);
+    return 1;
+  }
+
+  // Stop the thread once the current job is done
+  void stop() {
+    if (!opened) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = true;
+    }
+    wake.notify_all();
+    thread.join();
+  }
+
+  // Start programming an image in the background
+  void submit(std::shared_ptr<ImageFrames> _frames) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      frames = _frames;
+      busy = true;
+    }
+    wake.notify_all();
+  }
+
+  // Is a job still running
+  uint8_t isBusy() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return busy;
+  }
+
+  // Wait for the current job to finish
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return !busy; });
+  }
+
+  const BusConfig &getConfig() {
+    return config;
+  }
+
+  MultidropProgrammer &getProgrammer() {
+    return programmer;
+  }
+
+  // Only valid once the job is done
+  MultidropProgrammer::result_t getResult() {
+    return result;
+  }
+
+private:
+  BusConfig config;
+  CaptureWriter capture;  // Before the bus, which records to it until it's closed
+  DiscobusDataPosix bus;
+  MultidropProgrammer programmer;
+  MultidropProgrammer::result_t result;
+
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable wake,
+                          done;
+  std::shared_ptr<ImageFrames> frames;
+  uint8_t busy,
+          quit,
+          opened;
+
+  // Pick the page gap and checkpoint interval that should be quickest on this bus
+  void tune(const ImageFrames &job, const SessionHistory &history) {
+    SessionPlanner planner;
+    planner.setImage(job);
+    planner.setSettings(config.baud, opts.settings);
+    planner.minPageGapUs = opts.minPageGapUs;
+
+    std::vector<SessionChoice> choices;
+    uint32_t best = planner.plan(history, &choices);
+
+    ProgrammerSettings settings = opts.settings;
+    SessionPlanner::apply(choices[best], &settings);
+    programmer.setSettings(settings);
+  }
+
+  void run() {
+    while (true) {
+      std::shared_ptr<ImageFrames> job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [this] { return quit || (busy && frames); });
+        if (!busy) {
+          return;
+        }
+        job = frames;
+      }
+
+      SessionHistory history;
+      if (config.historyPath.size()) {
+        history.load(config.historyPath.c_str());
+        if (opts.tune) {
+          tune(*job, history);
+        }
+      }
+
+      if (opts.command >= 0) {
+        programmer.sendCommand(opts.command);
+        usleep(opts.commandWaitMs * 1000);
+      }
+      result = programmer.program(*job);
+
+      if (config.historyPath.size() &&
+          (result == MultidropProgrammer::PROG_DONE || result == MultidropProgrammer::PROG_GAVE_UP)) {
+        history.add(sessionRecord(config.baud, programmer.getSettings(), job->pageCount(), programmer.getStats(),
+                                  programmer.getErrorPages(), result == MultidropProgrammer::PROG_DONE));
+        history.save(config.historyPath.c_str());
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        frames.reset();
+        busy = false;
+      }
+      done.notify_all();
+    }
+  }
+};
+
+/**
+ * Encoded images, so a job that's repeated doesn't encode the image again.
+ * An entry is replaced when the file's size or modification time changes.
+ */
+struct CachedFrames {
+  time_t mtime;
+  off_t size;
+  std::vector<uint8_t> image;
+  std::shared_ptr<ImageFrames> frames;
+};
+
+static std::map<std::string, CachedFrames> frameCache;
+
+static const CachedFrames* loadFrames(const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0) {
+    perror(path.c_str());
+    return NULL;
+  }
+
+  std::map<std::string, CachedFrames>::iterator it = frameCache.find(path);
+  if (it != frameCache.end() && it->second.mtime == st.st_mtime && it->second.size == st.st_size) {
+    return &it->second;
+  }
+
+  CachedFrames entry;
+  entry.mtime = st.st_mtime;
+  entry.size = st.st_size;
+  if (!loadImage(path.c_str(), entry.image)) {
+    return NULL;
+  }
+  uint32_t pages = (entry.image.size() + opts.settings.pageSize - 1) / opts.settings.pageSize;
+  if (pages > 255) {
+    fprintf(stderr, "%s: %u pages, the bootloader can only take 255\n", path.c_str(), pages);
+    return NULL;
+  }
+
+  entry.frames = std::make_shared<ImageFrames>();
+  if (!entry.frames->encode(entry.image, opts.settings.pageSize, opts.settings.escaped)) {
+    perror("Encoding the image");
+    return NULL;
+  }
+
+  frameCache[path] = entry;
+  return &frameCache[path];
+}
+
+static const char* resultName(MultidropProgrammer::result_t result) {
+  switch (result) {
+    case MultidropProgrammer::PROG_DONE:     return "done";
+    case MultidropProgrammer::PROG_CURRENT:  return "current";
+    case MultidropProgrammer::PROG_NO_NODES: return "no nodes";
+    case MultidropProgrammer::PROG_GAVE_UP:
+    default:                                 return "gave up";
+  }
+}
+
+/**
+ * Program `image` on the buses in `selected` and report on them.
+ * Returns 1 if every bus finished.
+ */
+static uint8_t runJob(std::vector<BusWorker*> &workers, const std::vector<uint16_t> &selected,
+                      const std::string &path) {
+  const CachedFrames *cached = loadFrames(path);
+  if (!cached) {
+    return 0;
+  }
+  std::shared_ptr<ImageFrames> frames = cached->frames;
+  uint16_t pages = frames->pageCount();
+
+  fprintf(stderr, "%s: %u bytes, %u pages, %u encoded bytes, %u buses\n",
+          path.c_str(), (uint32_t)cached->image.size(), pages,
+          (uint32_t)frames->size(), (uint32_t)selected.size());
+
+  for (size_t i = 0; i < selected.size(); i++) {
+    workers[selected[i]]->submit(frames);
+  }
+
+  // Report progress until every bus is done
+  uint8_t running = 1;
+  while (running) {
+    usleep(opts.progressMs * 1000);
+
+    running = 0;
+    std::ostringstream line;
+    for (size_t i = 0; i < selected.size(); i++) {
+      BusWorker *worker = workers[selected[i]];
+      uint16_t page, round;
+      worker->getProgrammer().getProgress(&page, &round);
+
+      line << " [" << selected[i] << "] ";
+      if (worker->isBusy()) {
+        running = 1;
+        line << (page + 1) << "/" << pages;
+        if (round) {
+          line << " r" << round;
+        }
+      } else {
+        line << resultName(worker->getResult());
+      }
+    }
+    fprintf(stderr, "\r%s ", line.str().c_str());
+  }
+  fprintf(stderr, "\n");
+
+  // Per bus stats
+  uint8_t success = 1;
+  printf("%-4s %-24s %-9s %8s %10s %14s %7s %9s %8s %10s\n",
+         "Bus", "Device", "Result", "Seconds", "Bytes", "Retransmitted", "Rounds", "Restarts", "Gap us", "Checkpoint");
+  for (size_t i = 0; i < selected.size(); i++) {
+    BusWorker *worker = workers[selected[i]];
+    worker->wait();
+
+    MultidropProgrammer::result_t result = worker->getResult();
+    const ProgrammerStats &stats = worker->getProgrammer().getStats();
+    const ProgrammerSettings &settings = worker->getProgrammer().getSettings();
+    char checkpoint[8];
+    snprintf(checkpoint, sizeof(checkpoint), settings.checkpointPages ? "%u" : "end", settings.checkpointPages);
+    printf("%-4u %-24s %-9s %8.3f %10u %14u %7u %9u %8u %10s\n",
+           selected[i], worker->getConfig().device.c_str(), resultName(result),
+           stats.seconds, stats.bytesSent, stats.bytesRetransmitted, stats.rounds, stats.restarts,
+           settings.pageGapUs, checkpoint);
+
+    if (result != MultidropProgrammer::PROG_DONE && result != MultidropProgrammer::PROG_CURRENT) {
+      success = 0;
+    }
+  }
+  fflush(stdout);
+  return success;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+    "Usage: %s [options] --bus DEVICE[,OPTIONS] ... [PROGRAM.hex|PROGRAM.bin]\n"
+    "  -B, --bus SPEC          Add a bus. SPEC is the serial port followed by any of:\n"
+    "                            ,baud=BAUD        (default: --baud)\n"
+    "                            ,de=LINE          rts, dtr or none\n"
+    "                            ,signal=LINE      cts, dsr, dcd, ri or none\n"
+    "                            ,inverted         the signal input reads as asserted when high\n"
+    "                            ,signal-file=PATH read the signal line from a file\n"
+    "                            ,capture=PATH     record the bus traffic (see multidrop_capture)\n"
+    "                            ,history=PATH     add each session to this bus's history\n"
+    "  -b, --baud BAUD         Default baud rate of the buses (default 115200)\n"
+    "  -p, --page-size N       Flash page size of the nodes (default 128)\n"
+    "      --digest            Nodes use the image digest (USE_IMAGE_DIGEST)\n"
+    "      --escaped           Nodes use escaped framing (ESCAPED_FRAMING)\n"
+    "      --start-gap US      Wait after the START message (default 5000)\n"
+    "      --page-gap US       Wait after each page (default 9200)\n"
+    "  -r, --max-rounds N      Retransmission rounds before giving up (default 10)\n"
+    "      --checkpoint N      Resend after N pages if one failed (default: at the end of the image)\n"
+    "      --tune              Pick each bus's page gap and checkpoint interval from its history\n"
+    "      --min-page-gap US   Never try a page gap shorter than this (default: half of --page-gap)\n"
+    "  -c, --command CMD       Broadcast this DiscoBus command first, to reboot the nodes into the bootloader\n"
+    "      --command-wait MS   Wait after the command (default 500)\n"
+    "      --progress-ms MS    How often to report progress (default 500)\n"
+    "\n"
+    "Without a program, jobs are read from stdin: a program path, then the bus\n"
+    "numbers to program (all buses if none are given).\n",
+    name);
+  exit(1);
+}
+
+// Parse "DEVICE[,key=value...]"
+static uint8_t parseBus(const char *spec, uint32_t defaultBaud, BusConfig *config) {
+  std::stringstream ss(spec);
+  std::string part;
+
+  config->baud = defaultBaud;
+  config->deLine = DiscobusDataPosix::LINE_NONE;
+  config->signalLine = DiscobusDataPosix::LINE_NONE;
+  config->signalInverted = false;
+
+  if (!std::getline(ss, config->device, ',') || config->device.empty()) {
+    return 0;
+  }
+
+  while (std::getline(ss, part, ',')) {
+    std::string key = part, value;
+    size_t eq = part.find('=');
+    if (eq != std::string::npos) {
+      key = part.substr(0, eq);
+      value = part.substr(eq + 1);
+    }
+
+    if (key == "baud") {
+      config->baud = atoi(value.c_str());
+      if (config->baud == 0) {
+        return 0;
+      }
+    }
+    else if (key == "de") {
+      if (!DiscobusDataPosix::parseModemLine(value.c_str(), &config->deLine) ||
+          (config->deLine != DiscobusDataPosix::LINE_NONE &&
+           config->deLine != DiscobusDataPosix::LINE_RTS &&
+           config->deLine != DiscobusDataPosix::LINE_DTR)) {
+        return 0;
+      }
+    }
+    else if (key == "signal") {
+      if (!DiscobusDataPosix::parseModemLine(value.c_str(), &config->signalLine) ||
+          config->signalLine == DiscobusDataPosix::LINE_RTS ||
+          config->signalLine == DiscobusDataPosix::LINE_DTR) {
+        return 0;
+      }
+    }
+    else if (key == "inverted") {
+      config->signalInverted = true;
+    }
+    else if (key == "signal-file") {
+      config->signalFile = value;
+    }
+    else if (key == "capture") {
+      config->capturePath = value;
+    }
+    else if (key == "history") {
+      config->historyPath = value;
+    }
+    else {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void parseOptions(int argc, char **argv) {
+  static struct option longOpts[] = {
+    { "bus",          required_argument, 0, 'B' },
+    { "baud",         required_argument, 0, 'b' },
+    { "page-size",    required_argument, 0, 'p' },
+    { "digest",       no_argument,       0, 'G' },
+    { "escaped",      no_argument,       0, 'E' },
+    { "start-gap",    required_argument, 0, 's' },
+    { "page-gap",     required_argument, 0, 'g' },
+    { "max-rounds",   required_argument, 0, 'r' },
+    { "checkpoint",   required_argument, 0, 'k' },
+    { "tune",         no_argument,       0, 'T' },
+    { "min-page-gap", required_argument, 0, 'm' },
+    { "command",      required_argument, 0, 'c' },
+    { "command-wait", required_argument, 0, 'w' },
+    { "progress-ms",  required_argument, 0, 'P' },
+    { 0, 0, 0, 0 }
+  };
+
+  uint32_t baud = 115200;
+  std::vector<const char*> specs;
+
+  opts.command = -1;
+  opts.commandWaitMs = 500;
+  opts.progressMs = 500;
+  MultidropProgrammer::defaultSettings(&opts.settings);
+
+  int c;
+  while ((c = getopt_long(argc, argv, "B:b:p:r:c:", longOpts, NULL)) != -1) {
+    switch (c) {
+      case 'B': specs.push_back(optarg); break;
+      case 'b': baud = atoi(optarg); break;
+      case 'p': opts.settings.pageSize = atoi(optarg); break;
+      case 'G': opts.settings.useDigest = true; break;
+      case 'E': opts.settings.escaped = true; break;
+      case 's': opts.settings.startGapUs = atoi(optarg); break;
+      case 'g': opts.settings.pageGapUs = atoi(optarg); break;
+      case 'r': opts.settings.maxRounds = atoi(optarg); break;
+      case 'k': opts.settings.checkpointPages = atoi(optarg); break;
+      case 'T': opts.tune = true; break;
+      case 'm': opts.minPageGapUs = atoi(optarg); break;
+      case 'c': opts.command = strtol(optarg, NULL, 0) & 0xFF; break;
+      case 'w': opts.commandWaitMs = atoi(optarg); break;
+      case 'P': opts.progressMs = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if (optind < argc - 1 || specs.empty() || baud == 0 || opts.progressMs == 0 ||
+      opts.settings.pageSize == 0 || opts.settings.pageSize > 255) {
+    usage(argv[0]);
+  }
+  opts.imagePath = (optind < argc) ? argv[optind] : NULL;
+  if (!opts.minPageGapUs) {
+    opts.minPageGapUs = opts.settings.pageGapUs / 2;
+  }
+
+  // Bus options can come before --baud
+  for (size_t i = 0; i < specs.size(); i++) {
+    BusConfig config;
+    if (!parseBus(specs[i], baud, &config)) {
+      fprintf(stderr, "Invalid bus: %s\n", specs[i]);
+      usage(argv[0]);
+    }
+    opts.buses.push_back(config);
+  }
+}
+
+int main(int argc, char **argv) {
+  parseOptions(argc, argv);
+
+  std::vector<BusWorker*> workers;
+  std::vector<uint16_t> allBuses;
+  uint8_t success = 1;
+
+  for (size_t i = 0; i < opts.buses.size(); i++) {
+    BusWorker *worker = new BusWorker(opts.buses[i]);
+    workers.push_back(worker);
+    if (!worker->open()) {
+      fprintf(stderr, "Could not open bus %u (%s)\n", (uint32_t)i, opts.buses[i].device.c_str());
+      success = 0;
+      break;
+    }
+    allBuses.push_back(i);
+  }
+
+  if (success) {
+    if (opts.imagePath) {
+      success = runJob(workers, allBuses, opts.imagePath);
+    }
+    else {
+      char buf[1024];
+      while (fgets(buf, sizeof(buf), stdin)) {
+        std::istringstream job(buf);
+        std::string path;
+        if (!(job >> path) || path[0] == '#') {
+          continue;
+        }
+
+        std::vector<uint16_t> selected;
+        uint32_t num;
+        uint8_t valid = 1;
+        while (job >> num) {
+          if (num >= workers.size()) {
+            fprintf(stderr, "There's no bus %u\n", num);
+            valid = 0;
+          }
+          selected.push_back(num);
+        }
+        if (!job.eof()) {
+          fprintf(stderr, "Invalid job: %s", buf);
+          valid = 0;
+        }
+        if (!valid) {
+          success = 0;
+          continue;
+        }
+
+        if (!runJob(workers, selected.size() ? selected : allBuses, path)) {
+          success = 0;
+        }
+      }
+    }
+  }
+
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i]->stop();
+    delete workers[i];
+  }
+  return success ? 0 : 2;
+}
@@ -0,0 +1,296 @@
+/*****************************************************************************
+*
+* Plans how an image will be sent: which pages are blank, repeated, or the
+* same as in the image deployed last, and how many bytes go on the wire.
+* With a bus's session history, also which page gap and checkpoint interval
+* the programmer would pick, and how long it expects the session to take.
+*
+*   multidrop_plan --page-size 128 --cache bus.digests program.elf
+*   multidrop_plan --page-size 128 --cache bus.digests --record program.elf
+*   multidrop_plan --page-size 128 --history bus.sessions program.elf
+*   multidrop_plan --page-size 128 --error-rate 0.05 program.elf
+*
+****************************************************************************/
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "Image.h"
+#include "ImageFrames.h"
+#include "PagePlanner.h"
+#include "SessionPlanner.h"
+
+struct options {
+  const char *imagePath;
+  const char *cachePath;
+  uint16_t pageSize;
+  uint8_t escaped;
+  uint8_t hasBase;
+  uint32_t baseDigest;
+  uint8_t record;
+  uint8_t listPages;
+  const char *historyPath;
+  double errorRate;
+  uint32_t baud;
+  uint32_t minPageGapUs;
+  ProgrammerSettings settings;
+};
+
+static struct options opts;
+
+static double monotonicSeconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+    "Usage: %s [options] PROGRAM.elf|PROGRAM.hex|PROGRAM.bin\n"
+    "  -p, --page-size N       Flash page size of the nodes (default 128)\n"
+    "      --escaped           Nodes use escaped framing (ESCAPED_FRAMING)\n"
+    "  -c, --cache FILE        Page digests of deployed images\n"
+    "      --base DIGEST       Compare with this deployed image (default: the last one in the cache)\n"
+    "      --record            Add this image to the cache as the latest deployed one\n"
+    "  -l, --pages             List every page\n"
+    "      --history FILE      Plan the session from the bus's history (see --history in multidrop_program)\n"
+    "      --error-rate P      Show the expected session time at each checkpoint interval with this page error rate\n"
+    "  -b, --baud BAUD         Bus baud rate (default 115200)\n"
+    "      --start-gap US      Wait after the START message (default 5000)\n"
+    "      --page-gap US       Wait after each page (default 9200)\n"
+    "  -r, --max-rounds N      Retransmission rounds before giving up (default 10)\n"
+    "      --min-page-gap US   Never try a page gap shorter than this (default: half of --page-gap)\n",
+    name);
+  exit(1);
+}
+
+static void parseOptions(int argc, char **argv) {
+  static struct option longOpts[] = {
+    { "page-size",    required_argument, 0, 'p' },
+    { "escaped",      no_argument,       0, 'E' },
+    { "cache",        required_argument, 0, 'c' },
+    { "base",         required_argument, 0, 'B' },
+    { "record",       no_argument,       0, 'R' },
+    { "pages",        no_argument,       0, 'l' },
+    { "history",      required_argument, 0, 'H' },
+    { "error-rate",   required_argument, 0, 'e' },
+    { "baud",         required_argument, 0, 'b' },
+    { "start-gap",    required_argument, 0, 's' },
+    { "page-gap",     required_argument, 0, 'g' },
+    { "max-rounds",   required_argument, 0, 'r' },
+    { "min-page-gap", required_argument, 0, 'm' },
+    { 0, 0, 0, 0 }
+  };
+
+  opts.pageSize = 128;
+  opts.errorRate = -1;
+  opts.baud = 115200;
+  MultidropProgrammer::defaultSettings(&opts.settings);
+
+  int c;
+  while ((c = getopt_long(argc, argv, "p:c:lb:r:", longOpts, NULL)) != -1) {
+    switch (c) {
+      case 'p': opts.pageSize = atoi(optarg); break;
+      case 'E': opts.escaped = true; break;
+      case 'c': opts.cachePath = optarg; break;
+      case 'B':
+        opts.hasBase = true;
+        opts.baseDigest = strtoul(optarg, NULL, 16);
+        break;
+      case 'R': opts.record = true; break;
+      case 'l': opts.listPages = true; break;
+      case 'H': opts.historyPath = optarg; break;
+      case 'e': opts.errorRate = atof(optarg); break;
+      case 'b': opts.baud = atoi(optarg); break;
+      case 's': opts.settings.startGapUs = atoi(optarg); break;
+      case 'g': opts.settings.pageGapUs = atoi(optarg); break;
+      case 'r': opts.settings.maxRounds = atoi(optarg); break;
+      case 'm': opts.minPageGapUs = atoi(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 1 || opts.pageSize == 0 || opts.pageSize > 255 ||
+      ((opts.hasBase || opts.record) && !opts.cachePath)) {
+    usage(argv[0]);
+  }
+  opts.imagePath = argv[optind];
+
+  if (opts.baud == 0 || opts.errorRate >= 1) {
+    usage(argv[0]);
+  }
+  opts.settings.pageSize = opts.pageSize;
+  opts.settings.escaped = opts.escaped;
+  if (!opts.minPageGapUs) {
+    opts.minPageGapUs = opts.settings.pageGapUs / 2;
+  }
+}
+
+// The expected cost of every checkpoint interval, at a known page error rate
+static void printCosts(const ImageFrames &frames) {
+  // The planner's timing, without any host overhead
+  uint32_t len, pageBytes = 0, startEndBytes = 0;
+  for (uint16_t i = 0; i < frames.pageCount(); i++) {
+    frames.page(i, &len);
+    pageBytes += len;
+  }
+  frames.start(&len);
+  startEndBytes += len;
+  frames.end(&len);
+  startEndBytes += len;
+
+  SessionModel model;
+  model.pages = frames.pageCount();
+  model.startSeconds = startEndBytes * 10.0 / opts.baud + opts.settings.startGapUs / 1e6;
+  model.pageSeconds = (double)pageBytes / model.pages * 10.0 / opts.baud + opts.settings.pageGapUs / 1e6;
+  model.pageErrorRate = opts.errorRate;
+
+  printf("\n%-10s %12s %12s %10s\n", "Checkpoint", "Expected s", "Pages sent", "Rounds");
+  for (uint8_t k = 0; k < sessionCheckpointCount; k++) {
+    SessionCost cost = expectedCost(model, sessionCheckpoints[k]);
+    if (sessionCheckpoints[k]) {
+      printf("%-10u", sessionCheckpoints[k]);
+    } else {
+      printf("%-10s", "end");
+    }
+    printf(" %12.3f %12.1f %10.1f\n", cost.seconds, cost.pagesSent, cost.rounds);
+  }
+}
+
+// Which settings the programmer would pick from a bus's history
+static uint8_t printSessionPlan(const ImageFrames &frames) {
+  SessionHistory history;
+  if (!history.load(opts.historyPath)) {
+    return 0;
+  }
+
+  SessionPlanner planner;
+  planner.setImage(frames);
+  planner.setSettings(opts.baud, opts.settings);
+  planner.minPageGapUs = opts.minPageGapUs;
+
+  std::vector<SessionChoice> choices;
+  uint32_t best = planner.plan(history, &choices);
+  const SessionChoice &choice = choices[best];
+
+  printf("\nSessions:         %u in %s\n", (uint32_t)history.records.size(), opts.historyPath);
+  printf("Session plan:     page gap %u us, ", choice.pageGapUs);
+  if (choice.checkpointPages) {
+    printf("resend every %u pages", choice.checkpointPages);
+  } else {
+    printf("resend at the end of the image");
+  }
+  printf(", %.3f s expected\n", choice.cost.seconds);
+
+  uint32_t fastest = best;
+  for (uint32_t i = 0; i < choices.size(); i++) {
+    if (choices[i].cost.seconds < choices[fastest].cost.seconds) {
+      fastest = i;
+    }
+  }
+  if (choices[fastest].baud != opts.baud) {
+    printf("Faster baud:      %u (%.3f s expected), if the nodes are rebuilt with SERIAL_BAUD=%u\n",
+           choices[fastest].baud, choices[fastest].cost.seconds, choices[fastest].baud);
+  }
+
+  printf("\n%-8s %8s %10s %10s %8s %10s %8s\n", "Baud", "Gap us", "Checkpoint", "Error rate", "Sessions",
+         "Expected s", "Rounds");
+  for (uint32_t i = 0; i < choices.size(); i++) {
+    const SessionChoice &c = choices[i];
+    char checkpoint[8];
+    snprintf(checkpoint, sizeof(checkpoint), c.checkpointPages ? "%u" : "end", c.checkpointPages);
+    printf("%-8u %8u %10s %10.4f %8u %10.3f %8.1f%s\n", c.baud, c.pageGapUs, checkpoint, c.pageErrorRate,
+           c.sessions, c.cost.seconds, c.cost.rounds, (i == best) ? "  <" : "");
+  }
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  parseOptions(argc, argv);
+
+  double start = monotonicSeconds();
+
+  std::vector<uint8_t> image;
+  if (!loadImage(opts.imagePath, image)) {
+    return 1;
+  }
+
+  PageDigestCache cache;
+  const std::vector<uint64_t> *base = NULL;
+  if (opts.cachePath) {
+    if (!cache.load(opts.cachePath)) {
+      return 1;
+    }
+
+    // Compare with the last deployed image by default, if it had the same page size
+    uint16_t basePageSize;
+    if (!opts.hasBase) {
+      opts.hasBase = cache.latest(&opts.baseDigest, &basePageSize) && basePageSize == opts.pageSize;
+    }
+    if (opts.hasBase) {
+      base = cache.find(opts.baseDigest, opts.pageSize);
+      if (!base) {
+        fprintf(stderr, "%08X with %u byte pages isn't in %s\n", opts.baseDigest, opts.pageSize, opts.cachePath);
+        return 1;
+      }
+    }
+  }
+
+  PagePlan plan;
+  plan.plan(image, opts.pageSize, opts.escaped, base);
+  double elapsed = monotonicSeconds() - start;
+
+  uint32_t pages = plan.pages.size();
+  printf("Image:            %s, %u bytes, digest %08X\n", opts.imagePath, (uint32_t)image.size(), plan.imageDigest);
+  printf("Pages:            %u of %u bytes%s\n", pages, opts.pageSize,
+         (pages > 255) ? " (too many, the bootloader can only take 255)" : "");
+  printf("Blank pages:      %u (sent empty)\n", plan.blankPages);
+  printf("Duplicate pages:  %u\n", plan.duplicatePages);
+  if (base) {
+    printf("Unchanged pages:  %u (since %08X)\n", plan.unchangedPages, opts.baseDigest);
+  }
+  printf("Bytes on wire:    %u (%u with whole pages, %.1f%% saved)\n", plan.wireBytes, plan.fullWireBytes,
+         100.0 * (plan.fullWireBytes - plan.wireBytes) / plan.fullWireBytes);
+  printf("Planned in:       %.3f ms\n", elapsed * 1000);
+
+  if (opts.listPages) {
+    printf("\n%-6s %-16s %-9s %5s %s\n", "Page", "Digest", "Kind", "Bytes", "Notes");
+    for (uint32_t i = 0; i < pages; i++) {
+      const PagePlanEntry &entry = plan.pages[i];
+      const char *kind = (entry.kind == PagePlanEntry::PAGE_BLANK) ? "blank" :
+                         (entry.kind == PagePlanEntry::PAGE_DUPLICATE) ? "duplicate" : "data";
+      printf("%-6u %016llX %-9s %5u", i, (unsigned long long)entry.digest, kind, entry.sendLen);
+      if (entry.sameAs >= 0) {
+        printf(" same as %d", entry.sameAs);
+      }
+      if (entry.unchanged) {
+        printf(" unchanged");
+      }
+      printf("\n");
+    }
+  }
+
+  if (opts.historyPath || opts.errorRate >= 0) {
+    ImageFrames frames;
+    if (pages > 255 || !frames.encode(image, opts.pageSize, opts.escaped)) {
+      fprintf(stderr, "Can't encode the image\n");
+      return 1;
+    }
+    if (opts.errorRate >= 0) {
+      printCosts(frames);
+    }
+    if (opts.historyPath && !printSessionPlan(frames)) {
+      return 1;
+    }
+  }
+
+  if (opts.record) {
+    cache.add(plan.imageDigest, opts.pageSize, plan.pageDigests);
+    if (!cache.save(opts.cachePath)) {
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,251 @@
+/*****************************************************************************
+*
+* Programs every node on an RS485 bus through a serial port, using the
+* bootloader protocol described in the README.
+*
+*   multidrop_program --device /dev/ttyUSB0 --signal cts --page-size 128 program.hex
+*
+****************************************************************************/
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "DiscobusDataPosix.h"
+#include "Image.h"
+#include "ImageFrames.h"
+#include "MultidropProgrammer.h"
+#include "SessionPlanner.h"
+
+struct options {
+  const char *device;
+  const char *imagePath;
+  uint32_t baud;
+  DiscobusDataPosix::ModemLine deLine;
+  DiscobusDataPosix::ModemLine signalLine;
+  uint8_t signalInverted;
+  const char *signalFile;
+  const char *capturePath;
+  const char *historyPath;
+  uint8_t tune;
+  uint32_t minPageGapUs;
+  int16_t command;
+  uint32_t commandWaitMs;
+  ProgrammerSettings settings;
+};
+
+static struct options opts;
+
+static void usage(const char *name) {
+  fprintf(stderr,
+    "Usage: %s [options] PROGRAM.hex|PROGRAM.bin\n"
+    "  -d, --device PATH       Serial port\n"
+    "  -b, --baud BAUD         Bus baud rate (default 115200)\n"
+    "  -p, --page-size N       Flash page size of the nodes (default 128)\n"
+    "      --de LINE           Output wired to the transceiver's DE pin: rts, dtr or none (default)\n"
+    "      --signal LINE       Input wired to the signal line: cts, dsr, dcd, ri or none (default)\n"
+    "      --signal-inverted   The signal input reads as asserted when the line is high\n"
+    "      --signal-file PATH  Read the signal line from a file instead (see --bridge in sim/multidrop_sim)\n"
+    "      --digest            Nodes use the image digest (USE_IMAGE_DIGEST)\n"
+    "      --escaped           Nodes use escaped framing (ESCAPED_FRAMING)\n"
+    "      --start-gap US      Wait after the START message (default 5000)\n"
+    "      --page-gap US       Wait after each page (default 9200)\n"
+    "  -r, --max-rounds N      Retransmission rounds before giving up (default 10)\n"
+    "      --checkpoint N      Resend after N pages if one failed (default: at the end of the image)\n"
+    "  -c, --command CMD       Broadcast this DiscoBus command first, to reboot the nodes into the bootloader\n"
+    "      --command-wait MS   Wait after the command (default 500)\n"
+    "      --capture PATH      Record the bus traffic to a capture file (see multidrop_capture)\n"
+    "      --history PATH      Add each session to this bus's history\n"
+    "      --tune              Pick the page gap and checkpoint interval from the history\n"
+    "      --min-page-gap US   Never try a page gap shorter than this (default: half of --page-gap)\n"
+    "  -v, --verbose           Print progress\n"
+    "\n"
+    "Without a signal line the pages are only sent once, since errors can't be detected.\n",
+    name);
+  exit(1);
+}
+
+static void parseOptions(int argc, char **argv) {
+  static struct option longOpts[] = {
+    { "device",          required_argument, 0, 'd' },
+    { "baud",            required_argument, 0, 'b' },
+    { "page-size",       required_argument, 0, 'p' },
+    { "de",              required_argument, 0, 'D' },
+    { "signal",          required_argument, 0, 'S' },
+    { "signal-inverted", no_argument,       0, 'I' },
+    { "signal-file",     required_argument, 0, 'F' },
+    { "digest",          no_argument,       0, 'G' },
+    { "escaped",         no_argument,       0, 'E' },
+    { "start-gap",       required_argument, 0, 's' },
+    { "page-gap",        required_argument, 0, 'g' },
+    { "max-rounds",      required_argument, 0, 'r' },
+    { "command",         required_argument, 0, 'c' },
+    { "command-wait",    required_argument, 0, 'w' },
+    { "checkpoint",      required_argument, 0, 'k' },
+    { "capture",         required_argument, 0, 'C' },
+    { "history",         required_argument, 0, 'H' },
+    { "tune",            no_argument,       0, 'T' },
+    { "min-page-gap",    required_argument, 0, 'm' },
+    { "verbose",         no_argument,       0, 'v' },
+    { 0, 0, 0, 0 }
+  };
+
+  opts.baud = 115200;
+  opts.command = -1;
+  opts.commandWaitMs = 500;
+  MultidropProgrammer::defaultSettings(&opts.settings);
+
+  int c;
+  while ((c = getopt_long(argc, argv, "d:b:p:r:c:v", longOpts, NULL)) != -1) {
+    switch (c) {
+      case 'd': opts.device = optarg; break;
+      case 'b': opts.baud = atoi(optarg); break;
+      case 'p': opts.settings.pageSize = atoi(optarg); break;
+      case 'D':
+        if (!DiscobusDataPosix::parseModemLine(optarg, &opts.deLine) ||
+            (opts.deLine != DiscobusDataPosix::LINE_NONE &&
+             opts.deLine != DiscobusDataPosix::LINE_RTS &&
+             opts.deLine != DiscobusDataPosix::LINE_DTR)) {
+          usage(argv[0]);
+        }
+        break;
+      case 'S':
+        if (!DiscobusDataPosix::parseModemLine(optarg, &opts.signalLine) ||
+            opts.signalLine == DiscobusDataPosix::LINE_RTS ||
+            opts.signalLine == DiscobusDataPosix::LINE_DTR) {
+          usage(argv[0]);
+        }
+        break;
+      case 'I': opts.signalInverted = true; break;
+      case 'F': opts.signalFile = optarg; break;
+      case 'G': opts.settings.useDigest = true; break;
+      case 'E': opts.settings.escaped = true; break;
+      case 's': opts.settings.startGapUs = atoi(optarg); break;
+      case 'g': opts.settings.pageGapUs = atoi(optarg); break;
+      case 'r': opts.settings.maxRounds = atoi(optarg); break;
+      case 'c': opts.command = strtol(optarg, NULL, 0) & 0xFF; break;
+      case 'w': opts.commandWaitMs = atoi(optarg); break;
+      case 'k': opts.settings.checkpointPages = atoi(optarg); break;
+      case 'C': opts.capturePath = optarg; break;
+      case 'H': opts.historyPath = optarg; break;
+      case 'T': opts.tune = true; break;
+      case 'm': opts.minPageGapUs = atoi(optarg); break;
+      case 'v': opts.settings.verbose = true; break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 1 || !opts.device) {
+    usage(argv[0]);
+  }
+  opts.imagePath = argv[optind];
+
+  if (opts.baud == 0 || opts.settings.pageSize == 0 || opts.settings.pageSize > 255 ||
+      (opts.tune && !opts.historyPath)) {
+    usage(argv[0]);
+  }
+  if (!opts.minPageGapUs) {
+    opts.minPageGapUs = opts.settings.pageGapUs / 2;
+  }
+}
+
+// Pick the page gap and checkpoint interval that should be quickest on this bus
+static void tune(const ImageFrames &frames, const SessionHistory &history) {
+  SessionPlanner planner;
+  planner.setImage(frames);
+  planner.setSettings(opts.baud, opts.settings);
+  planner.minPageGapUs = opts.minPageGapUs;
+
+  std::vector<SessionChoice> choices;
+  uint32_t best = planner.plan(history, &choices);
+  const SessionChoice &choice = choices[best];
+  SessionPlanner::apply(choice, &opts.settings);
+
+  printf("Page gap %u us, ", choice.pageGapUs);
+  if (choice.checkpointPages) {
+    printf("resend every %u pages", choice.checkpointPages);
+  } else {
+    printf("resend at the end of the image");
+  }
+  printf(" (%.3f s expected from %u sessions)\n", choice.cost.seconds, (uint32_t)history.records.size());
+}
+
+int main(int argc, char **argv) {
+  parseOptions(argc, argv);
+
+  std::vector<uint8_t> image;
+  if (!loadImage(opts.imagePath, image)) {
+    return 1;
+  }
+  uint32_t pages = (image.size() + opts.settings.pageSize - 1) / opts.settings.pageSize;
+  if (pages > 255) {
+    fprintf(stderr, "%s: %u pages, the bootloader can only take 255\n", opts.imagePath, pages);
+    return 1;
+  }
+
+  ImageFrames frames;
+  if (!frames.encode(image, opts.settings.pageSize, opts.settings.escaped)) {
+    perror("Encoding the image");
+    return 1;
+  }
+
+  SessionHistory history;
+  if (opts.historyPath) {
+    if (!history.load(opts.historyPath)) {
+      return 1;
+    }
+    if (opts.tune) {
+      tune(frames, history);
+    }
+  }
+
+  // Outlives the bus, which records to it until it's closed
+  CaptureWriter capture;
+
+  DiscobusDataPosix bus(opts.device, opts.deLine, opts.signalLine, opts.signalInverted);
+  bus.begin(opts.baud);
+  if (!bus.isOpen() || (opts.signalFile && !bus.setSignalFile(opts.signalFile))) {
+    return 1;
+  }
+
+  if (opts.capturePath) {
+    if (!capture.open(opts.capturePath, opts.baud)) {
+      return 1;
+    }
+    bus.setCapture(&capture);
+  }
+
+  MultidropProgrammer programmer(&bus, opts.settings);
+  if (opts.command >= 0) {
+    programmer.sendCommand(opts.command);
+    usleep(opts.commandWaitMs * 1000);
+  }
+
+  MultidropProgrammer::result_t result = programmer.program(frames);
+  const ProgrammerStats &stats = programmer.getStats();
+
+  if (opts.historyPath && (result == MultidropProgrammer::PROG_DONE || result == MultidropProgrammer::PROG_GAVE_UP)) {
+    history.add(sessionRecord(opts.baud, opts.settings, pages, stats, programmer.getErrorPages(),
+                              result == MultidropProgrammer::PROG_DONE));
+    history.save(opts.historyPath);
+  }
+
+  switch (result) {
+    case MultidropProgrammer::PROG_DONE:
+      printf("Programmed %u bytes (%u pages) in %.3f s\n", (uint32_t)image.size(), pages, stats.seconds);
+      printf("Bytes sent: %u (%u retransmitted in %u rounds, %u from the start)\n",
+             stats.bytesSent, stats.bytesRetransmitted, stats.rounds, stats.restarts);
+      return 0;
+    case MultidropProgrammer::PROG_CURRENT:
+      printf("Every node already has this program\n");
+      return 0;
+    case MultidropProgrammer::PROG_NO_NODES:
+      fprintf(stderr, "No nodes enabled the signal line\n");
+      return 2;
+    case MultidropProgrammer::PROG_GAVE_UP:
+    default:
+      fprintf(stderr, "Gave up after %u rounds\n", stats.rounds);
+      return 2;
+  }
+}
@@ -0,0 +1,33 @@
+/*****************************************************************************
+*
+* Non-standard baud rates. Linux takes any rate through termios2, which
+* can't share a file with <termios.h>, so it lives here on its own.
+*
+****************************************************************************/
+
+#include "serial_baud.h"
+
+#ifdef __linux__
+
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+uint8_t setCustomBaud(int fd, uint32_t baud) {
+  struct termios2 tio;
+  if (ioctl(fd, TCGETS2, &tio) < 0) {
+    return 0;
+  }
+  tio.c_cflag &= ~CBAUD;
+  tio.c_cflag |= BOTHER;
+  tio.c_ispeed = baud;
+  tio.c_ospeed = baud;
+  return ioctl(fd, TCSETS2, &tio) == 0;
+}
+
+#else
+
+uint8_t setCustomBaud(int fd, uint32_t baud) {
+  return 0;
+}
+
+#endif
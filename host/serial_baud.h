@@ -0,0 +1,10 @@
+#ifndef SERIAL_BAUD_H
+#define SERIAL_BAUD_H
+
+#include <stdint.h>
+
+// Set a baud rate that termios has no Bxxx constant for (like 250000).
+// Returns 0 if the platform or driver doesn't support it.
+uint8_t setCustomBaud(int fd, uint32_t baud);
+
+#endif
@@ -4,13 +4,11 @@
 *
 ****************************************************************************/
 
-#include <avr/eeprom.h>
-#include <avr/boot.h>
-#include <avr/wdt.h>
-
+#include "hal.h"
 #include "config.h"
 #include "shared.h"
 #include "comm.h"
+#include "trace.h"
 
 uint8_t numPagesWritten = 0;
 uint16_t pageAddress = 0;
@@ -39,7 +37,7 @@ int main(void) {
   eeprom_update_byte(EEPROM_RUN_APP, 0xFF);
 #endif
 
-    asm("jmp 0000");
+    startApplication();
   }
 
 }
@@ -75,6 +73,7 @@ static void bootloader() {
   // Setup
   signalEnable();
   commSetup();
+  traceSetup();
 
   // Parse serial
   while (1) {
@@ -82,7 +81,7 @@ static void bootloader() {
     if (status == STATUS_PAGE_READY) {
       writeNextPage();
     }
-    else if(status == STATUS_DONE) {
+    else if(status == STATUS_DONE || status == STATUS_CURRENT) {
       finishedProgramming();
       return;
     }
@@ -93,11 +92,16 @@ static void bootloader() {
 // Write the next page of the program to flash
 static void writeNextPage() {
 
+  // Flash can't be written while the EEPROM is busy
+  eeprom_busy_wait();
+
   // Erase page
+  TRACE(TRACE_ERASE);
   boot_page_erase(pageAddress);
   boot_spm_busy_wait();
 
   // Write to page buffer
+  TRACE(TRACE_FILL);
   uint16_t word;
   for (uint8_t i = 0; i < SPM_PAGESIZE; i += 2) {
     word = pageData[i];
@@ -106,8 +110,10 @@ static void writeNextPage() {
   }
 
   // Save to flash
+  TRACE(TRACE_WRITE);
   boot_page_write(pageAddress);
   boot_spm_busy_wait();
+  TRACE(TRACE_WRITTEN);
 
   pageAddress += SPM_PAGESIZE;
   numPagesWritten++;
@@ -121,6 +127,9 @@ static void finishedProgramming() {
 
   signalDisable();
 
+  TRACE(TRACE_FINISHED);
+  traceDump();
+
   // Reset
 #if BOOTLOAD_ON_EEPROM == 1
   eeprom_update_byte(EEPROM_RUN_APP, 1);
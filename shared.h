@@ -4,13 +4,13 @@
 
 
 // Drive the signal line low
-inline void signalEnable() {
+static inline void signalEnable() {
   SIGNAL_DDR_REG |= (1 << SIGNAL_BIT);
-  SIGNAL_PIN_REG &= ~(1 << SIGNAL_BIT);
+  SIGNAL_PORT_REG &= ~(1 << SIGNAL_BIT);
 }
 
 // Put signal into tri-state
-inline void signalDisable() {
+static inline void signalDisable() {
   SIGNAL_DDR_REG &= ~(1 << SIGNAL_BIT);
 }
 
@@ -0,0 +1,390 @@
+/*****************************************************************************
+*
+* Cycle profile of the bootloader running under simavr.
+*
+* Loads the built .elf, feeds it a scripted programming session through
+* UART0 and measures how many CPU cycles the bootloader spends on every byte
+* it receives: from reading UDR0 until it polls UCSR0A for the next byte.
+* That cost is then replayed against each baud rate, with the USART's
+* 3 character receive buffer, to find where the polled loop starts to drop
+* bytes.
+*
+****************************************************************************/
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <sim_io.h>
+#include <avr_uart.h>
+
+#include "protocol.h"
+
+// ATmega328P UART0 data space addresses
+#define UCSR0A_ADDR 0xC0
+#define UDR0_ADDR   0xC6
+
+// Characters the USART holds before it overruns
+#define UART_FIFO_SIZE 3
+
+// Keep this many bytes queued in simavr's UART
+#define UART_QUEUE 8
+
+struct options {
+  const char *elf;
+  const char *mcu;
+  uint32_t freq;
+  uint16_t pages;
+  uint16_t pageSize;
+  uint32_t spmUs;
+  uint32_t pageGapUs;
+  uint8_t csv;
+};
+
+static struct options opts;
+static avr_t *avr;
+
+// The scripted session
+static uint8_t *stream;
+static uint8_t *inPage;   // 1 on the PAGE_NUM and PAGE_DATA bytes
+static uint8_t *pageEnd;  // 1 on the last byte of each PAGE_DATA frame
+static uint8_t *frameEnd; // 1 on the last byte of every frame
+static uint32_t streamLen;
+
+// Cycles spent on each byte
+static uint32_t *service;
+static uint32_t pushed;
+static uint32_t consumed;
+
+static avr_cycle_count_t readCycle;
+static uint8_t readPending;
+
+static struct {
+  avr_io_read_t c;
+  void *param;
+} udrRead, statusRead;
+
+////////////////////////////////////////////
+/// UART hooks
+////////////////////////////////////////////
+
+// The bootloader read a byte
+static uint8_t udrReadHook(avr_t *avr, avr_io_addr_t addr, void *param) {
+  uint8_t v = udrRead.c ? udrRead.c(avr, addr, udrRead.param) : avr->data[addr];
+  if (consumed < streamLen) {
+    readCycle = avr->cycle;
+    readPending = 1;
+  }
+  return v;
+}
+
+// The bootloader is ready for the next byte
+static uint8_t statusReadHook(avr_t *avr, avr_io_addr_t addr, void *param) {
+  if (readPending) {
+    service[consumed++] = avr->cycle - readCycle;
+    readPending = 0;
+  }
+  return statusRead.c ? statusRead.c(avr, addr, statusRead.param) : avr->data[addr];
+}
+
+// Chain our hooks in front of the UART module's own IO handlers
+static void hookRead(avr_io_addr_t addr, avr_io_read_t hook, avr_io_read_t *origC, void **origParam) {
+  avr_io_addr_t io = AVR_DATA_TO_IO(addr);
+  *origC = avr->io[io].r.c;
+  *origParam = avr->io[io].r.param;
+  avr->io[io].r.c = hook;
+  avr->io[io].r.param = NULL;
+}
+
+////////////////////////////////////////////
+/// Session
+////////////////////////////////////////////
+
+static void appendFrame(uint8_t command, const uint8_t *data, uint8_t len, uint8_t isPage, uint8_t isLast) {
+  uint8_t frame[FRAME_MAX];
+  uint16_t n = frameEncode(frame, command, data, len);
+  memcpy(&stream[streamLen], frame, n);
+  memset(&inPage[streamLen], isPage, n);
+  streamLen += n;
+  frameEnd[streamLen - 1] = 1;
+  pageEnd[streamLen - 1] = isLast;
+}
+
+// The same messages the reference programmer in multidrop_sim sends
+static void buildSession() {
+  uint32_t maxLen = (opts.pages + 2) * 2 * FRAME_MAX;
+  stream = calloc(maxLen, 1);
+  inPage = calloc(maxLen, 1);
+  pageEnd = calloc(maxLen, 1);
+  frameEnd = calloc(maxLen, 1);
+  service = calloc(maxLen, sizeof(*service));
+
+  uint8_t *image = malloc(opts.pages * opts.pageSize);
+  uint32_t x = 1;
+  for (uint32_t i = 0; i < opts.pages * opts.pageSize; i++) {
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    image[i] = x;
+  }
+
+  uint8_t digest[IMAGE_DIGEST_LEN] = { 0 };
+  appendFrame(MSG_CMD_PROG_START, digest, IMAGE_DIGEST_LEN, 0, 0);
+  for (uint16_t page = 0; page < opts.pages; page++) {
+    uint8_t pageNum = page;
+    appendFrame(MSG_CMD_PAGE_NUM, &pageNum, 1, 1, 0);
+    appendFrame(MSG_CMD_PAGE_DATA, &image[page * opts.pageSize], opts.pageSize, 1, 1);
+  }
+  appendFrame(MSG_CMD_PROG_END, NULL, 0, 0, 0);
+  free(image);
+}
+
+static void runSession() {
+  elf_firmware_t firmware;
+  memset(&firmware, 0, sizeof(firmware));
+  if (elf_read_firmware(opts.elf, &firmware)) {
+    fprintf(stderr, "Unable to load %s\n", opts.elf);
+    exit(1);
+  }
+  if (opts.mcu) {
+    strncpy(firmware.mmcu, opts.mcu, sizeof(firmware.mmcu) - 1);
+  }
+  if (opts.freq) {
+    firmware.frequency = opts.freq;
+  }
+
+  avr = avr_make_mcu_by_name(firmware.mmcu);
+  if (!avr) {
+    fprintf(stderr, "Unknown MCU '%s'\n", firmware.mmcu);
+    exit(1);
+  }
+  avr_init(avr);
+  avr_load_firmware(avr, &firmware);
+
+  // Start at the bootloader, like BOOTRST does
+  avr->pc = firmware.flashbase;
+
+  // Keep the UART quiet on stdout
+  uint32_t flags = 0;
+  avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+  flags &= ~AVR_UART_FLAG_STDIO;
+  avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+
+  hookRead(UDR0_ADDR, udrReadHook, &udrRead.c, &udrRead.param);
+  hookRead(UCSR0A_ADDR, statusReadHook, &statusRead.c, &statusRead.param);
+
+  avr_irq_t *uartInput = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+
+  // Run until the bootloader has handled the whole session. The last
+  // byte has no following poll, the END message resets the device.
+  uint64_t limit = (uint64_t)firmware.frequency * 60;
+  while (consumed < streamLen - 1 && avr->cycle < limit) {
+    while (pushed < streamLen && pushed - consumed < UART_QUEUE) {
+      avr_raise_irq(uartInput, stream[pushed++]);
+    }
+
+    int state = avr_run(avr);
+    if (state == cpu_Done || state == cpu_Crashed) {
+      break;
+    }
+  }
+
+  if (consumed < streamLen - 1) {
+    fprintf(stderr, "Bootloader stopped after %u of %u bytes\n", consumed, streamLen);
+    exit(1);
+  }
+  opts.freq = firmware.frequency;
+  opts.mcu = strdup(firmware.mmcu);
+}
+
+////////////////////////////////////////////
+/// Analysis
+////////////////////////////////////////////
+
+// Replay the measured service times against bytes arriving at `baud`.
+// Returns the number of bytes that would be lost to UART overruns.
+static uint32_t replay(uint32_t baud) {
+  double byteCycles = 10.0 * opts.freq / baud;
+  double spmCycles = (double)opts.spmUs * opts.freq / 1e6;
+  double gapCycles = (double)opts.pageGapUs * opts.freq / 1e6;
+
+  uint32_t lost = 0;
+  double arrival = 0;
+  double ready = 0;
+  uint32_t serviced = 0;
+
+  // Arrival times of the bytes waiting in the USART
+  double fifo[UART_FIFO_SIZE];
+  uint8_t fifoLen = 0;
+
+  for (uint32_t i = 0; i < streamLen; i++) {
+    arrival += byteCycles;
+
+    // Read everything the CPU got to before this byte arrived
+    while (fifoLen && ready <= arrival) {
+      double readAt = ready > fifo[0] ? ready : fifo[0];
+      uint32_t cost = service[serviced < consumed ? serviced : consumed - 1];
+      ready = readAt + cost;
+      if (pageEnd[serviced]) {
+        ready += spmCycles;
+      }
+      serviced++;
+      memmove(fifo, fifo + 1, --fifoLen * sizeof(double));
+    }
+
+    if (fifoLen == UART_FIFO_SIZE) {
+      lost++;
+    } else {
+      fifo[fifoLen++] = arrival;
+    }
+
+    // The programmer waits for the page to be written
+    if (pageEnd[i]) {
+      arrival += gapCycles;
+    }
+  }
+  return lost;
+}
+
+// Highest baud rate where no bytes are lost
+static uint32_t maxGapFreeBaud() {
+  uint32_t low = 300;
+  uint32_t high = opts.freq / 8;
+  if (replay(low)) {
+    return 0;
+  }
+  while (high - low > 1) {
+    uint32_t mid = low + (high - low) / 2;
+    if (replay(mid)) {
+      high = mid;
+    } else {
+      low = mid;
+    }
+  }
+  return low;
+}
+
+static void report() {
+  static const uint32_t bauds[] = { 9600, 19200, 38400, 57600, 76800, 115200, 230400, 250000, 500000, 1000000 };
+
+  uint32_t byteMin = ~0, byteMax = 0, msgMax = 0;
+  uint64_t byteSum = 0, pageSum = 0, pageCycles = 0;
+  uint32_t byteCount = 0, pageMax = 0, pageCount = 0;
+
+  for (uint32_t i = 0; i < consumed; i++) {
+    if (inPage[i]) {
+      pageCycles += service[i];
+    }
+    if (pageEnd[i]) {
+      pageSum += pageCycles;
+      pageMax = pageCycles > pageMax ? pageCycles : pageMax;
+      pageCount++;
+      pageCycles = 0;
+    }
+    if (frameEnd[i]) {
+      msgMax = service[i] > msgMax ? service[i] : msgMax;
+      continue;
+    }
+    byteMin = service[i] < byteMin ? service[i] : byteMin;
+    byteMax = service[i] > byteMax ? service[i] : byteMax;
+    byteSum += service[i];
+    byteCount++;
+  }
+
+  double byteAvg = byteCount ? (double)byteSum / byteCount : 0;
+  double pageAvg = pageCount ? (double)pageSum / pageCount : 0;
+  uint32_t maxBaud = maxGapFreeBaud();
+
+  if (opts.csv) {
+    printf("mcu,freq,page_size,bytes,byte_cycles_min,byte_cycles_avg,byte_cycles_max,"
+           "message_cycles_max,page_cycles_avg,page_cycles_max,max_gap_free_baud");
+    for (uint8_t i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++) {
+      printf(",overruns_%u", bauds[i]);
+    }
+    printf("\n%s,%u,%u,%u,%u,%.1f,%u,%u,%.0f,%u,%u", opts.mcu, opts.freq, opts.pageSize, consumed,
+           byteMin, byteAvg, byteMax, msgMax, pageAvg, pageMax, maxBaud);
+    for (uint8_t i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++) {
+      printf(",%u", replay(bauds[i]));
+    }
+    printf("\n");
+    return;
+  }
+
+  printf("Firmware:            %s (%s @ %u Hz)\n", opts.elf, opts.mcu, opts.freq);
+  printf("Bytes received:      %u (%u pages of %u)\n", consumed, opts.pages, opts.pageSize);
+  printf("Cycles per byte:     min %u, avg %.1f, max %u\n", byteMin, byteAvg, byteMax);
+  printf("Cycles per message:  max %u (last byte of each message)\n", msgMax);
+  printf("Cycles per page:     avg %.0f, max %u (plus %u us flash programming)\n", pageAvg, pageMax, opts.spmUs);
+  printf("Max gap-free baud:   %u\n", maxBaud);
+  printf("\n  Baud       Overruns\n");
+  for (uint8_t i = 0; i < sizeof(bauds) / sizeof(bauds[0]); i++) {
+    printf("  %-10u %u\n", bauds[i], replay(bauds[i]));
+  }
+}
+
+////////////////////////////////////////////
+/// Setup
+////////////////////////////////////////////
+
+static void usage(const char *name) {
+  fprintf(stderr,
+    "Usage: %s [options] bootloader.elf\n"
+    "  -m, --mcu NAME         MCU to simulate (default: from the .elf)\n"
+    "  -f, --freq HZ          CPU frequency (default: from the .elf)\n"
+    "  -n, --pages N          Pages in the scripted session (default 16)\n"
+    "  -p, --page-size N      Flash page size (default %d)\n"
+    "  -s, --spm-us US        Flash erase + write time per page (default 9000)\n"
+    "  -g, --page-gap US      Programmer wait after each page (default: spm-us + 200)\n"
+    "      --csv              Print a CSV header and result row\n",
+    name, SPM_PAGESIZE);
+  exit(1);
+}
+
+static void parseOptions(int argc, char **argv) {
+  static struct option longOpts[] = {
+    { "mcu",       required_argument, 0, 'm' },
+    { "freq",      required_argument, 0, 'f' },
+    { "pages",     required_argument, 0, 'n' },
+    { "page-size", required_argument, 0, 'p' },
+    { "spm-us",    required_argument, 0, 's' },
+    { "page-gap",  required_argument, 0, 'g' },
+    { "csv",       no_argument,       0, 'v' },
+    { 0, 0, 0, 0 }
+  };
+
+  opts.pages = 16;
+  opts.pageSize = SPM_PAGESIZE;
+  opts.spmUs = 9000;
+
+  int c;
+  while ((c = getopt_long(argc, argv, "m:f:n:p:s:g:", longOpts, NULL)) != -1) {
+    switch (c) {
+      case 'm': opts.mcu = optarg; break;
+      case 'f': opts.freq = atoi(optarg); break;
+      case 'n': opts.pages = atoi(optarg); break;
+      case 'p': opts.pageSize = atoi(optarg); break;
+      case 's': opts.spmUs = atoi(optarg); break;
+      case 'g': opts.pageGapUs = atoi(optarg); break;
+      case 'v': opts.csv = 1; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || opts.pages == 0 || opts.pages > 255 || opts.pageSize > 255) {
+    usage(argv[0]);
+  }
+  if (opts.pageGapUs == 0) {
+    opts.pageGapUs = opts.spmUs + 200;
+  }
+  opts.elf = argv[optind];
+}
+
+int main(int argc, char **argv) {
+  parseOptions(argc, argv);
+  buildSession();
+  runSession();
+  report();
+  return 0;
+}
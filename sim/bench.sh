@@ -0,0 +1,111 @@
+#!/bin/sh
+#
+# Programs simulated buses over a sweep of bus sizes, image sizes, page sizes,
+# baud rates and line faults, and prints one CSV row per session (see the
+# --csv option of multidrop_sim for the columns).
+#
+# Each setting is a space separated list, taken from the environment:
+#
+#   BENCH_NODES        Nodes on the bus (1 - 255)
+#   BENCH_IMAGE_SIZES  Image sizes, in bytes
+#   BENCH_PAGE_SIZES   Flash page sizes
+#   BENCH_BAUDS        Baud rates
+#   BENCH_FAULTS       Comma separated faults for each run, or "none":
+#                        ber=RATE   bit error rate
+#                        drop=RATE  chance of a node missing a byte
+#                        late=N     nodes that power up after programming started
+#                        slow=N     nodes with twice the flash write time
+#   BENCH_SEEDS        Random seeds, for repeated runs
+#   BENCH_MODES        Protocol modes to compare, as NAME or NAME:DEFS where DEFS
+#                      is a comma separated list of config.h overrides, e.g.
+#                      "default digest:-DUSE_IMAGE_DIGEST=1 escaped:-DESCAPED_FRAMING=1"
+#   BENCH_ARGS         Extra options for every multidrop_sim run
+#
+# Run from the repository root, usually through `make bench`.
+#
+
+NODES=${BENCH_NODES:-"1 8 32 128 255"}
+IMAGE_SIZES=${BENCH_IMAGE_SIZES:-"4096 12288"}
+PAGE_SIZES=${BENCH_PAGE_SIZES:-"64 128"}
+BAUDS=${BENCH_BAUDS:-"115200 250000"}
+FAULTS=${BENCH_FAULTS:-"none ber=1e-6 ber=1e-5 drop=1e-4 late=1 slow=1"}
+SEEDS=${BENCH_SEEDS:-"1"}
+MODES=${BENCH_MODES:-"default"}
+
+BUILD=sim/bench
+mkdir -p $BUILD || exit 1
+
+# Turn a fault list into multidrop_sim options
+faultArgs() {
+  for fault in $(echo "$1" | tr ',' ' '); do
+    value=${fault#*=}
+    case $fault in
+      none) ;;
+      ber=*)  printf ' --ber %s' "$value" ;;
+      drop=*) printf ' --drop-rate %s' "$value" ;;
+      late=*) printf ' --late-nodes %s' "$value" ;;
+      slow=*) printf ' --slow-nodes %s' "$value" ;;
+      *) echo "Unknown fault: $fault" >&2; exit 1 ;;
+    esac
+  done
+}
+
+# Number of nodes the faults single out
+faultNodes() {
+  total=0
+  for fault in $(echo "$1" | tr ',' ' '); do
+    case $fault in
+      late=*|slow=*) total=$((total + ${fault#*=})) ;;
+    esac
+  done
+  echo $total
+}
+
+header=1
+for mode in $MODES; do
+  name=${mode%%:*}
+  defs=""
+  case $mode in
+    *:*) defs=$(echo "${mode#*:}" | tr ',' ' ') ;;
+  esac
+
+  programmer=$BUILD/$name-programmer
+  rm -f $programmer
+  make -s --no-print-directory SIM_PROGRAMMER=$programmer SIM_DEFS="$defs" $programmer >&2 || exit 1
+
+  for pageSize in $PAGE_SIZES; do
+    for baud in $BAUDS; do
+      node=$BUILD/$name-node-$pageSize-$baud
+      rm -f $node
+      make -s --no-print-directory SIM_NODE=$node SIM_DEFS="$defs" \
+        SIM_PAGESIZE=$pageSize SIM_BAUD=$baud $node >&2 || exit 1
+
+      for faults in $FAULTS; do
+        args=$(faultArgs "$faults") || exit 1
+        for nodes in $NODES; do
+          # Keep at least one node that's there from the start
+          if [ "$(faultNodes "$faults")" -ge "$nodes" ]; then
+            continue
+          fi
+          for imageSize in $IMAGE_SIZES; do
+            for seed in $SEEDS; do
+              # A session that gives up still reports a row
+              $programmer --csv --label "$name" --node-bin $node --nodes $nodes \
+                --baud $baud --page-size $pageSize --image-size $imageSize \
+                --seed $seed $args $BENCH_ARGS > $BUILD/run.csv
+              if [ ! -s $BUILD/run.csv ]; then
+                echo "Run failed: $name $nodes nodes, $baud baud, $pageSize byte pages, $faults" >&2
+                continue
+              fi
+              if [ $header = 1 ]; then
+                head -n 1 $BUILD/run.csv
+                header=0
+              fi
+              tail -n +2 $BUILD/run.csv
+            done
+          done
+        done
+      done
+    done
+  done
+done
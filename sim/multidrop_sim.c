@@ -0,0 +1,786 @@
+/*****************************************************************************
+*
+* Runs N bootloader nodes on a virtual RS485 bus and programs them with a
+* reference programmer, then reports how long the session took and whether
+* every node ended up with the right flash contents.
+*
+* Each node is the real bootloader (main.c + comm.c) built against the
+* simulated hardware in sim_hal.c and started as its own process.
+*
+****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sim_bus.h"
+#include "protocol.h"
+#include "digest.h"
+#include "../host/capture_format.h"
+
+// Bytes the stream can hold for the whole session
+#define STREAM_CAPACITY (8UL * 1024 * 1024)
+
+struct options {
+  uint16_t nodes;
+  uint16_t current;
+  uint32_t baud;
+  uint32_t imageSize;
+  const char *imagePath;
+  uint16_t pageSize;
+  uint32_t pageGapUs;
+  uint16_t maxRounds;
+  uint16_t checkpoint;
+  uint32_t seed;
+  uint16_t lateNodes;
+  uint32_t lateJoinMs;
+  uint16_t slowNodes;
+  uint16_t slowSpmPercent;
+  const char *label;
+  uint8_t csv;
+  const char *bridge;
+  uint32_t bridgeIdleMs;
+  const char *replayPath;
+  char nodeBin[4096];
+};
+
+static struct options opts;
+static struct simBus *bus;
+static pid_t pids[SIM_MAX_NODES];
+
+// Programmer time (ns)
+static uint64_t now;
+static uint64_t byteNs;
+
+// Bytes written to the stream but not yet published
+static uint32_t pending;
+
+// Session stats
+static uint32_t bytesSent;
+static uint32_t bytesRetransmitted;
+static uint16_t rounds;
+static uint16_t restarts;
+
+// Capture being replayed (see --replay)
+static const uint64_t *captureRecords;
+static size_t captureCount;
+
+////////////////////////////////////////////
+/// Bus
+////////////////////////////////////////////
+
+static void die(const char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+// Make everything transmitted so far visible to the nodes, and promise
+// nothing else arrives before `until`
+static void publish(uint64_t until) {
+  pthread_mutex_lock(&bus->lock);
+  bus->count = pending;
+  bus->horizon = until;
+  bus->gen++;
+  pthread_cond_broadcast(&bus->streamChanged);
+  pthread_mutex_unlock(&bus->lock);
+}
+
+// Check for nodes whose process died without exiting cleanly
+static void reapNodes() {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    for (uint16_t i = 0; i < opts.nodes; i++) {
+      if (pids[i] == pid) {
+        pids[i] = 0;
+        if (bus->nodes[i].state != SIM_NODE_EXITED) {
+          bus->nodes[i].state = SIM_NODE_EXITED;
+          bus->nodes[i].exitReason = SIM_EXIT_CRASHED;
+          bus->nodes[i].signal = 0;
+        }
+      }
+    }
+  }
+}
+
+// Let the nodes run up to `until` and wait for all of them to block on the bus
+static void syncNodes(uint64_t until) {
+  publish(until);
+
+  pthread_mutex_lock(&bus->lock);
+  while (1) {
+    uint16_t i;
+    for (i = 0; i < opts.nodes; i++) {
+      struct simNode *node = &bus->nodes[i];
+      if (node->state == SIM_NODE_EXITED) continue;
+      if (node->state == SIM_NODE_WAITING && node->waitGen == bus->gen) continue;
+      break;
+    }
+    if (i == opts.nodes) break;
+
+    struct timespec timeout;
+    clock_gettime(CLOCK_REALTIME, &timeout);
+    timeout.tv_nsec += 100000000L;
+    if (timeout.tv_nsec >= 1000000000L) {
+      timeout.tv_sec++;
+      timeout.tv_nsec -= 1000000000L;
+    }
+    if (pthread_cond_timedwait(&bus->nodeBlocked, &bus->lock, &timeout) == ETIMEDOUT) {
+      reapNodes();
+    }
+  }
+  pthread_mutex_unlock(&bus->lock);
+
+  if (until > now) {
+    now = until;
+  }
+}
+
+// Is any node driving the signal line low
+static uint8_t signalLine() {
+  for (uint16_t i = 0; i < opts.nodes; i++) {
+    struct simNode *node = &bus->nodes[i];
+    if (node->joinNs > now) continue;
+    if (node->state != SIM_NODE_EXITED && node->signal) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Put bytes on the line, back to back
+static void transmit(const uint8_t *data, uint32_t len) {
+  uint64_t *times = SIM_STREAM_TIMES(bus);
+  uint8_t *bytes = SIM_STREAM_BYTES(bus);
+
+  if (pending + len > bus->capacity) {
+    fprintf(stderr, "Bus stream is full\n");
+    exit(1);
+  }
+  for (uint32_t i = 0; i < len; i++) {
+    now += byteNs;
+    times[pending] = now;
+    bytes[pending] = data[i];
+    pending++;
+  }
+  bytesSent += len;
+}
+
+static uint16_t sendMessage(uint8_t command, const uint8_t *data, uint8_t len) {
+  uint8_t frame[FRAME_MAX];
+  uint16_t n = frameEncode(frame, command, data, len);
+  transmit(frame, n);
+  return n;
+}
+
+////////////////////////////////////////////
+/// Nodes
+////////////////////////////////////////////
+
+static void createBus() {
+  int fd = memfd_create("multidrop-bus", 0);
+  if (fd < 0) die("memfd_create");
+  if (ftruncate(fd, SIM_BUS_MAP_SIZE(STREAM_CAPACITY)) < 0) die("ftruncate");
+
+  bus = mmap(NULL, SIM_BUS_MAP_SIZE(STREAM_CAPACITY), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (bus == MAP_FAILED) die("mmap");
+  bus->capacity = STREAM_CAPACITY;
+
+  pthread_mutexattr_t mutexAttr;
+  pthread_mutexattr_init(&mutexAttr);
+  pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+  pthread_mutex_init(&bus->lock, &mutexAttr);
+
+  pthread_condattr_t condAttr;
+  pthread_condattr_init(&condAttr);
+  pthread_condattr_setpshared(&condAttr, PTHREAD_PROCESS_SHARED);
+  pthread_cond_init(&bus->streamChanged, &condAttr);
+  pthread_cond_init(&bus->nodeBlocked, &condAttr);
+
+  char fdStr[16];
+  snprintf(fdStr, sizeof(fdStr), "%d", fd);
+  setenv(SIM_ENV_BUS_FD, fdStr, 1);
+}
+
+static void startNodes() {
+  // The last nodes join late, the ones before them have slow flash
+  uint16_t firstLate = opts.nodes - opts.lateNodes;
+  uint16_t firstSlow = firstLate - opts.slowNodes;
+
+  for (uint16_t i = 0; i < opts.nodes; i++) {
+    struct simNode *node = &bus->nodes[i];
+    node->state = SIM_NODE_RUNNING;
+    node->preload = (i < opts.current);
+    node->spmPercent = (i >= firstSlow && i < firstLate) ? opts.slowSpmPercent : 100;
+    node->joinNs = (i >= firstLate) ? opts.lateJoinMs * 1000000ULL : 0;
+  }
+
+  for (uint16_t i = 0; i < opts.nodes; i++) {
+    pid_t pid = fork();
+    if (pid < 0) die("fork");
+    if (pid == 0) {
+      char idStr[8];
+      snprintf(idStr, sizeof(idStr), "%d", i);
+      setenv(SIM_ENV_NODE_ID, idStr, 1);
+      execl(opts.nodeBin, opts.nodeBin, (char *)NULL);
+      perror(opts.nodeBin);
+      _exit(1);
+    }
+    pids[i] = pid;
+  }
+}
+
+static void stopNodes() {
+  for (uint16_t i = 0; i < opts.nodes; i++) {
+    if (pids[i]) {
+      kill(pids[i], SIGKILL);
+    }
+  }
+  while (wait(NULL) > 0);
+}
+
+// Make sure the nodes were built for this bus
+static void checkNodes() {
+  for (uint16_t i = 0; i < opts.nodes; i++) {
+    struct simNode *node = &bus->nodes[i];
+    if (node->state == SIM_NODE_EXITED) continue;
+
+    if (node->pageSize != opts.pageSize) {
+      fprintf(stderr, "Node %d was built with %d byte pages, not %d\n", i, node->pageSize, opts.pageSize);
+      exit(1);
+    }
+
+    double nodeBaud = (double)bus->config.fCpu / (16.0 * (node->ubrr + 1));
+    double error = (nodeBaud - opts.baud) / opts.baud;
+    if (error > 0.025 || error < -0.025) {
+      fprintf(stderr, "Node %d UART runs at %.0f baud, bus is %u (rebuild with SIM_BAUD=%u)\n",
+              i, nodeBaud, opts.baud, opts.baud);
+      exit(1);
+    }
+  }
+}
+
+////////////////////////////////////////////
+/// Programmer
+////////////////////////////////////////////
+
+// Send the START message (image digest and page count)
+// and give the nodes time to update EEPROM
+static void startSession(uint8_t pages) {
+  uint8_t data[IMAGE_DIGEST_LEN + 1];
+  memcpy(data, bus->config.digest, IMAGE_DIGEST_LEN);
+  data[IMAGE_DIGEST_LEN] = pages;
+
+  uint16_t sent = sendMessage(MSG_CMD_PROG_START, data, sizeof(data));
+  if (rounds > 0) {
+    bytesRetransmitted += sent;
+  }
+  syncNodes(now + bus->config.eepromWriteNs + 1000000ULL);
+}
+
+// Program all nodes, following the process described in README.md.
+// Returns 1 if programming finished, 0 if it gave up.
+static uint8_t programNodes(uint16_t pages) {
+  uint64_t pageGapNs = opts.pageGapUs * 1000ULL;
+
+  // Nodes enable the signal line once they're in the bootloader
+  syncNodes(1000000ULL);
+  checkNodes();
+  if (!signalLine()) {
+    fprintf(stderr, "No nodes on the bus\n");
+    return 0;
+  }
+
+  startSession(pages);
+
+#if USE_IMAGE_DIGEST == 1
+  // Every node is already current
+  if (!signalLine()) {
+    return 1;
+  }
+#endif
+
+  int16_t firstError = -1;
+  uint16_t roundStart = 0;
+  uint8_t stuck = 0;
+  uint16_t page = 0;
+  while (page < pages) {
+    uint32_t offset = page * opts.pageSize;
+    uint32_t len = bus->config.imageSize - offset;
+    if (len > opts.pageSize) {
+      len = opts.pageSize;
+    }
+
+    uint8_t pageNum = page;
+    uint16_t sent = sendMessage(MSG_CMD_PAGE_NUM, &pageNum, 1);
+    sent += sendMessage(MSG_CMD_PAGE_DATA, &bus->image[offset], len);
+    if (rounds > 0) {
+      bytesRetransmitted += sent;
+    }
+
+    // Give the nodes time to write the page
+    syncNodes(now + pageGapNs);
+    if (signalLine() && firstError < 0) {
+      firstError = page;
+    }
+
+    // Resend from the first error, at the end of the image or the next checkpoint
+    page++;
+    uint8_t checkpoint = page == pages || (opts.checkpoint && (page - roundStart) % opts.checkpoint == 0);
+    if (checkpoint && firstError >= 0) {
+      if (rounds++ == opts.maxRounds) {
+        return 0;
+      }
+
+      // The first page of the round failed twice in a row. A node is missing
+      // the START message or earlier pages (it may have joined late), so start over.
+      stuck = (firstError == roundStart) ? stuck + 1 : 0;
+      if (stuck == 2) {
+        restarts++;
+        stuck = 0;
+        startSession(pages);
+        page = 0;
+      } else {
+        // A byte lost at the end of a page is only noticed when the next
+        // message arrives, so also resend the page before the error
+        page = firstError ? firstError - 1 : 0;
+      }
+      roundStart = page;
+      firstError = -1;
+    }
+  }
+
+  sendMessage(MSG_CMD_PROG_END, NULL, 0);
+  syncNodes(now + 1000000ULL);
+  return 1;
+}
+
+////////////////////////////////////////////
+/// Bridge
+////////////////////////////////////////////
+
+static uint64_t monotonicNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Instead of the reference programmer, let an outside programmer drive the
+// bus through a pty, in real time. Bytes written to the pty go onto the bus
+// at the baud rate, and the signal line is written to "<bridge>.signal"
+// ('1' when a node is driving it low). Returns 1 when every node has left
+// the bootloader, 0 if the pty was idle for too long first.
+static uint8_t bridgeNodes() {
+  int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) die("pty");
+
+  // Keep the other end open in raw mode, so the programmer coming and going doesn't matter
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  if (slave < 0) die(ptsname(master));
+  struct termios tio;
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+
+  char signalPath[4096];
+  snprintf(signalPath, sizeof(signalPath), "%s.signal", opts.bridge);
+  unlink(opts.bridge);
+  if (symlink(ptsname(master), opts.bridge) < 0) die(opts.bridge);
+  int signalFd = open(signalPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (signalFd < 0) die(signalPath);
+
+  fprintf(stderr, "Bus on %s (%s), signal line in %s\n", opts.bridge, ptsname(master), signalPath);
+
+  syncNodes(0);
+  checkNodes();
+
+  uint8_t finished = 0;
+  char signal = 0;
+  uint64_t start = monotonicNs();
+  uint64_t lastActivity = 0;
+  while (1) {
+    uint64_t wall = monotonicNs() - start;
+
+    uint8_t buff[4096];
+    ssize_t n = read(master, buff, sizeof(buff));
+    if (n > 0) {
+      if (now < wall) {
+        now = wall;
+      }
+      transmit(buff, n);
+      lastActivity = wall;
+    }
+    syncNodes(wall);
+
+    char level = signalLine() ? '1' : '0';
+    if (level != signal) {
+      signal = level;
+      pwrite(signalFd, &signal, 1, 0);
+    }
+
+    uint16_t running = 0;
+    for (uint16_t i = 0; i < opts.nodes; i++) {
+      if (bus->nodes[i].state != SIM_NODE_EXITED) running++;
+    }
+    if (running == 0) {
+      finished = 1;
+      break;
+    }
+    if (wall - lastActivity > opts.bridgeIdleMs * 1000000ULL) {
+      break;
+    }
+
+    struct pollfd pfd = { master, POLLIN, 0 };
+    poll(&pfd, 1, 0);
+    if (!(pfd.revents & POLLIN)) {
+      usleep(100);
+    }
+  }
+
+  unlink(opts.bridge);
+  unlink(signalPath);
+  close(signalFd);
+  close(slave);
+  close(master);
+  return finished;
+}
+
+// Map the capture given to --replay, and run the bus at the baud it was recorded at
+static void openCapture() {
+  int fd = open(opts.replayPath, O_RDONLY);
+  if (fd < 0) die(opts.replayPath);
+
+  off_t size = lseek(fd, 0, SEEK_END);
+  if (size < CAPTURE_HEADER_SIZE) {
+    fprintf(stderr, "%s: not a capture file\n", opts.replayPath);
+    exit(1);
+  }
+  const uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) die(opts.replayPath);
+  close(fd);
+  madvise((void*)map, size, MADV_SEQUENTIAL);
+
+  const struct captureHeader *header = (const struct captureHeader*)map;
+  if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != CAPTURE_VERSION || header->recordSize != sizeof(uint64_t)) {
+    fprintf(stderr, "%s: not a version %u capture file\n", opts.replayPath, CAPTURE_VERSION);
+    exit(1);
+  }
+  captureRecords = (const uint64_t*)(map + CAPTURE_HEADER_SIZE);
+  captureCount = (size - CAPTURE_HEADER_SIZE) / sizeof(uint64_t);
+
+  if (header->baud) {
+    opts.baud = header->baud;
+    bus->config.baud = opts.baud;
+    byteNs = (10ULL * 1000000000ULL + opts.baud / 2) / opts.baud;
+  }
+}
+
+// Instead of the reference programmer, send what a real programmer sent in
+// a capture (see host/Capture.h), with the same timing. Bytes the nodes sent
+// are left out, since the simulated nodes send their own. Returns 1 when
+// every node has left the bootloader.
+static uint8_t replayNodes() {
+  // The capture starts when the programmer opened the port, so give the nodes a millisecond to boot
+  syncNodes(1000000ULL);
+  checkNodes();
+
+  uint64_t offset = now;
+  uint64_t synced = now;
+  for (size_t i = 0; i < captureCount; i++) {
+    uint64_t record = captureRecords[i];
+    if (captureEvent(record) != CAPTURE_TX) continue;
+
+    // Stamped when it finished leaving the wire
+    uint64_t at = offset + captureTime(record);
+    if (at > now + byteNs) {
+      syncNodes(now);
+      synced = now;
+      now = at - byteNs;
+    }
+    uint8_t b = captureData(record);
+    transmit(&b, 1);
+
+    // Keep the nodes close behind, rather than handing them the whole session at once
+    if (now - synced > 1000000ULL) {
+      syncNodes(now);
+      synced = now;
+    }
+  }
+  syncNodes(now + 100000000ULL);
+
+  for (uint16_t i = 0; i < opts.nodes; i++) {
+    if (bus->nodes[i].state != SIM_NODE_EXITED) return 0;
+  }
+  return 1;
+}
+
+////////////////////////////////////////////
+/// Setup
+////////////////////////////////////////////
+
+static void loadImage() {
+  if (opts.imagePath) {
+    FILE *file = fopen(opts.imagePath, "rb");
+    if (!file) die(opts.imagePath);
+    opts.imageSize = fread(bus->image, 1, sizeof(bus->image), file);
+    fclose(file);
+  } else {
+    // Random program
+    uint32_t x = opts.seed ? opts.seed : 1;
+    for (uint32_t i = 0; i < opts.imageSize; i++) {
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      bus->image[i] = x;
+    }
+  }
+
+  uint32_t limit = SIM_APP_SIZE < 255 * opts.pageSize ? SIM_APP_SIZE : 255 * opts.pageSize;
+  if (opts.imageSize == 0 || opts.imageSize > limit) {
+    fprintf(stderr, "Image must be 1 - %u bytes\n", limit);
+    exit(1);
+  }
+
+  // Unused flash is erased
+  uint32_t padded = (opts.imageSize + opts.pageSize - 1) / opts.pageSize * opts.pageSize;
+  memset(&bus->image[opts.imageSize], 0xFF, sizeof(bus->image) - opts.imageSize);
+
+  uint32_t digest = digestImage(bus->image, padded);
+  for (uint8_t i = 0; i < IMAGE_DIGEST_LEN && i < sizeof(digest); i++) {
+    bus->config.digest[i] = digest >> (i * 8);
+  }
+  bus->config.imageSize = opts.imageSize;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "  -n, --nodes N          Number of nodes on the bus (default 8)\n"
+    "  -c, --current N        Number of nodes that already have the image (default 0)\n"
+    "  -b, --baud BAUD        Bus baud rate (default %d)\n"
+    "  -s, --image-size N     Size of a random image, in bytes (default 8192)\n"
+    "  -i, --image FILE       Program a raw binary image instead\n"
+    "  -p, --page-size N      Flash page size (default %d)\n"
+    "  -g, --page-gap US      Wait after each page, in microseconds (default: erase + write time)\n"
+    "  -r, --max-rounds N     Retransmission rounds before giving up (default 10)\n"
+    "      --checkpoint N     Resend after N pages if one failed (default: at the end of the image)\n"
+    "      --cycles-per-byte  CPU cycles the bootloader spends on each byte (default 64)\n"
+    "      --seed N           Seed for the random image and faults\n"
+    "      --ber RATE         Chance of each bit a node receives being flipped\n"
+    "      --drop-rate RATE   Chance of a node missing each byte\n"
+    "      --late-nodes N     Number of nodes that power up late\n"
+    "      --late-join-ms MS  When the late nodes power up (default 100)\n"
+    "      --slow-nodes N     Number of nodes with slow flash\n"
+    "      --slow-spm PERCENT Flash erase/write time of the slow nodes (default 200)\n"
+    "      --label TEXT       Value of the mode column in the CSV output\n"
+    "      --node-bin PATH    Bootloader node executable\n"
+    "      --csv              Print a CSV header and result row\n"
+    "      --bridge PATH      Let another programmer drive the bus through a pty linked at PATH\n"
+    "      --bridge-idle-ms MS  Give up when the pty has been quiet this long (default 5000)\n"
+    "      --replay CAPTURE   Send the bytes in a host capture (multidrop_program --capture) instead\n",
+    name, SERIAL_BAUD, SPM_PAGESIZE);
+  exit(1);
+}
+
+static void parseOptions(int argc, char **argv) {
+  static struct option longOpts[] = {
+    { "nodes",           required_argument, 0, 'n' },
+    { "current",         required_argument, 0, 'c' },
+    { "baud",            required_argument, 0, 'b' },
+    { "image-size",      required_argument, 0, 's' },
+    { "image",           required_argument, 0, 'i' },
+    { "page-size",       required_argument, 0, 'p' },
+    { "page-gap",        required_argument, 0, 'g' },
+    { "max-rounds",      required_argument, 0, 'r' },
+    { "checkpoint",      required_argument, 0, 'K' },
+    { "cycles-per-byte", required_argument, 0, 'C' },
+    { "seed",            required_argument, 0, 'S' },
+    { "ber",             required_argument, 0, 'E' },
+    { "drop-rate",       required_argument, 0, 'D' },
+    { "late-nodes",      required_argument, 0, 'L' },
+    { "late-join-ms",    required_argument, 0, 'J' },
+    { "slow-nodes",      required_argument, 0, 'W' },
+    { "slow-spm",        required_argument, 0, 'P' },
+    { "label",           required_argument, 0, 'l' },
+    { "node-bin",        required_argument, 0, 'N' },
+    { "csv",             no_argument,       0, 'v' },
+    { "bridge",          required_argument, 0, 'B' },
+    { "bridge-idle-ms",  required_argument, 0, 'I' },
+    { "replay",          required_argument, 0, 'R' },
+    { 0, 0, 0, 0 }
+  };
+
+  opts.nodes = 8;
+  opts.baud = SERIAL_BAUD;
+  opts.imageSize = 8192;
+  opts.pageSize = SPM_PAGESIZE;
+  opts.maxRounds = 10;
+  opts.seed = 1;
+  opts.lateJoinMs = 100;
+  opts.slowSpmPercent = 200;
+  opts.label = "default";
+  opts.bridgeIdleMs = 5000;
+
+  bus->config.fCpu = F_CPU;
+  bus->config.cyclesPerByte = 64;
+  bus->config.flashEraseNs = 4500000;
+  bus->config.flashWriteNs = 4500000;
+  bus->config.eepromWriteNs = 3400000;
+
+  char *dir = strdup(argv[0]);
+  snprintf(opts.nodeBin, sizeof(opts.nodeBin), "%s/bootloader_node", dirname(dir));
+  free(dir);
+
+  int c;
+  while ((c = getopt_long(argc, argv, "n:c:b:s:i:p:g:r:", longOpts, NULL)) != -1) {
+    switch (c) {
+      case 'n': opts.nodes = atoi(optarg); break;
+      case 'c': opts.current = atoi(optarg); break;
+      case 'b': opts.baud = atoi(optarg); break;
+      case 's': opts.imageSize = atoi(optarg); break;
+      case 'i': opts.imagePath = optarg; break;
+      case 'p': opts.pageSize = atoi(optarg); break;
+      case 'g': opts.pageGapUs = atoi(optarg); break;
+      case 'r': opts.maxRounds = atoi(optarg); break;
+      case 'K': opts.checkpoint = atoi(optarg); break;
+      case 'C': bus->config.cyclesPerByte = atoi(optarg); break;
+      case 'S': opts.seed = atoi(optarg); break;
+      case 'E': bus->config.bitErrorRate = atof(optarg); break;
+      case 'D': bus->config.dropRate = atof(optarg); break;
+      case 'L': opts.lateNodes = atoi(optarg); break;
+      case 'J': opts.lateJoinMs = atoi(optarg); break;
+      case 'W': opts.slowNodes = atoi(optarg); break;
+      case 'P': opts.slowSpmPercent = atoi(optarg); break;
+      case 'l': opts.label = optarg; break;
+      case 'N': snprintf(opts.nodeBin, sizeof(opts.nodeBin), "%s", optarg); break;
+      case 'v': opts.csv = 1; break;
+      case 'B': opts.bridge = optarg; break;
+      case 'I': opts.bridgeIdleMs = atoi(optarg); break;
+      case 'R': opts.replayPath = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if (opts.nodes < 1 || opts.nodes > SIM_MAX_NODES || opts.current > opts.nodes) {
+    fprintf(stderr, "Nodes must be 1 - %d\n", SIM_MAX_NODES);
+    exit(1);
+  }
+  if (opts.lateNodes + opts.slowNodes > opts.nodes) {
+    fprintf(stderr, "Late and slow nodes add up to more than %u nodes\n", opts.nodes);
+    exit(1);
+  }
+  if (opts.baud == 0 || opts.pageSize == 0 || opts.pageSize > 255) {
+    usage(argv[0]);
+  }
+  bus->config.seed = opts.seed;
+  if (opts.pageGapUs == 0) {
+    opts.pageGapUs = (bus->config.flashEraseNs + bus->config.flashWriteNs) / 1000 + 200;
+  }
+
+  bus->config.baud = opts.baud;
+  byteNs = (10ULL * 1000000000ULL + opts.baud / 2) / opts.baud;
+}
+
+////////////////////////////////////////////
+/// Report
+////////////////////////////////////////////
+
+static void report(uint8_t finished, uint16_t pages) {
+  uint8_t flash[SIM_APP_SIZE];
+  memset(flash, 0xFF, sizeof(flash));
+  memcpy(flash, bus->image, opts.imageSize);
+  uint64_t expected = flashHash(flash, sizeof(flash));
+
+  uint16_t verified = 0;
+  uint32_t overruns = 0;
+  uint32_t bitErrors = 0;
+  uint32_t dropped = 0;
+  uint64_t sessionNs = now;
+  uint64_t nodeNs = 0;
+  for (uint16_t i = 0; i < opts.nodes; i++) {
+    struct simNode *node = &bus->nodes[i];
+    if (node->exitReason == SIM_EXIT_RESET && node->flashHash == expected) {
+      verified++;
+    }
+    if (node->time > sessionNs) {
+      sessionNs = node->time;
+    }
+    nodeNs += node->time;
+    overruns += node->overruns;
+    bitErrors += node->bitErrors;
+    dropped += node->dropped;
+  }
+
+  double seconds = sessionNs / 1e9;
+  double nodeSeconds = nodeNs / 1e9 / opts.nodes;
+  double goodput = opts.imageSize / seconds;
+
+  if (opts.csv) {
+    printf("mode,nodes,current,baud,page_size,image_size,pages,seed,ber,drop_rate,late_nodes,slow_nodes,"
+           "finished,session_ms,mean_node_ms,bytes_sent,bytes_retransmitted,rounds,restarts,goodput_Bps,"
+           "nodes_verified,overruns,bit_errors,bytes_dropped\n");
+    printf("%s,%u,%u,%u,%u,%u,%u,%u,%g,%g,%u,%u,%u,%.3f,%.3f,%u,%u,%u,%u,%.1f,%u,%u,%u,%u\n",
+           opts.label, opts.nodes, opts.current, opts.baud, opts.pageSize, opts.imageSize, pages,
+           opts.seed, bus->config.bitErrorRate, bus->config.dropRate, opts.lateNodes, opts.slowNodes,
+           finished, seconds * 1000, nodeSeconds * 1000, bytesSent, bytesRetransmitted, rounds, restarts, goodput,
+           verified, overruns, bitErrors, dropped);
+    return;
+  }
+
+  printf("Nodes:               %u (%u already current)\n", opts.nodes, opts.current);
+  printf("Baud:                %u\n", opts.baud);
+  printf("Image:               %u bytes, %u pages of %u\n", opts.imageSize, pages, opts.pageSize);
+  printf("Session:             %s\n", finished ? "finished" : "gave up");
+  printf("Session time:        %.3f s\n", seconds);
+  printf("Mean node time:      %.3f s (until it leaves the bootloader)\n", nodeSeconds);
+  printf("Bytes sent:          %u (%u retransmitted in %u rounds, %u from the start)\n",
+         bytesSent, bytesRetransmitted, rounds, restarts);
+  printf("Goodput:             %.1f bytes/s\n", goodput);
+  printf("Nodes verified:      %u/%u\n", verified, opts.nodes);
+  printf("UART overruns:       %u\n", overruns);
+  printf("Line faults:         %u bit errors, %u bytes dropped\n", bitErrors, dropped);
+
+  for (uint16_t i = 0; i < opts.nodes; i++) {
+    struct simNode *node = &bus->nodes[i];
+    static const char *reasons[] = { "running", "reset", "app", "crashed" };
+    printf("  node %3u: %-7s at %8.3f s, %3u pages written, %u bytes read%s\n",
+           i, reasons[node->exitReason], node->time / 1e9, node->pagesWritten, node->bytesRead,
+           (node->state != SIM_NODE_EXITED || node->flashHash == expected) ? "" : ", flash mismatch");
+  }
+}
+
+int main(int argc, char **argv) {
+  signal(SIGPIPE, SIG_IGN);
+
+  createBus();
+  parseOptions(argc, argv);
+  loadImage();
+
+  uint16_t pages = (opts.imageSize + opts.pageSize - 1) / opts.pageSize;
+
+  if (opts.replayPath) {
+    openCapture();
+  }
+
+  startNodes();
+  uint8_t finished = opts.bridge ? bridgeNodes() :
+                     opts.replayPath ? replayNodes() : programNodes(pages);
+  report(finished, pages);
+  stopNodes();
+
+  return finished ? 0 : 2;
+}
@@ -0,0 +1,76 @@
+#include "protocol.h"
+
+#define SOM_BYTE   0xFF
+#define BATCH_FLAG 0x01
+
+#define FRAME_END     0xC0
+#define FRAME_ESC     0xDB
+#define FRAME_ESC_END 0xDC
+#define FRAME_ESC_ESC 0xDD
+#define ESCAPED_FLAG  0x04
+
+uint16_t crc16Update(uint16_t crc, uint8_t data) {
+  crc ^= data;
+  for (uint8_t i = 0; i < 8; i++) {
+    if (crc & 1) {
+      crc = (crc >> 1) ^ 0xA001;
+    } else {
+      crc = (crc >> 1);
+    }
+  }
+  return crc;
+}
+
+// Add a byte of the message, escaping it if needed
+static uint16_t putByte(uint8_t *out, uint16_t n, uint8_t b) {
+#if ESCAPED_FRAMING == 1
+  if (b == FRAME_END) {
+    out[n++] = FRAME_ESC;
+    b = FRAME_ESC_END;
+  }
+  else if (b == FRAME_ESC) {
+    out[n++] = FRAME_ESC;
+    b = FRAME_ESC_ESC;
+  }
+#endif
+  out[n++] = b;
+  return n;
+}
+
+uint16_t frameEncode(uint8_t *out, uint8_t command, const uint8_t *data, uint8_t len) {
+  uint16_t crc = ~0;
+  uint16_t n = 0;
+  uint8_t flags = BATCH_FLAG;
+
+#if ESCAPED_FRAMING == 1
+  out[n++] = FRAME_END;
+  flags |= ESCAPED_FLAG;
+#else
+  out[n++] = SOM_BYTE;
+  out[n++] = SOM_BYTE;
+#endif
+
+  // Header: flags, address, command, nodes in batch, length per node
+  uint8_t header[5] = { flags, 0, command, 1, len };
+  for (uint8_t i = 0; i < sizeof(header); i++) {
+    n = putByte(out, n, header[i]);
+    crc = crc16Update(crc, header[i]);
+  }
+
+  for (uint16_t i = 0; i < len; i++) {
+    n = putByte(out, n, data[i]);
+    crc = crc16Update(crc, data[i]);
+  }
+
+  n = putByte(out, n, (crc >> 8) & 0xFF);
+  n = putByte(out, n, crc & 0xFF);
+  return n;
+}
+
+uint64_t flashHash(const uint8_t *data, uint32_t len) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (uint32_t i = 0; i < len; i++) {
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
@@ -0,0 +1,32 @@
+/*****************************************************************************
+*
+* The programmer's side of the bootloader protocol: CRC and frame encoding.
+* The image digest sent in the START message is in common/digest.h.
+*
+****************************************************************************/
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+#include "../hal.h"
+#include "../config.h"
+
+// SOM + header + CRC
+#define FRAME_OVERHEAD 9
+
+// Largest frame we'll ever encode (every byte escaped, with ESCAPED_FRAMING)
+#define FRAME_MAX (2 * (FRAME_OVERHEAD + 255))
+
+// Same as avr-libc's _crc16_update (polynomial 0xA001)
+uint16_t crc16Update(uint16_t crc, uint8_t data);
+
+// Encode a bootloader message into `out` and return the number of bytes.
+// The framing follows ESCAPED_FRAMING in config.h.
+uint16_t frameEncode(uint8_t *out, uint8_t command, const uint8_t *data, uint8_t len);
+
+// 64-bit FNV-1a, used to compare flash contents
+uint64_t flashHash(const uint8_t *data, uint32_t len);
+
+#endif
@@ -0,0 +1,107 @@
+/*****************************************************************************
+*
+* Simulated AVR registers and avr-libc functions used by the bootloader.
+*
+* The registers the bootloader only writes to are plain variables. The UART
+* registers are backed by the virtual bus (see sim_hal.c), so reading
+* UCSR0A/UDR0 receives bytes in simulated time. TCNT1 counts simulated time.
+* Writing OCR1A clears OCF1A (writes to TIFR1 are ignored).
+*
+****************************************************************************/
+
+#ifndef SIM_AVR_H
+#define SIM_AVR_H
+
+#include <stdint.h>
+
+#ifndef SPM_PAGESIZE
+#define SPM_PAGESIZE 128
+#endif
+
+// ATmega328P memory sizes
+#define SIM_FLASH_SIZE  32768
+#define SIM_EEPROM_SIZE 1024
+
+// Flash below the bootloader section
+#ifndef SIM_APP_SIZE
+#define SIM_APP_SIZE 0x7C00
+#endif
+
+////////////////////////////////////////////
+/// Registers
+////////////////////////////////////////////
+
+extern volatile uint8_t simMCUSR, simWDTCSR;
+extern volatile uint8_t simPORTD, simDDRD, simPIND;
+extern volatile uint8_t simUCSR0B, simUCSR0C;
+extern volatile uint16_t simUBRR0;
+extern volatile uint8_t simTCCR1A, simTCCR1B;
+
+volatile uint8_t *simUartStatus(void);
+volatile uint8_t *simUartData(void);
+volatile uint16_t *simTimer1(void);
+volatile uint16_t *simTimer1Compare(void);
+volatile uint8_t *simTimer1Flags(void);
+
+#define MCUSR   simMCUSR
+#define WDTCSR  simWDTCSR
+#define PORTD   simPORTD
+#define DDRD    simDDRD
+#define PIND    simPIND
+#define UCSR0A  (*simUartStatus())
+#define UCSR0B  simUCSR0B
+#define UCSR0C  simUCSR0C
+#define UBRR0   simUBRR0
+#define UDR0    (*simUartData())
+#define TCCR1A  simTCCR1A
+#define TCCR1B  simTCCR1B
+#define TCNT1   (*simTimer1())
+#define OCR1A   (*simTimer1Compare())
+#define TIFR1   (*simTimer1Flags())
+
+#define WDRF   3
+#define WDCE   4
+#define WDE    3
+
+#define RXC0   7
+#define RXEN0  4
+#define UCSZ01 2
+#define UCSZ00 1
+
+#define CS12   2
+#define CS11   1
+#define CS10   0
+#define OCF1A  1
+
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+
+////////////////////////////////////////////
+/// avr-libc
+////////////////////////////////////////////
+
+#define WDTO_15MS 0
+
+void boot_page_erase(uint16_t address);
+void boot_page_fill(uint16_t address, uint16_t word);
+void boot_page_write(uint16_t address);
+void boot_rww_enable(void);
+#define boot_spm_busy_wait()
+
+uint8_t eeprom_read_byte(const uint8_t *address);
+void eeprom_update_byte(uint8_t *address, uint8_t value);
+#define eeprom_busy_wait()
+
+void wdt_enable(uint8_t timeout);
+
+uint16_t _crc16_update(uint16_t crc, uint8_t data);
+
+void startApplication(void);
+
+#endif
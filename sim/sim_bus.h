@@ -0,0 +1,99 @@
+/*****************************************************************************
+*
+* The virtual RS485 bus shared between the simulated programmer and the
+* bootloader node processes.
+*
+* The programmer appends every byte it transmits to a single stream, stamped
+* with the simulated time (ns) it finishes arriving at the nodes. The stream
+* is final up to `horizon`; nodes never run past it, which keeps the
+* simulation deterministic no matter how the processes are scheduled.
+*
+* When the programmer needs to look at the signal line it moves the horizon
+* forward and waits for every node to block waiting on the bus again.
+*
+****************************************************************************/
+
+#ifndef SIM_BUS_H
+#define SIM_BUS_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define SIM_MAX_NODES 255
+#define SIM_IMAGE_MAX 32768
+
+// Environment variables used to hand the bus to a node process
+#define SIM_ENV_BUS_FD  "SIM_BUS_FD"
+#define SIM_ENV_NODE_ID "SIM_NODE_ID"
+
+// Node states
+#define SIM_NODE_RUNNING 0
+#define SIM_NODE_WAITING 1
+#define SIM_NODE_EXITED  2
+
+// Why a node exited
+#define SIM_EXIT_NONE    0
+#define SIM_EXIT_RESET   1  // watchdog reset after programming
+#define SIM_EXIT_APP     2  // jumped straight to the program
+#define SIM_EXIT_CRASHED 3  // the process died
+
+struct simConfig {
+  uint32_t baud;
+  uint32_t fCpu;
+  uint32_t cyclesPerByte;   // CPU time to read and parse one byte
+  uint32_t flashEraseNs;
+  uint32_t flashWriteNs;
+  uint32_t eepromWriteNs;
+  uint32_t imageSize;
+  uint8_t digest[8];
+
+  // Faults, drawn independently by each node
+  double bitErrorRate;      // chance of each data bit being flipped
+  double dropRate;          // chance of missing a byte entirely
+  uint32_t seed;
+};
+
+struct simNode {
+  // Set by the programmer before the node starts
+  uint8_t preload;          // node already has the image
+  uint16_t spmPercent;      // flash erase/write time, percent of the datasheet value
+  uint64_t joinNs;          // powered up late, misses everything before this
+
+  // Published by the node
+  uint32_t state;
+  uint32_t waitGen;
+  uint8_t signal;           // 1 when driving the signal line low
+  uint8_t exitReason;
+  uint16_t pageSize;
+  uint16_t ubrr;
+  uint64_t time;
+  uint32_t bytesRead;
+  uint32_t overruns;
+  uint32_t bitErrors;
+  uint32_t dropped;
+  uint32_t pagesWritten;
+  uint64_t flashHash;
+};
+
+struct simBus {
+  pthread_mutex_t lock;
+  pthread_cond_t streamChanged;  // programmer -> nodes
+  pthread_cond_t nodeBlocked;    // nodes -> programmer
+
+  uint32_t gen;
+  uint32_t count;
+  uint32_t capacity;
+  uint64_t horizon;
+
+  struct simConfig config;
+  struct simNode nodes[SIM_MAX_NODES];
+
+  uint8_t image[SIM_IMAGE_MAX];
+};
+
+// The stream arrays follow the bus header in the shared mapping
+#define SIM_STREAM_TIMES(bus) ((uint64_t *)((bus) + 1))
+#define SIM_STREAM_BYTES(bus) ((uint8_t *)(SIM_STREAM_TIMES(bus) + (bus)->capacity))
+#define SIM_BUS_MAP_SIZE(capacity) (sizeof(struct simBus) + (uint64_t)(capacity) * 9)
+
+#endif
@@ -0,0 +1,425 @@
+/*****************************************************************************
+*
+* Node side of the simulator.
+*
+* Each bootloader node runs in its own process, so main.c and comm.c are used
+* unchanged. This provides the registers and avr-libc functions declared in
+* sim_avr.h on top of the shared virtual bus (sim_bus.h), and keeps the
+* node's local time as it receives bytes and writes flash.
+*
+****************************************************************************/
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../hal.h"
+#include "../config.h"
+#include "sim_bus.h"
+#include "protocol.h"
+
+// Characters the USART holds before it overruns:
+// two in the receive buffer and one in the shift register
+#define UART_FIFO_SIZE 3
+
+////////////////////////////////////////////
+/// Registers
+////////////////////////////////////////////
+
+volatile uint8_t simMCUSR, simWDTCSR;
+volatile uint8_t simPORTD, simDDRD, simPIND;
+volatile uint8_t simUCSR0B, simUCSR0C;
+volatile uint16_t simUBRR0;
+volatile uint8_t simTCCR1A, simTCCR1B;
+
+static volatile uint8_t ucsr0a;
+static volatile uint8_t udr0;
+static volatile uint16_t tcnt1;
+static volatile uint16_t ocr1a;
+static volatile uint8_t tifr1;
+
+// When OCR1A was last written
+static uint8_t compareArmed;
+static uint64_t compareArmedAt;
+
+////////////////////////////////////////////
+/// Local Variables
+////////////////////////////////////////////
+
+static struct simBus *bus;
+static struct simNode *node;
+
+// Local time (ns)
+static uint64_t now;
+
+// What we've seen of the bus stream
+static const uint64_t *streamTimes;
+static const uint8_t *streamBytes;
+static uint32_t cursor;
+static uint32_t count;
+static uint64_t horizon;
+
+// USART receive buffer
+static uint8_t fifo[UART_FIFO_SIZE];
+static uint8_t fifoHead;
+static uint8_t fifoLen;
+
+// Faults on our side of the line
+static uint32_t randomState;
+static uint64_t bitsUntilError;
+static uint64_t bytesUntilDrop;
+
+static uint8_t flash[SIM_FLASH_SIZE];
+static uint8_t pageBuffer[SPM_PAGESIZE];
+static uint8_t eeprom[SIM_EEPROM_SIZE];
+
+////////////////////////////////////////////
+/// Time
+////////////////////////////////////////////
+
+static void advance(uint64_t ns) {
+  now += ns;
+}
+
+static uint64_t cyclesToNs(uint32_t cycles) {
+  return (uint64_t)cycles * 1000000000ULL / bus->config.fCpu;
+}
+
+////////////////////////////////////////////
+/// Faults
+////////////////////////////////////////////
+
+static uint32_t random32() {
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+// Number of trials before the next event that happens with `probability`
+static uint64_t untilNextEvent(double probability) {
+  if (probability <= 0) {
+    return UINT64_MAX;
+  }
+  double u = (random32() + 0.5) / 4294967296.0;
+  double trials = log(u) / log1p(-probability);
+  return trials < 1e18 ? trials : UINT64_MAX;
+}
+
+// Apply line faults to a received byte
+// Returns 0 if the byte was lost.
+static uint8_t lineFault(uint8_t *b) {
+  if (bytesUntilDrop == 0) {
+    bytesUntilDrop = untilNextEvent(bus->config.dropRate);
+    node->dropped++;
+    return 0;
+  }
+  if (bytesUntilDrop != UINT64_MAX) {
+    bytesUntilDrop--;
+  }
+
+  while (bitsUntilError < 8) {
+    uint64_t next = untilNextEvent(bus->config.bitErrorRate);
+    *b ^= 1 << bitsUntilError;
+    node->bitErrors++;
+    bitsUntilError = (next == UINT64_MAX) ? UINT64_MAX : bitsUntilError + 1 + next;
+  }
+  if (bitsUntilError != UINT64_MAX) {
+    bitsUntilError -= 8;
+  }
+  return 1;
+}
+
+////////////////////////////////////////////
+/// Bus
+////////////////////////////////////////////
+
+// Copy our state to the shared node entry for the programmer
+static void publish() {
+  node->signal = (SIGNAL_DDR_REG >> SIGNAL_BIT) & 1;
+  node->ubrr = simUBRR0;
+  node->time = now;
+}
+
+// Wait for the programmer to add to the stream or move the horizon
+static void waitForStream() {
+  pthread_mutex_lock(&bus->lock);
+  if (bus->count == count && bus->horizon == horizon) {
+    uint32_t gen = bus->gen;
+
+    publish();
+    node->state = SIM_NODE_WAITING;
+    node->waitGen = gen;
+    pthread_cond_broadcast(&bus->nodeBlocked);
+
+    while (bus->gen == gen) {
+      pthread_cond_wait(&bus->streamChanged, &bus->lock);
+    }
+    node->state = SIM_NODE_RUNNING;
+  }
+  count = bus->count;
+  horizon = bus->horizon;
+  pthread_mutex_unlock(&bus->lock);
+}
+
+// A byte finished arriving on the RX line
+static void lineReceive(uint8_t b) {
+  if (fifoLen == UART_FIFO_SIZE) {
+    node->overruns++;
+    return;
+  }
+  fifo[(fifoHead + fifoLen) % UART_FIFO_SIZE] = b;
+  fifoLen++;
+}
+
+// Receive everything that arrived up to our local time
+static void uartFill() {
+  while (1) {
+    while (cursor < count && streamTimes[cursor] <= now) {
+      uint8_t b = streamBytes[cursor];
+
+      // Not powered up yet
+      if (streamTimes[cursor++] < node->joinNs) {
+        continue;
+      }
+      if (lineFault(&b)) {
+        lineReceive(b);
+      }
+    }
+
+    // We know nothing else arrives before `now`
+    if (cursor < count || horizon >= now) {
+      return;
+    }
+    waitForStream();
+  }
+}
+
+// Leave the simulation
+static void nodeExit(uint8_t reason) {
+  publish();
+  node->flashHash = flashHash(flash, SIM_APP_SIZE);
+
+  pthread_mutex_lock(&bus->lock);
+  node->exitReason = reason;
+  node->state = SIM_NODE_EXITED;
+  pthread_cond_broadcast(&bus->nodeBlocked);
+  pthread_mutex_unlock(&bus->lock);
+  exit(0);
+}
+
+// Attach to the bus handed to us by the programmer
+__attribute__((constructor))
+static void simNodeInit() {
+  const char *fdEnv = getenv(SIM_ENV_BUS_FD);
+  const char *idEnv = getenv(SIM_ENV_NODE_ID);
+  if (!fdEnv || !idEnv) {
+    fprintf(stderr, "Node must be started by multidrop_sim\n");
+    exit(1);
+  }
+
+  int fd = atoi(fdEnv);
+  struct simBus header;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+    perror("pread");
+    exit(1);
+  }
+
+  bus = mmap(NULL, SIM_BUS_MAP_SIZE(header.capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (bus == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  streamTimes = SIM_STREAM_TIMES(bus);
+  streamBytes = SIM_STREAM_BYTES(bus);
+
+  int id = atoi(idEnv);
+  node = &bus->nodes[id];
+  node->pageSize = SPM_PAGESIZE;
+  now = node->joinNs;
+
+  // Give each node its own, unrelated sequence
+  randomState = bus->config.seed * 0x9E3779B9UL + (id + 1) * 0x85EBCA6BUL;
+  randomState ^= randomState >> 16;
+  randomState *= 0x7FEB352DUL;
+  randomState ^= randomState >> 15;
+  randomState *= 0x846CA68BUL;
+  randomState ^= randomState >> 16;
+  if (!randomState) {
+    randomState = 1;
+  }
+  bitsUntilError = untilNextEvent(bus->config.bitErrorRate);
+  bytesUntilDrop = untilNextEvent(bus->config.dropRate);
+
+  memset(flash, 0xFF, sizeof(flash));
+  memset(pageBuffer, 0xFF, sizeof(pageBuffer));
+  memset(eeprom, 0xFF, sizeof(eeprom));
+
+  // Already running the image that's about to be sent
+  if (node->preload) {
+    memcpy(flash, bus->image, bus->config.imageSize);
+    memcpy(&eeprom[(uintptr_t)EEPROM_IMAGE_DIGEST], bus->config.digest, IMAGE_DIGEST_LEN);
+  }
+}
+
+////////////////////////////////////////////
+/// UART
+////////////////////////////////////////////
+
+static uint64_t compareDeadline();
+
+volatile uint8_t *simUartStatus() {
+  uartFill();
+
+  // The bootloader spins on this until the next byte arrives,
+  // or until its receive timeout expires
+  while (fifoLen == 0) {
+    uint64_t deadline = compareDeadline();
+    if (deadline <= now) {
+      deadline = UINT64_MAX;
+    }
+
+    if (cursor < count && streamTimes[cursor] <= deadline) {
+      now = streamTimes[cursor];
+      uartFill();
+    } else if (deadline != UINT64_MAX && (cursor < count || horizon >= deadline)) {
+      now = deadline;
+      ucsr0a = 0;
+      return &ucsr0a;
+    } else {
+      waitForStream();
+    }
+  }
+
+  ucsr0a = (1 << RXC0);
+  return &ucsr0a;
+}
+
+volatile uint8_t *simUartData() {
+  udr0 = 0;
+  if (fifoLen) {
+    udr0 = fifo[fifoHead];
+    fifoHead = (fifoHead + 1) % UART_FIFO_SIZE;
+    fifoLen--;
+    node->bytesRead++;
+  }
+
+  // Time spent handling the byte
+  advance(cyclesToNs(bus->config.cyclesPerByte));
+  return &udr0;
+}
+
+////////////////////////////////////////////
+/// Timer1
+////////////////////////////////////////////
+
+static uint16_t timer1Prescale() {
+  static const uint16_t prescalers[] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+  return prescalers[simTCCR1B & 0x07];
+}
+
+// Timer1 ticks from the start of the simulation until `ns`
+static uint64_t timer1Ticks(uint64_t ns) {
+  return ns * bus->config.fCpu / 1000000000ULL / timer1Prescale();
+}
+
+// When TCNT1 next reaches OCR1A, after it was written
+static uint64_t compareDeadline() {
+  if (!compareArmed || !timer1Prescale()) {
+    return UINT64_MAX;
+  }
+
+  uint64_t armedTicks = timer1Ticks(compareArmedAt);
+  uint16_t ticks = ocr1a - (uint16_t)armedTicks;
+  uint64_t cycles = (armedTicks + (ticks ? ticks : 0x10000)) * timer1Prescale();
+  return (cycles * 1000000000ULL + bus->config.fCpu - 1) / bus->config.fCpu;
+}
+
+// Counts from the start of the simulation, at the prescaler set in TCCR1B
+volatile uint16_t *simTimer1() {
+  tcnt1 = timer1Prescale() ? timer1Ticks(now) : 0;
+  return &tcnt1;
+}
+
+// OCR1A is only ever written
+volatile uint16_t *simTimer1Compare() {
+  compareArmed = 1;
+  compareArmedAt = now;
+  return &ocr1a;
+}
+
+volatile uint8_t *simTimer1Flags() {
+  tifr1 = (now >= compareDeadline()) ? (1 << OCF1A) : 0;
+  return &tifr1;
+}
+
+////////////////////////////////////////////
+/// Flash
+////////////////////////////////////////////
+
+static void checkPageAddress(uint16_t address) {
+  if (address % SPM_PAGESIZE || address + SPM_PAGESIZE > SIM_APP_SIZE) {
+    fprintf(stderr, "Node %d: invalid page address 0x%04X\n", (int)(node - bus->nodes), address);
+    nodeExit(SIM_EXIT_CRASHED);
+  }
+}
+
+void boot_page_erase(uint16_t address) {
+  checkPageAddress(address);
+  memset(&flash[address], 0xFF, SPM_PAGESIZE);
+  advance((uint64_t)bus->config.flashEraseNs * node->spmPercent / 100);
+}
+
+void boot_page_fill(uint16_t address, uint16_t word) {
+  address %= SPM_PAGESIZE;
+  pageBuffer[address] = word & 0xFF;
+  pageBuffer[address + 1] = word >> 8;
+}
+
+void boot_page_write(uint16_t address) {
+  checkPageAddress(address);
+  memcpy(&flash[address], pageBuffer, SPM_PAGESIZE);
+  memset(pageBuffer, 0xFF, SPM_PAGESIZE);
+  node->pagesWritten++;
+  advance((uint64_t)bus->config.flashWriteNs * node->spmPercent / 100);
+}
+
+void boot_rww_enable() {
+}
+
+////////////////////////////////////////////
+/// EEPROM
+////////////////////////////////////////////
+
+uint8_t eeprom_read_byte(const uint8_t *address) {
+  return eeprom[(uintptr_t)address % SIM_EEPROM_SIZE];
+}
+
+void eeprom_update_byte(uint8_t *address, uint8_t value) {
+  uint16_t i = (uintptr_t)address % SIM_EEPROM_SIZE;
+  if (eeprom[i] != value) {
+    eeprom[i] = value;
+    advance(bus->config.eepromWriteNs);
+  }
+}
+
+////////////////////////////////////////////
+/// Misc
+////////////////////////////////////////////
+
+void wdt_enable(uint8_t timeout) {
+  (void)timeout;
+  nodeExit(SIM_EXIT_RESET);
+}
+
+void startApplication() {
+  nodeExit(SIM_EXIT_APP);
+}
+
+uint16_t _crc16_update(uint16_t crc, uint8_t data) {
+  return crc16Update(crc, data);
+}
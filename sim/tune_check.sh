@@ -0,0 +1,90 @@
+#!/bin/sh
+#
+# Checks the session cost model the host programmer tunes itself with
+# (host/SessionPlanner.h) against the simulated bus. For each drop rate and
+# checkpoint interval, prints the session time and rounds the model expects
+# next to the mean of the simulated sessions, as CSV. Exits with 1 if any of
+# them are further apart than the tolerance.
+#
+# Each setting is taken from the environment:
+#
+#   TUNE_NODES        Nodes on the bus
+#   TUNE_IMAGE_SIZE   Image size, in bytes
+#   TUNE_DROPS        Chances of a node missing each byte
+#   TUNE_CHECKPOINTS  Checkpoint intervals (0 is only at the end of the image;
+#                     every one the planner compares by default)
+#   TUNE_SEEDS        Random seeds; each is a simulated session
+#   TUNE_TOLERANCE    How far a simulated mean can be from the model, as a
+#                     fraction of the model, on top of two standard errors
+#                     of the mean
+#
+# The nodes are the ones `make sim` builds, so the page size and baud rate
+# come from SIM_PAGESIZE and SIM_BAUD. Run from the repository root, usually
+# through `make tune_check`.
+#
+
+NODES=${TUNE_NODES:-8}
+IMAGE_SIZE=${TUNE_IMAGE_SIZE:-16384}
+DROPS=${TUNE_DROPS:-"1e-5 3e-5 1e-4"}
+CHECKPOINTS=$TUNE_CHECKPOINTS
+SEEDS=${TUNE_SEEDS:-"1 2 3 4 5"}
+TOLERANCE=${TUNE_TOLERANCE:-0.2}
+PAGE_SIZE=${SIM_PAGESIZE:-128}
+BAUD=${SIM_BAUD:-115200}
+
+BUILD=sim/bench
+mkdir -p $BUILD || exit 1
+IMAGE=$BUILD/tune.bin
+head -c $IMAGE_SIZE /dev/urandom > $IMAGE || exit 1
+
+# A page is a PAGE_NUM message (10 bytes) and a PAGE_DATA message (9 bytes and the data),
+# and fails if any node misses any of its bytes
+pageErrorRate() {
+  awk -v d="$1" -v n=$NODES -v b=$((PAGE_SIZE + 19)) 'BEGIN { printf "%.6f", 1 - (1 - d) ^ (n * b) }'
+}
+
+echo "drop_rate,page_error_rate,checkpoint,predicted_s,simulated_s,predicted_rounds,simulated_rounds,sessions,within"
+failed=0
+for drop in $DROPS; do
+  rate=$(pageErrorRate $drop)
+  ./host/multidrop_plan --page-size $PAGE_SIZE --baud $BAUD --error-rate $rate $IMAGE > $BUILD/tune.plan || exit 1
+
+  # The planner's checkpoint intervals are the rows after the table's heading
+  checkpoints=${CHECKPOINTS:-$(awk '$1 == "Checkpoint" { table = 1; next }
+                                    table && NF { print ($1 == "end") ? 0 : $1 }' $BUILD/tune.plan)}
+
+  for checkpoint in $checkpoints; do
+    label=$checkpoint
+    if [ $checkpoint = 0 ]; then
+      label=end
+    fi
+    predicted=$(awk -v k=$label '$1 == k { print $2 "," $4 }' $BUILD/tune.plan)
+
+    # Time and rounds of each session that finished
+    for seed in $SEEDS; do
+      ./sim/multidrop_sim --csv --nodes $NODES --baud $BAUD --page-size $PAGE_SIZE --image $IMAGE \
+        --drop-rate $drop --checkpoint $checkpoint --max-rounds 1000 --seed $seed | tail -n 1
+    done > $BUILD/tune.csv
+
+    # The mean of each, and whether it's within the tolerance of the model
+    row=$(awk -F, -v predicted=$predicted -v tolerance=$TOLERANCE '
+      function within(model, sum, squares) {
+        mean = sum / n
+        se = (n > 1) ? sqrt((squares - n * mean * mean) / (n - 1) / n) : 0
+        return (mean - model) ^ 2 <= (tolerance * model + 2 * se) ^ 2
+      }
+      $13 == 1 { s = $14 / 1000; ss += s; ss2 += s * s; rs += $18; rs2 += $18 * $18; n++ }
+      END {
+        split(predicted, p, ",")
+        if (!n) { printf "%s,,%s,,0,no", p[1], p[2]; exit }
+        ok = within(p[1], ss, ss2) && within(p[2], rs, rs2)
+        printf "%s,%.3f,%s,%.1f,%d,%s", p[1], ss / n, p[2], rs / n, n, ok ? "yes" : "no"
+      }' $BUILD/tune.csv)
+
+    echo "$drop,$rate,$checkpoint,$row"
+    case $row in
+      *,no) failed=1 ;;
+    esac
+  done
+done
+exit $failed
@@ -1,8 +1,38 @@
 #include "Discobus.h"
 #include "DiscobusData.h"
+#include <util/delay.h>
 
 
-Discobus::Discobus(DiscobusData *_serial) : serial(_serial) {
+Discobus::Discobus() {
+  escaped = 0;
+  escapePending = 0;
+  guardUs = 0;
+  frameUs = 0;
+}
+
+void Discobus::setBusTiming(uint32_t baud, uint16_t turnaroundUs, uint8_t frameBits) {
+  frameUs = (frameBits * 1000000UL + baud - 1) / baud;
+  guardUs = frameUs + turnaroundUs;
+}
+
+uint16_t Discobus::guardTimeUs() {
+  return guardUs;
+}
+
+uint32_t Discobus::responseSlotUs(uint8_t length) {
+  return guardUs + (uint32_t)length * frameUs;
+}
+
+uint8_t Discobus::fitsSchedule(uint8_t length, uint8_t nodes) {
+  return responseSlotUs(length) * nodes + guardUs <= MD_SCHEDULE_MAX_US;
+}
+
+void Discobus::waitGuardTime() {
+  // _delay_us() only takes constants, so wait a microsecond at a time
+  // (the loop makes it a little longer)
+  for (uint16_t us = guardUs; us; us--) {
+    _delay_us(1);
+  }
 }
 
 void Discobus::addDaisyChain(volatile uint8_t d1_pin_number,
@@ -112,3 +142,20 @@ uint8_t Discobus::isPrevDaisyEnabled() {
   return !(*pin & mask);
 }
 
+uint8_t Discobus::unescapeByte(uint8_t *b) {
+  if (!escaped) return 1;
+
+  if (escapePending) {
+    escapePending = 0;
+    if (*b == FRAME_ESC_END) {
+      *b = FRAME_END;
+    } else if (*b == FRAME_ESC_ESC) {
+      *b = FRAME_ESC;
+    }
+  }
+  else if (*b == FRAME_ESC) {
+    escapePending = 1;
+    return 0;
+  }
+  return 1;
+}
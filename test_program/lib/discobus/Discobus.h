@@ -1,5 +1,13 @@
 /************************************************************************************
  *  The base class that master and slave classes extend from.
+ *
+ *  DiscobusMasterT and DiscobusSlaveT are templates over the data stream
+ *  (the "transport") they talk through. DiscobusMaster and DiscobusSlave use any
+ *  DiscobusData through its virtual methods. Passing a concrete transport, like
+ *  DiscobusUart or DiscobusRS485, lets the compiler inline it into the parser
+ *  instead, and leaves out the vtables. A transport needs the same methods as
+ *  DiscobusData, and has to be added to the list at the bottom of
+ *  DiscobusMaster.cpp or DiscobusSlave.cpp.
  ************************************************************************************/
 
 #ifndef Discobus_H
@@ -8,22 +16,53 @@
 // Maximum size of the message buffer
 #define MSG_BUFFER_LEN  150
 
+// Time, in microseconds, for a transceiver to let go of the line, and the
+// next one to take it, including the interrupt that releases it
+#ifndef MD_TURNAROUND_US
+#define MD_TURNAROUND_US 20
+#endif
+
+// Gaps, in microseconds, left before writing to the bus until the bus timing
+// is set (see setBusTiming): before a tentative address, and before a response
+#ifndef MD_ADDRESS_GUARD_US
+#define MD_ADDRESS_GUARD_US 200
+#endif
+#ifndef MD_RESPONSE_GUARD_US
+#define MD_RESPONSE_GUARD_US 150
+#endif
+
+// The longest round of turns, in microseconds, for responses on a schedule
+// (see scheduleResponses). It has to fit in Timer1 (see DiscobusTimer.cpp).
+#ifndef MD_SCHEDULE_MAX_US
+#define MD_SCHEDULE_MAX_US 3000000UL
+#endif
+
 #include <avr/io.h>
 #include <stdint.h>
+#include <util/crc16.h>
 #include "DiscobusData.h"
 
 #define CMD_RESET   0xFA
 #define CMD_ADDRESS 0xFB
 #define CMD_NULL    0xFF
 
+// Escaped framing: each message starts with FRAME_END and any FRAME_END or
+// FRAME_ESC inside the message is sent as FRAME_ESC followed by FRAME_ESC_END
+// or FRAME_ESC_ESC. So, unlike 0xFF 0xFF, the start can't show up in the data.
+#define FRAME_END     0xC0
+#define FRAME_ESC     0xDB
+#define FRAME_ESC_END 0xDC
+#define FRAME_ESC_ESC 0xDD
+
 class Discobus {
 
 public:
   static const uint8_t BROADCAST_ADDRESS = 0;
   static const uint8_t BATCH_FLAG = 0b00000001;
   static const uint8_t RESPONSE_MESSAGE_FLAG = 0b00000010;
+  static const uint8_t ESCAPED_FLAG = 0b00000100;
 
-  Discobus(DiscobusData*);
+  Discobus();
 
   // Add the pin and registers for the daisy chain lines.
   // To automatically define the polarity as d1=prev and d2=next, pass `set_polarity` as `true`.
@@ -55,6 +94,19 @@ public:
   // the pins for d1_* and d2_* defined in addDaisyChain()
   void setDaisyChainPolarity(uint8_t prev, uint8_t next);
 
+  // Work out the gap left before writing to the bus, instead of the defaults
+  // (MD_ADDRESS_GUARD_US and MD_RESPONSE_GUARD_US).
+  // The gap is a frame at `baud` (to let the last byte finish and the line go idle),
+  // plus `turnaroundUs`. Use 11 `frameBits` for 9-bit frames (see setMultiprocessorMode).
+  void setBusTiming(uint32_t baud, uint16_t turnaroundUs=MD_TURNAROUND_US, uint8_t frameBits=10);
+
+  // The gap, in microseconds (0 until the bus timing is set)
+  uint16_t guardTimeUs();
+
+  // Microseconds from the start of one node's turn in a response message to the next:
+  // the gap, then `length` bytes.
+  uint32_t responseSlotUs(uint8_t length);
+
 
 protected:
 
@@ -63,10 +115,22 @@ protected:
     response_msg = 0x40
   };
 
-  DiscobusData *serial;
-
   uint16_t messageCRC;
 
+  // Bus timing (see setBusTiming)
+  uint16_t guardUs,
+           frameUs;
+
+  // Can `nodes` turns of `length` bytes go on the response schedule (see MD_SCHEDULE_MAX_US)
+  uint8_t fitsSchedule(uint8_t length, uint8_t nodes);
+
+  // Wait out the gap before writing to the bus (once the bus timing is set)
+  void waitGuardTime();
+
+  // The current message uses escaped framing
+  uint8_t escaped,
+          escapePending;
+
   // Daisy chain pin registers
   volatile uint8_t d1_num,
                    d2_num;
@@ -89,6 +153,48 @@ protected:
   // Get the value (1 or 0) from the prev daisy chain pin
   uint8_t isPrevDaisyEnabled();
 
+  // Write a byte of the current message (escaped, if the message is)
+  template <class Transport>
+  void writeByte(Transport *serial, uint8_t b) {
+    if (escaped && (b == FRAME_END || b == FRAME_ESC)) {
+      serial->write(FRAME_ESC);
+      b = (b == FRAME_END) ? FRAME_ESC_END : FRAME_ESC_ESC;
+    }
+    serial->write(b);
+  }
+
+  // Write several bytes of the current message and add them to messageCRC.
+  // Runs of bytes that don't need escaping are handed to the data stream at once.
+  template <class Transport>
+  void writeData(Transport *serial, const uint8_t *data, uint16_t len) {
+    if (!escaped) {
+      serial->write(data, len, &messageCRC);
+      return;
+    }
+
+    while (len) {
+      uint16_t run = 0;
+      while (run < len && data[run] != FRAME_END && data[run] != FRAME_ESC) {
+        run++;
+      }
+      if (run) {
+        serial->write(data, run, &messageCRC);
+        data += run;
+        len -= run;
+      }
+      else {
+        writeByte(serial, *data);
+        messageCRC = _crc16_update(messageCRC, *data);
+        data++;
+        len--;
+      }
+    }
+  }
+
+  // Unescape a byte received in the current message.
+  // Returns 0 if `b` was FRAME_ESC, and the data byte is still to come.
+  uint8_t unescapeByte(uint8_t *b);
+
 };
 
 #endif
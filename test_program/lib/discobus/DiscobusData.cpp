@@ -0,0 +1,59 @@
+
+#include "DiscobusData.h"
+#include "DiscobusMessage.h"
+#include <util/crc16.h>
+
+// Defaults for subclasses that don't need every method
+// (this also gives the compiler somewhere to put the class's vtable)
+
+void DiscobusData::begin(uint32_t baud) { }
+uint8_t DiscobusData::available() { return 0; }
+uint8_t DiscobusData::read() { return 0; }
+void DiscobusData::write(uint8_t) { }
+void DiscobusData::flush() { }
+void DiscobusData::clear() { }
+void DiscobusData::enable_write() { }
+void DiscobusData::enable_read() { }
+uint8_t DiscobusData::onReceive(DiscobusReceiveFunction handler, void *context) { return 0; }
+uint8_t DiscobusData::setMultiprocessorMode(uint8_t enabled) { return 0; }
+void DiscobusData::writeStart(uint8_t b) { write(b); }
+uint8_t DiscobusData::skipMessage() { return 0; }
+
+uint8_t DiscobusData::read(uint8_t *buff, uint8_t max, uint16_t *crc) {
+  uint8_t i;
+  for (i = 0; i < max && available(); i++) {
+    buff[i] = read();
+    if (crc) {
+      *crc = _crc16_update(*crc, buff[i]);
+    }
+  }
+  return i;
+}
+
+void DiscobusData::write(const uint8_t *data, uint16_t len, uint16_t *crc) {
+  for (uint16_t i = 0; i < len; i++) {
+    write(data[i]);
+    if (crc) {
+      *crc = _crc16_update(*crc, data[i]);
+    }
+  }
+}
+
+void DiscobusData::queue(DiscobusMessage *message) {
+  uint8_t b;
+
+  enable_write();
+  message->rewind();
+  if (message->nextByte(&b)) {
+    writeStart(b);
+    while (message->nextByte(&b)) {
+      write(b);
+    }
+  }
+  enable_read();
+
+  message->state = DiscobusMessage::SENT;
+  if (message->onSent) {
+    message->onSent(message);
+  }
+}
@@ -15,6 +15,11 @@
 
 #include <avr/io.h>
 
+class DiscobusMessage;
+
+// Takes each byte as it's received (see DiscobusData::onReceive)
+typedef void (*DiscobusReceiveFunction)(void *context, uint8_t b);
+
 class DiscobusData {
 public:
 
@@ -30,6 +35,40 @@ public:
   // Write a byte to the TX line
   virtual void write(uint8_t);
 
+  // Read up to `max` bytes from the RX buffer into `buff` and return how many were read.
+  // If `crc` is set, it's updated with each byte as it's copied.
+  virtual uint8_t read(uint8_t *buff, uint8_t max, uint16_t *crc=0);
+
+  // Write `len` bytes to the TX line, updating `crc` (if set) with each one.
+  // The default versions of these call the single byte methods, subclasses
+  // can copy whole runs of their buffers at once.
+  virtual void write(const uint8_t *data, uint16_t len, uint16_t *crc=0);
+
+  // Hand every received byte to `handler`, from the receive interrupt, instead
+  // of buffering it for read(). Pass 0 to go back to buffering.
+  // Returns 0 if the data stream can't (which is what this default version does).
+  virtual uint8_t onReceive(DiscobusReceiveFunction handler, void *context);
+
+  // Send a whole message (see DiscobusMessage.h), in the background if the
+  // data stream can. This default version sends it right away, with the
+  // write methods, and calls the message's onSent before returning.
+  virtual void queue(DiscobusMessage *message);
+
+  // Use 9-bit frames, where only the first byte of each message has the 9th bit
+  // set, so nodes can have the hardware skip messages for other nodes (see
+  // skipMessage). Everyone on the bus has to agree on the framing.
+  // Returns 0 if the data stream can't (which is what this default version does).
+  virtual uint8_t setMultiprocessorMode(uint8_t enabled);
+
+  // Write the first byte of a message. In multiprocessor mode, this is the
+  // only byte sent with the 9th bit set. The default version calls write().
+  virtual void writeStart(uint8_t b);
+
+  // Ignore everything received until the next message starts.
+  // Returns 0 if the data stream can't, or still has received bytes to be read,
+  // and the caller has to parse its way through the rest of the message.
+  virtual uint8_t skipMessage();
+
   // Send everything in the TX buffer with blocking
   virtual void flush();
 
@@ -1,24 +1,25 @@
-
 #ifndef DiscobusData485_H
 #define DiscobusData485_H
 
 #include "DiscobusDataUart.h"
+#include "DiscobusRS485.h"
 #include <avr/io.h>
 
+// DiscobusRS485 as a DiscobusData (see DiscobusRS485.h)
 class DiscobusData485 : public DiscobusDataUart {
 public:
-  DiscobusData485(volatile uint8_t de_pin_num,
-                   volatile uint8_t* de_ddr_register,
-                   volatile uint8_t* de_port_register);
+  DiscobusData485(uint8_t de_pin_num,
+                  volatile uint8_t* de_ddr_register,
+                  volatile uint8_t* de_port_register);
 
+  using DiscobusDataUart::write;
   void write(uint8_t byte);
   void enable_write();
   void enable_read();
+  void queue(DiscobusMessage *message);
 
 private:
-  volatile uint8_t de_pin;
-  volatile uint8_t* de_ddr;
-  volatile uint8_t* de_port;
+  DiscobusRS485 rs485;
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,186 +1,68 @@
-
 #include "DiscobusDataUart.h"
-#include <avr/interrupt.h>
-
-////////////////////////////////////////////
-/// Prototypes
-////////////////////////////////////////////
-void uartReceive();
-void uartSendNextByte();
-void writeByteToRegister(uint8_t);
-
-////////////////////////////////////////////
-/// Macros
-////////////////////////////////////////////
-#define UART0_UBRRH UBRR0H
-#define UART0_UBRRL UBRR0L
-#define UART0_UCSRA UCSR0A
-#define UART0_UCSRB UCSR0B
-#define UART0_UCSRC UCSR0C
-#define UART0_UDR   UDR0
-#define UART0_UDRE  UDRE0
-#define UART0_TXC   TXC0
-
-#ifndef UART0_RX_BUFFER_SIZE
-#define UART0_RX_BUFFER_SIZE 150
-#endif
-
-#ifndef UART0_TX_BUFFER_SIZE
-#define UART0_TX_BUFFER_SIZE 60
-#endif
-
-
-#define UART_BAUD_SELECT(baudRate)  (((F_CPU) + 8UL * (baudRate)) / (16UL * (baudRate)) -1UL)
-
-#define TX_BUFFER_EMPTY() (tx_buffer_head == tx_buffer_tail)
-#define TX_NEXT_HEAD_IDX() ((tx_buffer_head + 1) % UART0_TX_BUFFER_SIZE)
-#define TX_BUFFER_FULL() (TX_NEXT_HEAD_IDX() == tx_buffer_tail)
-
-#define RX_BUFFER_EMPTY() (rx_buffer_head == rx_buffer_tail)
-#define RX_BUFFER_FULL() (((rx_buffer_head + 1) % UART0_RX_BUFFER_SIZE) == rx_buffer_tail)
-
-#define DISABLE_TX_INT() UART0_UCSRB &= ~(1 << UDRIE0);
-#define ENABLE_TX_INT() UART0_UCSRB |= (1 << UDRIE0)
-
-////////////////////////////////////////////
-/// Static Globals
-////////////////////////////////////////////
-static volatile uint8_t rx_buffer[UART0_RX_BUFFER_SIZE];
-static volatile uint8_t tx_buffer[UART0_TX_BUFFER_SIZE];
-
-static volatile uint8_t tx_buffer_head;
-static volatile uint8_t tx_buffer_tail;
-static volatile uint8_t rx_buffer_head;
-static volatile uint8_t rx_buffer_tail;
-
-////////////////////////////////////////////
-/// Class members
-////////////////////////////////////////////
-DiscobusDataUart::DiscobusDataUart() { }
-
-// Hook into the UART and start receiving data
-void DiscobusDataUart::begin(uint32_t baud) {
-  UART0_UCSRA = 0;
-
-  // Endable TX/RX
-  UART0_UCSRB = (1<<TXEN0) | (1<<RXEN0);
-  UART0_UCSRB |= (1<<RXCIE0);  // RX Interrupt
 
-  // Frame format (8-bit, 1 stop bit)
-  UART0_UCSRC = 1<<UCSZ01 | 1<<UCSZ00;
+// Everything is passed on to DiscobusUart
 
-  // Set baud
-  UART0_UBRRL =  (unsigned char)UART_BAUD_SELECT(baud);
-  UART0_UBRRH =  (unsigned char)(UART_BAUD_SELECT(baud) << 8);
+DiscobusDataUart::DiscobusDataUart() { }
 
-  // Enable interrupts
-  sei();
+void DiscobusDataUart::begin(uint32_t baud) {
+  uart.begin(baud);
 }
 
-// Write something to the TX line
 void DiscobusDataUart::write(uint8_t c) {
+  uart.write(c);
+}
 
-  // If buffer is empty and the register is ready to be written
-  // to, send it directly
-  if (TX_BUFFER_EMPTY() && (UART0_UCSRA & (1<<UART0_UDRE))) {
-    writeByteToRegister(c);
-    return;
-  }
-
-  // If TX buffer is full, we need to flush a byte out first
-  if (TX_BUFFER_FULL()) {
-    uartSendNextByte();
-  }
-
-  // Add to buffer and enable interrupt
-  tx_buffer[tx_buffer_head] = c;
-  tx_buffer_head = TX_NEXT_HEAD_IDX();
-  ENABLE_TX_INT();
+void DiscobusDataUart::write(const uint8_t *data, uint16_t len, uint16_t *crc) {
+  uart.write(data, len, crc);
 }
 
-// Read a byte from the RX buffer
 uint8_t DiscobusDataUart::read() {
-  // if the head isn't ahead of the tail, we don't have any characters
-  if (RX_BUFFER_EMPTY()) {
-    return -1;
-  } else {
-    uint8_t c = rx_buffer[rx_buffer_tail];
-    rx_buffer_tail = (uint8_t)(rx_buffer_tail + 1) % UART0_RX_BUFFER_SIZE;
-    return c;
-  }
+  return uart.read();
+}
+
+uint8_t DiscobusDataUart::read(uint8_t *buff, uint8_t max, uint16_t *crc) {
+  return uart.read(buff, max, crc);
 }
 
-// How many bytes are available in the RX buffer
 uint8_t DiscobusDataUart::available() {
-  return ((uint8_t)(UART0_RX_BUFFER_SIZE + rx_buffer_head - rx_buffer_tail)) % UART0_RX_BUFFER_SIZE;
+  return uart.available();
+}
+
+uint16_t DiscobusDataUart::overflows() {
+  return uart.overflows();
+}
+
+void DiscobusDataUart::resetOverflows() {
+  uart.resetOverflows();
 }
 
-// Clears the RX buffer
 void DiscobusDataUart::clear() {
-  rx_buffer_head = 0;
-  rx_buffer_tail = 0;
+  uart.clear();
 }
 
-// Send everything in the TX buffer with blocking
 void DiscobusDataUart::flush() {
-  DISABLE_TX_INT();
-  while (!TX_BUFFER_EMPTY()) {
-    uartSendNextByte();
-  }
-  // Wait for the transmit to complete
-  while (!(UART0_UCSRA & (1 << UART0_TXC)));
+  uart.flush();
 }
 
-// Not implemented
 void DiscobusDataUart::enable_write() { }
 void DiscobusDataUart::enable_read() { }
 
-////////////////////////////////////////////
-/// Interrupt Controls
-////////////////////////////////////////////
-
-// Receive the byte out of the RX register
-void uartReceive() {
-  // RX buffer full, not taking on new bytes
-  if (RX_BUFFER_FULL()) {
-    return;
-  }
-
-  rx_buffer[rx_buffer_head] = UART0_UDR;
-  rx_buffer_head = (rx_buffer_head + 1) % UART0_RX_BUFFER_SIZE;
+void DiscobusDataUart::queue(DiscobusMessage *message) {
+  uart.queue(message);
 }
 
-// Send the next byte off the TX buffer
-void uartSendNextByte() {
-  if (TX_BUFFER_EMPTY()) return;
-  DISABLE_TX_INT();
-
-  // Wait for TX to be ready
-  while(!(UART0_UCSRA & (1<<UART0_UDRE)));
-
-  // Send from tail and move tail forward
-  writeByteToRegister(tx_buffer[tx_buffer_tail]);
-  tx_buffer_tail = (tx_buffer_tail + 1) % UART0_TX_BUFFER_SIZE;
-
-  // If buffer isn't empty, enable interrupt
-  if (!TX_BUFFER_EMPTY()) {
-    ENABLE_TX_INT();
-  }
+uint8_t DiscobusDataUart::onReceive(DiscobusReceiveFunction handler, void *context) {
+  return uart.onReceive(handler, context);
 }
 
-// Write a single byte to the TX register
-// this assumes you've made sure the register is empty
-void writeByteToRegister(uint8_t b) {
-  UART0_UDR = b;
-  UART0_UCSRA |= (1 << UART0_TXC); // Reset transmit byte
+uint8_t DiscobusDataUart::setMultiprocessorMode(uint8_t enabled) {
+  return uart.setMultiprocessorMode(enabled);
 }
 
-// Received a byte from the RX line
-ISR(USART_RX_vect){
-  uartReceive();
+void DiscobusDataUart::writeStart(uint8_t b) {
+  uart.writeStart(b);
 }
 
-// Ready to send a byte on the TX line
-ISR(USART_UDRE_vect) {
-  uartSendNextByte();
+uint8_t DiscobusDataUart::skipMessage() {
+  return uart.skipMessage();
 }
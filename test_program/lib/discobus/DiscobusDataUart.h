@@ -3,8 +3,11 @@
 #define DiscobusDataUart_H
 
 #include "DiscobusData.h"
+#include "DiscobusUart.h"
 #include <avr/io.h>
 
+// DiscobusUart as a DiscobusData (see DiscobusUart.h)
+
 class DiscobusDataUart : public DiscobusData {
 public:
   DiscobusDataUart();
@@ -21,6 +24,21 @@ public:
   // Write something to the TX line
   void write(uint8_t);
 
+  // Read or write several bytes at once (see DiscobusData.h)
+  uint8_t read(uint8_t *buff, uint8_t max, uint16_t *crc=0);
+  void write(const uint8_t *data, uint16_t len, uint16_t *crc=0);
+
+  // Send a whole message in the background
+  void queue(DiscobusMessage *message);
+
+  // Hand each received byte to `handler` from the RX interrupt
+  uint8_t onReceive(DiscobusReceiveFunction handler, void *context);
+
+  // 9-bit frames, so nodes can skip messages for other nodes (see DiscobusData.h)
+  uint8_t setMultiprocessorMode(uint8_t enabled);
+  void writeStart(uint8_t b);
+  uint8_t skipMessage();
+
   // Send everything in the TX buffer and return when the
   // final frame has been transmitted out
   void flush();
@@ -28,9 +46,17 @@ public:
   // Clears the RX buffer
   void clear();
 
+  // How many received bytes have been dropped because the RX buffer was full.
+  // Raise UART0_RX_BUFFER_SIZE, or read more often, if this goes up.
+  uint16_t overflows();
+  void resetOverflows();
+
   // Not implemented
   void enable_write();
   void enable_read();
+
+protected:
+  DiscobusUart uart;
 };
 
 #endif
\ No newline at end of file
@@ -3,19 +3,43 @@
 
 #include "DiscobusMaster.h"
 
+#ifdef __AVR__
+#include "DiscobusRS485.h"
+#endif
+
 #define BATCH_FLAG            0b00000001
 #define RESPONSE_MESSAGE_FLAG 0b00000010
 
-DiscobusMaster::DiscobusMaster(DiscobusData *serial) : Discobus(serial) {
+template <class Transport>
+DiscobusMasterT<Transport>::DiscobusMasterT(Transport *_serial) : serial(_serial) {
   state = EOM;
   nodeNum = 0;
+  escapedFraming = false;
+  scheduled = false;
+  onSchedule = false;
 }
 
-void DiscobusMaster::setNodeLength(uint8_t num) {
+template <class Transport>
+void DiscobusMasterT<Transport>::setNodeLength(uint8_t num) {
   nodeNum = num;
 }
 
-void DiscobusMaster::addNextDaisyChain(volatile uint8_t next_pin_num,
+template <class Transport>
+void DiscobusMasterT<Transport>::setEscapedFraming(uint8_t enabled) {
+  escapedFraming = enabled;
+}
+
+template <class Transport>
+uint8_t DiscobusMasterT<Transport>::scheduleResponses(uint8_t enabled) {
+  if (enabled && !frameUs) {
+    return 0;
+  }
+  scheduled = enabled;
+  return 1;
+}
+
+template <class Transport>
+void DiscobusMasterT<Transport>::addNextDaisyChain(volatile uint8_t next_pin_num,
                                         volatile uint8_t* next_ddr_register,
                                         volatile uint8_t* next_port_register,
                                         volatile uint8_t* next_pin_register) {
@@ -32,7 +56,8 @@ void DiscobusMaster::addNextDaisyChain(volatile uint8_t next_pin_num,
   daisy_next = 1;
 }
 
-uint8_t DiscobusMaster::startMessage(uint8_t command,
+template <class Transport>
+uint8_t DiscobusMasterT<Transport>::startMessage(uint8_t command,
                                       uint8_t destinationAddr,
                                       uint8_t dataLen,
                                       uint8_t batchMode,
@@ -40,8 +65,11 @@ uint8_t DiscobusMaster::startMessage(uint8_t command,
 
   state = 0;
   messageCRC = ~0;
+  escaped = escapedFraming;
+  escapePending = 0;
   dataLength = dataLen;
   destAddress = destinationAddr;
+  onSchedule = scheduled && batchMode && responseMessage && fitsSchedule(dataLen, nodeNum);
 
   uint8_t flags = 0;
   if (batchMode) {
@@ -53,11 +81,18 @@ uint8_t DiscobusMaster::startMessage(uint8_t command,
     // Don't timeout on first check
     dontTimeout = true;
   }
+  if (escaped) {
+    flags |= ESCAPED_FLAG;
+  }
 
-  // Start sending header
+  // Start sending header (the start of message isn't part of the CRC)
   serial->enable_write();
-  sendByte(0xFF);
-  sendByte(0xFF);
+  if (escaped) {
+    serial->writeStart(FRAME_END);
+  } else {
+    serial->writeStart(0xFF);
+    serial->write(0xFF);
+  }
   sendByte(flags);
   sendByte(destAddress);
   sendByte(command);
@@ -69,16 +104,60 @@ uint8_t DiscobusMaster::startMessage(uint8_t command,
   sendByte(dataLength);
   serial->enable_read();
 
+  // The nodes' turns are timed from the end of the header,
+  // so make sure it's out before the program reads the time
+  if (onSchedule) {
+    serial->flush();
+  }
+
   state = HEADER_SENT;
   return 1;
 }
 
-void DiscobusMaster::resetAllNodes() {
+template <class Transport>
+uint8_t DiscobusMasterT<Transport>::queueMessage(DiscobusMessage *message,
+                                                 uint8_t command,
+                                                 uint8_t destinationAddr,
+                                                 const uint8_t *data,
+                                                 uint8_t dataLen,
+                                                 uint8_t batchMode) {
+  if (state != EOM || !message->isSent()) return 0;
+
+  uint8_t header[5],
+          headerLen = 0,
+          i;
+  uint16_t crc = ~0,
+           fullLen = dataLen;
+
+  header[headerLen++] = (batchMode ? BATCH_FLAG : 0) | (escapedFraming ? ESCAPED_FLAG : 0);
+  header[headerLen++] = destinationAddr;
+  header[headerLen++] = command;
+  if (batchMode) {
+    header[headerLen++] = nodeNum;
+    fullLen = (uint16_t)nodeNum * dataLen;
+  }
+  header[headerLen++] = dataLen;
+
+  for (i = 0; i < headerLen; i++) {
+    crc = _crc16_update(crc, header[i]);
+  }
+  for (uint16_t j = 0; j < fullLen; j++) {
+    crc = _crc16_update(crc, data[j]);
+  }
+
+  message->set(header, headerLen, data, fullLen, crc, escapedFraming);
+  serial->queue(message);
+  return 1;
+}
+
+template <class Transport>
+void DiscobusMasterT<Transport>::resetAllNodes() {
   startMessage(CMD_RESET, BROADCAST_ADDRESS);
   finishMessage();
 }
 
-void DiscobusMaster::startAddressing(uint32_t time, uint32_t timeout) {
+template <class Transport>
+void DiscobusMasterT<Transport>::startAddressing(uint32_t time, uint32_t timeout) {
   nodeNum = 0;
   lastAddressReceived = 0;
   nodeAddressTries = 0;
@@ -97,12 +176,14 @@ void DiscobusMaster::startAddressing(uint32_t time, uint32_t timeout) {
   dontTimeout = true;
 }
 
-void DiscobusMaster::setResponseSettings(uint8_t *buff, uint32_t time, uint32_t timeout, uint8_t *defaultResponse) {
+template <class Transport>
+void DiscobusMasterT<Transport>::setResponseSettings(uint8_t *buff, uint32_t time, uint32_t timeout, uint8_t *defaultResponse) {
   responseIndex = 0;
   responseBuff = buff;
   timeoutDuration = timeout;
   defaultResponseValues = defaultResponse;
   timeoutTime = time + timeoutDuration;
+  roundStart = time;
 
   if (destAddress == BROADCAST_ADDRESS) {
     waitingOnNodes = nodeNum;
@@ -111,7 +192,8 @@ void DiscobusMaster::setResponseSettings(uint8_t *buff, uint32_t time, uint32_t
   }
 }
 
-uint8_t DiscobusMaster::checkForResponses(uint32_t time) {
+template <class Transport>
+uint8_t DiscobusMasterT<Transport>::checkForResponses(uint32_t time) {
   uint8_t b, i;
 
   if (dontTimeout) {
@@ -120,14 +202,26 @@ uint8_t DiscobusMaster::checkForResponses(uint32_t time) {
   dontTimeout = false;
 
   // Received all responses
-  if (waitingOnNodes == 0) {
+  if (waitingOnNodes == 0 && !onSchedule) {
     finishMessage();
     return true;
   }
 
-  // Get more responses
-  while (serial->available()) {
+  // Get more responses. Without escaping, they're copied straight
+  // into the response buffer.
+  while (!escaped && waitingOnNodes) {
+    uint16_t left = (uint16_t)waitingOnNodes * dataLength - (responseIndex % dataLength);
+    uint8_t n = serial->read(&responseBuff[responseIndex], (left > 0xFF) ? 0xFF : left, &messageCRC);
+    if (!n) break;
+
+    waitingOnNodes -= (responseIndex + n) / dataLength - responseIndex / dataLength;
+    responseIndex += n;
+    dontTimeout = true;
+  }
+  while (escaped && serial->available()) {
     b = serial->read();
+    if (!unescapeByte(&b)) continue;
+
     responseBuff[responseIndex] = b;
     messageCRC = _crc16_update(messageCRC, b);
 
@@ -140,8 +234,25 @@ uint8_t DiscobusMaster::checkForResponses(uint32_t time) {
     }
   }
 
+  // On a schedule, each node only has until the end of its turn
+  if (onSchedule) {
+    uint32_t slot = responseSlotUs(dataLength),
+             elapsed = time - roundStart;
+
+    while (waitingOnNodes && elapsed > slot * (responseIndex / dataLength + 1) + guardUs) {
+      skipNode();
+    }
+
+    // The nodes ignore the bus until every turn is over
+    if (!waitingOnNodes && elapsed > slot * nodeNum + guardUs) {
+      finishMessage();
+      return true;
+    }
+    return false;
+  }
+
   // Node timeout, send default response
-  if (time > timeoutTime) {
+  if (waitingOnNodes && time > timeoutTime) {
 
     // It's possible the node sent a partial response, so send whatever is left
     for (i = responseIndex % dataLength; i < dataLength; i++) {
@@ -161,7 +272,20 @@ uint8_t DiscobusMaster::checkForResponses(uint32_t time) {
   return false;
 }
 
-DiscobusMaster::adr_state_t DiscobusMaster::checkForAddresses(uint32_t time) {
+template <class Transport>
+void DiscobusMasterT<Transport>::skipNode() {
+
+  // It's possible the node sent a partial response, so fill in whatever is left
+  for (uint8_t i = responseIndex % dataLength; i < dataLength; i++) {
+    responseBuff[responseIndex] = defaultResponseValues[i];
+    responseIndex++;
+  }
+  escapePending = 0;
+  waitingOnNodes--;
+}
+
+template <class Transport>
+typename DiscobusMasterT<Transport>::adr_state_t DiscobusMasterT<Transport>::checkForAddresses(uint32_t time) {
   uint8_t b;
 
   if (dontTimeout) {
@@ -179,9 +303,16 @@ DiscobusMaster::adr_state_t DiscobusMaster::checkForAddresses(uint32_t time) {
 
   // Receive next address
   if (serial->available()) {
+    uint8_t received = 0;
     dontTimeout = true; // skip timing out next call
     while (serial->available()) {
       b = serial->read();
+      received = unescapeByte(&b);
+    }
+
+    // Wait for the rest of an escaped byte
+    if (!received) {
+      return ADR_WAITING;
     }
 
     // Verify it's 1 larger than the last address and send confirmation
@@ -228,7 +359,8 @@ DiscobusMaster::adr_state_t DiscobusMaster::checkForAddresses(uint32_t time) {
   return ADR_WAITING;
 }
 
-uint8_t DiscobusMaster::sendData(uint8_t d) {
+template <class Transport>
+uint8_t DiscobusMasterT<Transport>::sendData(uint8_t d) {
   if (state == EOM) return 0;
 
   sendByte(d, true);
@@ -236,21 +368,21 @@ uint8_t DiscobusMaster::sendData(uint8_t d) {
   return 1;
 }
 
-uint8_t DiscobusMaster::sendData(uint8_t *data, uint16_t len) {
+template <class Transport>
+uint8_t DiscobusMasterT<Transport>::sendData(uint8_t *data, uint16_t len) {
   if (state == EOM) return 0;
 
   serial->enable_write();
-  for(uint16_t i = 0; i < len; i++) {
-    sendByte(data[i]);
-  }
+  writeData(serial, data, len);
   serial->enable_read();
   state = DATA_SENDING;
   return 1;
 }
 
-void DiscobusMaster::sendByte(uint8_t b, uint8_t directionCntrl, uint8_t updateCRC) {
+template <class Transport>
+void DiscobusMasterT<Transport>::sendByte(uint8_t b, uint8_t directionCntrl, uint8_t updateCRC) {
   if (directionCntrl) serial->enable_write();
-  serial->write(b);
+  writeByte(serial, b);
   if (directionCntrl) serial->enable_read();
 
   if (updateCRC) {
@@ -258,7 +390,8 @@ void DiscobusMaster::sendByte(uint8_t b, uint8_t directionCntrl, uint8_t updateC
   }
 }
 
-uint8_t DiscobusMaster::finishMessage() {
+template <class Transport>
+uint8_t DiscobusMasterT<Transport>::finishMessage() {
   if (state == EOM) return 0;
 
   serial->enable_write();
@@ -290,3 +423,14 @@ uint8_t DiscobusMaster::finishMessage() {
   return 1;
 }
 
+////////////////////////////////////////////
+/// Transports
+////////////////////////////////////////////
+
+// The transports the template is built for. Add yours here to use it
+// directly, instead of through DiscobusData.
+template class DiscobusMasterT<DiscobusData>;
+#ifdef __AVR__
+template class DiscobusMasterT<DiscobusUart>;
+template class DiscobusMasterT<DiscobusRS485>;
+#endif
@@ -6,13 +6,15 @@
 #include <avr/io.h>
 #include <stdint.h>
 #include "Discobus.h"
+#include "DiscobusMessage.h"
 
 // How many times master will try to get a node's address, before deciding it is done
 #ifndef MD_MASTER_ADDR_MAX_TRIES
 #define MD_MASTER_ADDR_MAX_TRIES 4
 #endif
 
-class DiscobusMaster: public Discobus {
+template <class Transport>
+class DiscobusMasterT: public Discobus {
 
 public:
   enum adr_state_t {
@@ -22,7 +24,7 @@ public:
   };
   uint8_t nodeNum;
 
-  DiscobusMaster(DiscobusData *_serial);
+  DiscobusMasterT(Transport *_serial);
 
   // Set the number of nodes on the bus
   void setNodeLength(uint8_t);
@@ -35,6 +37,10 @@ public:
                          volatile uint8_t* next_port_register,
                          volatile uint8_t* next_pin_register);
 
+  // Send messages with escaped framing (see FRAME_END in Discobus.h).
+  // Nodes switch to escaped framing when they receive the first escaped message.
+  void setEscapedFraming(uint8_t enabled);
+
   // Start a new message to send
   uint8_t startMessage(uint8_t command,
                       uint8_t destination=BROADCAST_ADDRESS,
@@ -42,6 +48,20 @@ public:
                       uint8_t batchMode=false,
                       uint8_t responseMessage=false);
 
+  // Queue a whole message to be sent in the background, instead of writing it with
+  // startMessage, sendData and finishMessage. With DiscobusUart or DiscobusRS485, the
+  // TX interrupt sends it while your program carries on. Poll message->isSent(), or
+  // set message->onSent, to find out when it's done. Neither `message` nor `data` are
+  // copied, so they have to stay put until then. In batch mode, `data` holds
+  // `dataLength` bytes for each node. (messages that need responses can't be queued)
+  // Returns 0 if a message is being written, or `message` is still queued.
+  uint8_t queueMessage(DiscobusMessage *message,
+                       uint8_t command,
+                       uint8_t destination,
+                       const uint8_t *data,
+                       uint8_t dataLength,
+                       uint8_t batchMode=false);
+
   // Send a reset message to all nodes, which tells them to forget their address and
   // drop their daisy lines to low.
   void resetAllNodes();
@@ -72,6 +92,15 @@ public:
   // Return: true when all nodes have responded
   uint8_t checkForResponses(uint32_t time);
 
+  // Give each node a turn at a set time in batch response messages, like
+  // DiscobusSlaveT::scheduleResponses, so no node waits on another. Times passed to
+  // setResponseSettings and checkForResponses have to be in microseconds, and the
+  // timeout isn't used. A node that misses its turn gets the default response, which
+  // isn't sent, and the CRC is sent once every turn is over. Messages whose turns
+  // take longer than MD_SCHEDULE_MAX_US (see Discobus.h) go back to timeouts.
+  // Set the bus timing first (see Discobus.h). Returns 0 if it hasn't been.
+  uint8_t scheduleResponses(uint8_t enabled);
+
   // Send a single byte of data
   uint8_t sendData(uint8_t data);
 
@@ -82,6 +111,8 @@ public:
   uint8_t finishMessage();
 
 private:
+  Transport *serial;
+
   enum State {
     EOM,
     HEADER_SENT,
@@ -91,7 +122,8 @@ private:
 
   uint32_t timeoutTime,
            timeoutDuration,
-           addrTimeoutDuration;
+           addrTimeoutDuration,
+           roundStart;
   uint16_t responseIndex;
 
   uint8_t  destAddress,
@@ -100,13 +132,22 @@ private:
            dontTimeout,
            waitingOnNodes,
            nodeAddressTries,
-           lastAddressReceived;
+           lastAddressReceived,
+           escapedFraming,
+           scheduled,       // Responses are on a schedule (see scheduleResponses)
+           onSchedule;      // The current message's are
 
   uint8_t *responseBuff,
           *defaultResponseValues;
 
+  // Fill in the default response for the node being waited on, without sending it
+  void skipNode();
+
   // Send a byte and, optionally, update the messageCRC value
   void sendByte(uint8_t b, uint8_t directionCntrl=0, uint8_t updateCRC=1);
 };
 
+// Master on any DiscobusData
+typedef DiscobusMasterT<DiscobusData> DiscobusMaster;
+
 #endif
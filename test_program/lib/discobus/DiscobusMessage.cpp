@@ -0,0 +1,29 @@
+#include "DiscobusMessage.h"
+
+void DiscobusMessage::set(const uint8_t *_header, uint8_t _headerLen, const uint8_t *_data, uint16_t _dataLen,
+                          uint16_t _crc, uint8_t _escaped) {
+  uint8_t i;
+
+  escaped = _escaped;
+  if (escaped) {
+    start[0] = FRAME_END;
+    startLen = 1;
+  } else {
+    start[0] = 0xFF;
+    start[1] = 0xFF;
+    startLen = 2;
+  }
+
+  headerLen = (_headerLen > sizeof(header)) ? sizeof(header) : _headerLen;
+  for (i = 0; i < headerLen; i++) {
+    header[i] = _header[i];
+  }
+
+  data = _data;
+  dataLen = _dataLen;
+
+  crc[0] = (_crc >> 8) & 0xFF;
+  crc[1] = _crc & 0xFF;
+
+  rewind();
+}
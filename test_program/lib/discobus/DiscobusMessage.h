@@ -0,0 +1,119 @@
+#ifndef DiscobusMessage_H
+#define DiscobusMessage_H
+
+/************************************************************************************
+ *  A whole message, queued to be sent in the background
+ *  (see DiscobusMaster::queueMessage).
+ *
+ *  The header and CRC are kept here and the data is sent from where it is, so
+ *  both have to stay put until the message has been sent. The transport takes
+ *  the message apart one byte at a time with nextByte(), which also escapes it
+ *  if the message uses escaped framing.
+ *
+ ************************************************************************************/
+
+#include <stdint.h>
+#include "Discobus.h"
+
+class DiscobusMessage;
+
+typedef void (*DiscobusSentFunction)(DiscobusMessage *message);
+
+class DiscobusMessage {
+public:
+  enum state_t {
+    IDLE,
+    QUEUED,
+    SENT
+  };
+
+  DiscobusMessage() : onSent(0), next(0), state(IDLE) { }
+
+  // Called once the last byte has been handed to the hardware.
+  // With DiscobusUart, this is called from the TX interrupt, so keep it short.
+  DiscobusSentFunction onSent;
+
+  // Has the message been sent (or was it never queued)
+  uint8_t isSent() {
+    return state != QUEUED;
+  }
+
+  ////////////////////////////////////////////
+  /// For DiscobusMaster and the transports
+  ////////////////////////////////////////////
+
+  // Fill in the message (the header is the flags, address, command and length bytes)
+  void set(const uint8_t *header, uint8_t headerLen, const uint8_t *data, uint16_t dataLen,
+           uint16_t crc, uint8_t escaped);
+
+  // Get ready to be sent from the first byte
+  void rewind() {
+    section = 0;
+    pos = 0;
+    escapeNext = 0;
+  }
+
+  // Is the next byte the first one of the message
+  uint8_t atStart() {
+    return section == 0 && pos == 0;
+  }
+
+  // The next byte to send. Returns 0 when the whole message has been sent.
+  uint8_t nextByte(uint8_t *b) {
+    if (escapeNext) {
+      *b = escapeNext;
+      escapeNext = 0;
+      return 1;
+    }
+
+    for (;;) {
+      const uint8_t *p;
+      uint16_t len;
+
+      switch (section) {
+        case 0:  p = start;  len = startLen;  break;
+        case 1:  p = header; len = headerLen; break;
+        case 2:  p = data;   len = dataLen;   break;
+        case 3:  p = crc;    len = 2;         break;
+        default: return 0;
+      }
+
+      if (pos < len) {
+        uint8_t c = p[pos++];
+
+        // Everything after the start of message is escaped
+        if (escaped && section > 0 && (c == FRAME_END || c == FRAME_ESC)) {
+          escapeNext = (c == FRAME_END) ? FRAME_ESC_END : FRAME_ESC_ESC;
+          c = FRAME_ESC;
+        }
+        *b = c;
+        return 1;
+      }
+      section++;
+      pos = 0;
+    }
+  }
+
+  // The next message in the transport's queue
+  DiscobusMessage *next;
+
+  volatile uint8_t state;
+
+private:
+  uint8_t start[2],
+          startLen,
+          header[5],
+          headerLen,
+          crc[2],
+          escaped;
+
+  const uint8_t *data;
+  uint16_t dataLen;
+
+  // Where nextByte() is
+  uint8_t section,
+          escapeNext;
+  uint16_t pos;
+};
+
+#endif
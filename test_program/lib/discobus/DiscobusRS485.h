@@ -0,0 +1,53 @@
+#ifndef DiscobusRS485_H
+#define DiscobusRS485_H
+
+/************************************************************************************
+ *  The UART0 data stream with an RS485 transceiver, whose driver enable (DE)
+ *  pin is raised while writing. Like DiscobusUart, this is for the
+ *  DiscobusMasterT and DiscobusSlaveT templates, and DiscobusData485 wraps it up
+ *  as a DiscobusData.
+ *
+ *  enable_read() doesn't wait for the data to be sent. DE is released by the
+ *  TX complete interrupt, as soon as the last stop bit is out, so the CPU is free
+ *  while the line turns around. Call flush() to wait for it.
+ *
+ ************************************************************************************/
+
+#include "DiscobusUart.h"
+#include <avr/io.h>
+
+class DiscobusRS485 : public DiscobusUart {
+public:
+  DiscobusRS485(uint8_t de_pin_num,
+                volatile uint8_t* de_ddr_register,
+                volatile uint8_t* de_port_register):
+                de_pin(de_pin_num),
+                de_port(de_port_register) {
+
+    *de_ddr_register |= (1 << de_pin_num);
+    *de_port &= ~(1 << de_pin_num);
+  }
+
+  void enable_write() {
+    cancelRelease();
+    *de_port |= (1 << de_pin);
+  }
+
+  // Releases the line once everything has been sent
+  void enable_read() {
+    releaseWhenSent(de_port, (1 << de_pin));
+  }
+
+  // Hold the line until the message (and any queued before it) has been sent
+  void queue(DiscobusMessage *message) {
+    enable_write();
+    DiscobusUart::queue(message);
+    enable_read();
+  }
+
+private:
+  uint8_t de_pin;
+  volatile uint8_t* de_port;
+};
+
+#endif
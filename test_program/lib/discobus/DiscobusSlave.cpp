@@ -1,67 +1,168 @@
 
 #include "DiscobusSlave.h"
+#include <util/atomic.h>
 #include <util/crc16.h>
 #include <util/delay.h>
 
+#ifdef __AVR__
+#include "DiscobusRS485.h"
+#endif
+
 #define MAX_ADDR_ERRORS 5
 
 #define SOM 0xFF
 
-DiscobusSlave::DiscobusSlave(DiscobusData *_serial) : Discobus(_serial) {
+template <class Transport>
+DiscobusSlaveT<Transport>::DiscobusSlaveT(Transport *_serial) : serial(_serial) {
   flags = 0;
   myAddress = 0;
+  escapedFraming = 0;
   responseHandler = 0;
+  dataHandler = 0;
+  dataEndHandler = 0;
+  streaming = 0;
+#if MD_PUBLISH_RESPONSES
+  responseFront = 0;
+  responseReady = 0;
+#endif
   parseState = NO_MESSAGE;
+  rxChunkPos = 0;
+  rxChunkLen = 0;
+#if MD_RESPONSE_TIMER
+  scheduled = 0;
+#endif
+#if MD_MSG_QUEUE_SIZE
+  inInterrupt = 0;
+  dropped = 0;
+  queuedReady = 0;
+#endif
 }
 
-void DiscobusSlave::resetNode() {
+template <class Transport>
+void DiscobusSlaveT<Transport>::resetNode() {
   lastAddr = 0xFF;
   address = 0;
   myAddress = 0;
+  escapedFraming = 0;
   setNextDaisyValue(0);
 }
 
-uint8_t DiscobusSlave::hasNewMessage() {
+template <class Transport>
+uint8_t DiscobusSlaveT<Transport>::hasNewMessage() {
+#if MD_MSG_QUEUE_SIZE
+  if (inInterrupt) {
+    return queuedReady;
+  }
+#endif
   return parseState == MESSAGE_READY;
 }
 
-uint8_t DiscobusSlave::isAddressedToMe() {
+template <class Transport>
+uint8_t DiscobusSlaveT<Transport>::isAddressedToMe() {
+#if MD_MSG_QUEUE_SIZE
+  if (inInterrupt) {
+    return queuedReady && (queuedAddress == myAddress || queuedAddress == BROADCAST_ADDRESS);
+  }
+#endif
   return hasNewMessage() && (address == myAddress || address == BROADCAST_ADDRESS);
 }
 
-uint8_t DiscobusSlave::inBatchMode() {
+template <class Transport>
+uint8_t DiscobusSlaveT<Transport>::inBatchMode() {
+#if MD_MSG_QUEUE_SIZE
+  if (inInterrupt) {
+    return queuedFlags & BATCH_FLAG;
+  }
+#endif
   return flags & BATCH_FLAG;
 }
 
-uint8_t DiscobusSlave::isResponseMessage() {
+template <class Transport>
+uint8_t DiscobusSlaveT<Transport>::isResponseMessage() {
+#if MD_MSG_QUEUE_SIZE
+  if (inInterrupt) {
+    return queuedFlags & RESPONSE_MESSAGE_FLAG;
+  }
+#endif
   return flags & RESPONSE_MESSAGE_FLAG;
 }
 
-uint8_t* DiscobusSlave::getData() {
+template <class Transport>
+uint8_t* DiscobusSlaveT<Transport>::getData() {
+#if MD_MSG_QUEUE_SIZE
+  if (inInterrupt) {
+    return queuedData;
+  }
+#endif
   return dataBuffer;
 }
 
-uint8_t DiscobusSlave::getDataLen() {
+template <class Transport>
+uint8_t DiscobusSlaveT<Transport>::getDataLen() {
+#if MD_MSG_QUEUE_SIZE
+  if (inInterrupt) {
+    return queuedLen;
+  }
+#endif
   return dataIndex;
 }
 
-uint8_t DiscobusSlave::getCommand() {
+template <class Transport>
+uint8_t DiscobusSlaveT<Transport>::getCommand() {
+#if MD_MSG_QUEUE_SIZE
+  if (inInterrupt) {
+    return queuedCommand;
+  }
+#endif
   return command;
 }
 
-void DiscobusSlave::setAddress(uint8_t addr) {
+template <class Transport>
+void DiscobusSlaveT<Transport>::setAddress(uint8_t addr) {
   myAddress = addr;
 }
 
-uint8_t DiscobusSlave::getAddress() {
+template <class Transport>
+uint8_t DiscobusSlaveT<Transport>::getAddress() {
   return myAddress;
 }
 
-void DiscobusSlave::setResponseHandler(DiscobusResponseFunction handler) {
+template <class Transport>
+void DiscobusSlaveT<Transport>::setResponseHandler(DiscobusResponseFunction handler) {
   responseHandler = handler;
 }
 
-void DiscobusSlave::startMessage() {
+#if MD_PUBLISH_RESPONSES
+template <class Transport>
+void DiscobusSlaveT<Transport>::publishResponse(uint8_t command, const uint8_t *data, uint8_t len) {
+  uint8_t back = responseFront ^ 1,
+          i;
+
+  // Fill the buffer that isn't waiting to be sent
+  for (i = 0; i < MD_MAX_DATA_LEN; i++) {
+    responseBuffers[back][i] = (i < len) ? data[i] : 0;
+  }
+
+  // And swap it in
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    responseFront = back;
+    responseCommand = command;
+    responseReady = 1;
+  }
+}
+#endif
+
+template <class Transport>
+void DiscobusSlaveT<Transport>::setDataHandler(DiscobusDataFunction handler, DiscobusDataEndFunction endHandler) {
+  dataHandler = handler;
+  dataEndHandler = endHandler;
+}
+
+template <class Transport>
+void DiscobusSlaveT<Transport>::startMessage() {
+  // The last message was cut short by this one
+  endStream(0);
+
   flags = 0;
   length = 0;
   address = 0;
@@ -73,24 +174,37 @@ void DiscobusSlave::startMessage() {
   dataStartOffset = 0;
   errCount = 0;
   messageCRC = ~0;
+  escaped = 0;
+  escapePending = 0;
 }
 
-uint8_t DiscobusSlave::read() {
+template <class Transport>
+uint8_t DiscobusSlaveT<Transport>::read() {
   checkDaisyChainPolarity();
 
+#if MD_MSG_QUEUE_SIZE
+  if (inInterrupt) {
+    return readQueued();
+  }
+#endif
+
   // Move onto the next message
   if (parseState == MESSAGE_READY) {
     parseState = NO_MESSAGE;
   }
 
   // No new data, but our prev daisy line became enabled
-  if (command == CMD_ADDRESS && parsePos == ADDR_UNSET && isPrevDaisyEnabled() && !serial->available()){
-    processAddressing(lastAddr);
+  if (command == CMD_ADDRESS && parsePos == ADDR_UNSET && isPrevDaisyEnabled() && !rxAvailable()){
+    sendAddress(processAddressing(lastAddr));
   }
 
-  // Handle incoming bytes
-  while (serial->available()) {
-    if(parse(serial->read()) == 1 && !isResponseMessage()) {
+  // Handle incoming bytes, a chunk at a time
+  while (rxAvailable()) {
+    if (rxChunkPos == rxChunkLen) {
+      rxChunkLen = serial->read(rxChunk, MD_RX_CHUNK_LEN);
+      rxChunkPos = 0;
+    }
+    if(parse(rxChunk[rxChunkPos++]) == 1 && !isResponseMessage()) {
 
       if (command == CMD_RESET) {
         resetNode();
@@ -102,18 +216,170 @@ uint8_t DiscobusSlave::read() {
   return 0;
 }
 
+#if MD_MSG_QUEUE_SIZE
+template <class Transport>
+uint8_t DiscobusSlaveT<Transport>::parseInInterrupt() {
+  if (!serial->onReceive(&DiscobusSlaveT<Transport>::receiveInInterrupt, this)) {
+    return 0;
+  }
+  inInterrupt = 1;
+  return 1;
+}
+
+template <class Transport>
+uint16_t DiscobusSlaveT<Transport>::droppedMessages() {
+  uint16_t count;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    count = dropped;
+  }
+  return count;
+}
+
+template <class Transport>
+void DiscobusSlaveT<Transport>::receiveInInterrupt(void *context, uint8_t b) {
+  DiscobusSlaveT<Transport> *slave = (DiscobusSlaveT<Transport>*)context;
+
+  slave->parse(b);
+  if (slave->parseState == MESSAGE_READY) {
+    uint8_t command = slave->command;
+
+    // Responses have already been sent
+    if (!(slave->flags & RESPONSE_MESSAGE_FLAG) &&
+        (slave->address == slave->myAddress || slave->address == BROADCAST_ADDRESS)) {
+      slave->queueMessage();
+    }
+    if (command == CMD_RESET) {
+      slave->resetNode();
+    }
+    slave->parseState = NO_MESSAGE;
+  }
+}
+
+template <class Transport>
+void DiscobusSlaveT<Transport>::queueMessage() {
+  uint8_t header[4] = { flags, address, command, dataIndex };
+
+  if ((uint8_t)(messageQueue.MASK - messageQueue.count()) < sizeof(header) + dataIndex) {
+    dropped++;
+    return;
+  }
+  messageQueue.put(header, sizeof(header));
+  messageQueue.put(dataBuffer, dataIndex);
+}
+
+template <class Transport>
+uint8_t DiscobusSlaveT<Transport>::readQueued() {
+  uint8_t header[4],
+          addr = 0;
+
+  queuedReady = 0;
+
+  // Our prev daisy line became enabled, while the interrupt waits for an address.
+  // Only the decision is made with interrupts off, the gap and the address are sent
+  // with them on.
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (command == CMD_ADDRESS && parsePos == ADDR_UNSET && isPrevDaisyEnabled()) {
+      addr = processAddressing(lastAddr);
+      if (parseState == MESSAGE_READY) {
+        queueMessage();
+        parseState = NO_MESSAGE;
+      }
+    }
+  }
+  sendAddress(addr);
+
+  if (messageQueue.isEmpty()) {
+    return 0;
+  }
+  messageQueue.get(header, sizeof(header));
+  queuedFlags = header[0];
+  queuedAddress = header[1];
+  queuedCommand = header[2];
+  queuedLen = messageQueue.get(queuedData, header[3]);
+  queuedData[queuedLen] = '\0';
+  queuedReady = 1;
+  return 1;
+}
+#endif
+
+#if MD_RESPONSE_TIMER
+template <class Transport>
+uint8_t DiscobusSlaveT<Transport>::scheduleResponses(uint8_t enabled) {
+  if (enabled && (!inInterrupt || !frameUs)) {
+    return 0;
+  }
+  scheduled = enabled;
+  return 1;
+}
+
+template <class Transport>
+uint8_t DiscobusSlaveT<Transport>::startResponseTimer() {
+  uint32_t slot = responseSlotUs(length);
+
+  if (!fitsSchedule(length, numNodes)) {
+    return 0;
+  }
+  return responseTimer.start((myAddress <= numNodes) ? slot * (myAddress - 1) + guardUs : 0,
+                             slot * numNodes + guardUs / 2,
+                             &DiscobusSlaveT<Transport>::onResponseTimer, this);
+}
+
+template <class Transport>
+void DiscobusSlaveT<Transport>::onResponseTimer(void *context, uint8_t event) {
+  DiscobusSlaveT<Transport> *slave = (DiscobusSlaveT<Transport>*)context;
+
+  if (slave->parseState != SCHEDULE_SECTION) {
+    return;
+  }
+
+  // The gap is part of the schedule
+  if (event == DiscobusTimer::SLOT) {
+    slave->sendResponse(0);
+  }
+  // The master sends the CRC next, which isn't worth checking
+  // without the responses it covers
+  else {
+    slave->parseState = NO_MESSAGE;
+  }
+}
+#endif
+
+template <class Transport>
+uint8_t DiscobusSlaveT<Transport>::rxAvailable() {
+  return rxChunkPos < rxChunkLen || serial->available();
+}
+
 /**
  * Parse the next byte off the bus.
  * Returns 1 if a full message has been received, 0 if not.
  */
-uint8_t DiscobusSlave::parse(uint8_t b) {
+template <class Transport>
+uint8_t DiscobusSlaveT<Transport>::parse(uint8_t b) {
+
+  // Start of an escaped message. This is never part of an escaped message,
+  // so it also cuts the current one short.
+  if (b == FRAME_END && (parseState == NO_MESSAGE || escaped || escapedFraming)) {
+    startMessage();
+    escaped = 1;
+    parsePos = SOM2_POS;
+    parseState = HEADER_SECTION;
+    return 0;
+  }
+  if (parseState != NO_MESSAGE && !unescapeByte(&b)) {
+    return 0;
+  }
 
-  if (parseState == HEADER_SECTION) {
+  if (parseState == SKIP_SECTION) {
+    if (--skipLeft == 0) {
+      parseState = NO_MESSAGE;
+    }
+  }
+  else if (parseState == HEADER_SECTION) {
     parseHeader(b);
   }
   else if (parseState == DATA_SECTION) {
     if (command == CMD_ADDRESS) {
-      processAddressing(b);
+      sendAddress(processAddressing(b));
     } else {
       processData(b);
     }
@@ -134,9 +400,16 @@ uint8_t DiscobusSlave::parse(uint8_t b) {
     // Validate each byte
     if (crcByte != b) {
       parseState = NO_MESSAGE; // no match, abort
+      endStream(0);
     }
     else if (parsePos == EOM2_POS) {
       parseState = MESSAGE_READY;
+      endStream(1);
+
+      // From now on, only look for escaped messages
+      if (escaped) {
+        escapedFraming = 1;
+      }
       return 1;
     }
   }
@@ -153,7 +426,7 @@ uint8_t DiscobusSlave::parse(uint8_t b) {
     }
   }
   // First start byte
-  else if (parseState == NO_MESSAGE && b == SOM) {
+  else if (parseState == NO_MESSAGE && b == SOM && !escapedFraming) {
     parsePos = SOM1_POS;
     parseState = START_SECTION;
   }
@@ -161,13 +434,19 @@ uint8_t DiscobusSlave::parse(uint8_t b) {
   return 0;
 }
 
-void DiscobusSlave::parseHeader(uint8_t b) {
+template <class Transport>
+void DiscobusSlaveT<Transport>::parseHeader(uint8_t b) {
   messageCRC = _crc16_update(messageCRC, b);
 
   // Header flags
   if (parsePos == SOM2_POS) {
     parsePos = HEADER_FLAGS_POS;
     flags = b;
+
+    // The flag has to match how the message was framed
+    if (!(flags & ESCAPED_FLAG) != !escaped) {
+      parseState = NO_MESSAGE;
+    }
   }
   // Address
   else if (parsePos == HEADER_FLAGS_POS) {
@@ -184,7 +463,7 @@ void DiscobusSlave::parseHeader(uint8_t b) {
     parsePos = HEADER_LEN1_POS;
 
     // in batch mode, the first length byte is the number of nodes
-    if (inBatchMode()) {
+    if (flags & BATCH_FLAG) {
       numNodes = b;
     } else {
       length = b;
@@ -213,8 +492,24 @@ void DiscobusSlave::parseHeader(uint8_t b) {
   // Finishing header
   if (parseState == DATA_SECTION) {
 
+    // For another node, so there's nothing to check, only the end to find
+    if (!(flags & BATCH_FLAG) && address != myAddress && address != BROADCAST_ADDRESS &&
+        command != CMD_ADDRESS) {
+
+      // Have the transport skip the rest, if it can
+      // (only once every byte taken from it has been parsed)
+      if (rxChunkPos == rxChunkLen && serial->skipMessage()) {
+        parseState = NO_MESSAGE;
+      }
+      // Otherwise count through the data and CRC
+      else {
+        skipLeft = length + 2;
+        parseState = SKIP_SECTION;
+      }
+    }
+
     // On to addressing
-    if (command == CMD_ADDRESS) {
+    else if (command == CMD_ADDRESS) {
       parsePos = ADDR_WAITING;
     }
 
@@ -224,27 +519,52 @@ void DiscobusSlave::parseHeader(uint8_t b) {
       parseState = END_SECTION;
     }
 
+#if MD_RESPONSE_TIMER
+    // Respond on the schedule, and ignore the other nodes' responses
+    else if (scheduled && myAddress && (flags & BATCH_FLAG) && (flags & RESPONSE_MESSAGE_FLAG) &&
+             startResponseTimer()) {
+      parseState = SCHEDULE_SECTION;
+    }
+#endif
+
     // If in response message and we're the first node, move straight to sending a response
-    else if (isResponseMessage() && myAddress == 1) {
+    else if ((flags & RESPONSE_MESSAGE_FLAG) && myAddress == 1) {
       sendResponse();
     }
+
+    // Too long for the data buffer, so it goes to the data handler
+    else if (length > MD_MAX_DATA_LEN && dataHandler && !(flags & RESPONSE_MESSAGE_FLAG)) {
+      streaming = 1;
+      streamOffset = 0;
+    }
   }
 }
 
-void DiscobusSlave::processData(uint8_t b) {
+template <class Transport>
+void DiscobusSlaveT<Transport>::processData(uint8_t b) {
   messageCRC = _crc16_update(messageCRC, b);
   parsePos = DATA_POS;
   
   // If we're in our data section, fill data buffer
-  if (fullDataIndex >= dataStartOffset && dataIndex < length){
-    dataBuffer[dataIndex++] = b;
-    dataBuffer[dataIndex] = '\0';
+  if (fullDataIndex >= dataStartOffset && fullDataIndex - dataStartOffset < length){
+    if (dataIndex < MD_MAX_DATA_LEN) {
+      dataBuffer[dataIndex++] = b;
+      dataBuffer[dataIndex] = '\0';
+    }
+
+    // Pass it on when the buffer is full, or at the end of our data
+    if (streaming && (dataIndex == MD_MAX_DATA_LEN || fullDataIndex + 1 - dataStartOffset == length)) {
+      dataHandler(command, streamOffset, dataBuffer, dataIndex);
+      streamOffset += dataIndex;
+      dataIndex = 0;
+      dataBuffer[0] = '\0';
+    }
   }
 
   fullDataIndex++;
 
   // It's our turn to respond with some data
-  if (isResponseMessage() && fullDataIndex == dataStartOffset) {
+  if ((flags & RESPONSE_MESSAGE_FLAG) && fullDataIndex == dataStartOffset) {
     sendResponse();
     return;
   }
@@ -256,10 +576,21 @@ void DiscobusSlave::processData(uint8_t b) {
 }
 
 
-void DiscobusSlave::processAddressing(uint8_t b) {
+template <class Transport>
+void DiscobusSlaveT<Transport>::endStream(uint8_t valid) {
+  if (streaming) {
+    streaming = 0;
+    if (dataEndHandler) {
+      dataEndHandler(command, valid);
+    }
+  }
+}
+
+template <class Transport>
+uint8_t DiscobusSlaveT<Transport>::processAddressing(uint8_t b) {
 
   // We still waiting for an address
-  if (myAddress == 0 && isPrevDaisyEnabled() && !serial->available()){
+  if (myAddress == 0 && isPrevDaisyEnabled() && !rxAvailable()){
 
     // Address confirmation
     if (parsePos == ADDR_SENT) {
@@ -272,7 +603,7 @@ void DiscobusSlave::processAddressing(uint8_t b) {
         if (b == 0xFF) {
           doneAddressing();
         }
-        return;
+        return 0;
       }
       // Not confirmed, try again
       else {
@@ -293,19 +624,15 @@ void DiscobusSlave::processAddressing(uint8_t b) {
           parsePos = ADDR_UNSET;
           lastAddr = b;
         }
-        return;
+        return 0;
       }
     }
     // This might be ours, send tentative new address and wait for confirmation
     else if(b >= lastAddr) {
       b++;
       parsePos = ADDR_SENT;
-      _delay_us(200);
-      serial->enable_write();
-      serial->write(b);
-      serial->enable_read();
       lastAddr = b;
-      return;
+      return b;
     }
   }
 
@@ -319,30 +646,82 @@ void DiscobusSlave::processAddressing(uint8_t b) {
   if (parsePos == ADDR_WAITING) {
     parsePos = ADDR_UNSET;
   }
+  return 0;
+}
+
+template <class Transport>
+void DiscobusSlaveT<Transport>::sendAddress(uint8_t addr) {
+  if (!addr) {
+    return;
+  }
+  if (frameUs) {
+    waitGuardTime();
+  } else {
+    _delay_us(MD_ADDRESS_GUARD_US);
+  }
+  serial->enable_write();
+  writeByte(serial, addr);
+  serial->enable_read();
 }
 
-void DiscobusSlave::doneAddressing() {
+template <class Transport>
+void DiscobusSlaveT<Transport>::doneAddressing() {
   dataIndex = 0;
   dataBuffer[dataIndex++] = myAddress;
   dataBuffer[dataIndex] = '\0';
   parseState = MESSAGE_READY;
 }
 
-void DiscobusSlave::sendResponse() {
-  if (responseHandler) {
-    uint8_t i;
-    responseHandler(command, dataBuffer, length);
+template <class Transport>
+void DiscobusSlaveT<Transport>::sendResponse(uint8_t wait) {
+  uint8_t *response = 0,
+          len = (length > MD_MAX_DATA_LEN) ? MD_MAX_DATA_LEN : length;
 
-    // Make sure we're not butting up against other data that was just received
-    _delay_us(150);
+#if MD_PUBLISH_RESPONSES
+  // Published ahead of time
+  if (responseReady && responseCommand == command) {
+    response = responseBuffers[responseFront];
+    responseReady = 0;
+  }
+#endif
 
-    // Write response buffer to stream
-    serial->enable_write();
-    for (i = 0; i < length; i++) {
-      serial->write(dataBuffer[i]);
-      messageCRC = _crc16_update(messageCRC, dataBuffer[i]);
-      fullDataIndex++;
+  // Ask for it now
+  if (!response && responseHandler) {
+    responseHandler(command, dataBuffer, len);
+    response = dataBuffer;
+  }
+  if (!response) {
+    return;
+  }
+
+  // Make sure we're not butting up against other data that was just received
+  if (wait) {
+    if (frameUs) {
+      waitGuardTime();
+    } else {
+      _delay_us(MD_RESPONSE_GUARD_US);
     }
-    serial->enable_read();
   }
+
+  // Write response buffer to stream, and fill out the rest of our slot
+  serial->enable_write();
+  writeData(serial, response, len);
+  for (; len < length; len++) {
+    writeByte(serial, 0);
+    messageCRC = _crc16_update(messageCRC, 0);
+  }
+  fullDataIndex += length;
+  serial->enable_read();
 }
+
+////////////////////////////////////////////
+/// Transports
+////////////////////////////////////////////
+
+// The transports the template is built for. Add yours here to use it
+// directly, instead of through DiscobusData.
+template class DiscobusSlaveT<DiscobusData>;
+#ifdef __AVR__
+template class DiscobusSlaveT<DiscobusUart>;
+template class DiscobusSlaveT<DiscobusRS485>;
+#endif
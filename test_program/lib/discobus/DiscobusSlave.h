@@ -5,20 +5,48 @@
 #include <avr/io.h>
 #include <stdint.h>
 #include "Discobus.h"
+#include "RingBuffer.h"
+#include "DiscobusTimer.h"
 
 typedef void (*DiscobusResponseFunction)(uint8_t command, uint8_t *buff, uint8_t len);
 
+// Takes the data of a message that's too long for the data buffer, as it arrives
+// (see setDataHandler). `offset` is where `data` starts in this node's data.
+typedef void (*DiscobusDataFunction)(uint8_t command, uint8_t offset, uint8_t *data, uint8_t len);
+
+// Called once all of a long message has been handed over, with `valid` set if its CRC matched
+typedef void (*DiscobusDataEndFunction)(uint8_t command, uint8_t valid);
+
 #ifndef MD_MAX_DATA_LEN
 #define MD_MAX_DATA_LEN 10
 #endif
 
+// How many bytes are taken from the data stream at a time
+#ifndef MD_RX_CHUNK_LEN
+#define MD_RX_CHUNK_LEN 8
+#endif
+
+// Bytes set aside for messages parsed in the receive interrupt, waiting to be read
+// (see parseInInterrupt). Each message takes 4 bytes and its data. This has to be
+// a power of two, or 0 to leave the feature out.
+#ifndef MD_MSG_QUEUE_SIZE
+#define MD_MSG_QUEUE_SIZE 0
+#endif
+
+// Set to 1 for publishResponse(), which takes two more buffers of MD_MAX_DATA_LEN
+// bytes, or 0 to leave it out.
+#ifndef MD_PUBLISH_RESPONSES
+#define MD_PUBLISH_RESPONSES 0
+#endif
+
 /**
-  Discobus Slave class
+  Discobus Slave class, on any transport (see Discobus.h)
 */
-class DiscobusSlave: public Discobus {
+template <class Transport>
+class DiscobusSlaveT: public Discobus {
 
 public:
-  DiscobusSlave(DiscobusData *_serial);
+  DiscobusSlaveT(Transport *_serial);
 
   // Reset the node's stat and unset it's address.
   void resetNode();
@@ -56,14 +84,62 @@ public:
   // Is the current message in batch mode
   uint8_t inBatchMode();
 
+#if MD_RESPONSE_TIMER && !MD_MSG_QUEUE_SIZE
+#error "The response schedule (MD_RESPONSE_TIMER) needs MD_MSG_QUEUE_SIZE, to parse in the interrupt"
+#endif
+
+#if MD_MSG_QUEUE_SIZE
+  // Parse each byte in the transport's receive interrupt as it arrives, instead
+  // of in read(). Complete messages for this node are queued, and each call to
+  // read() takes the next one off the queue, so the program can go as long as
+  // it likes between reads without losing bytes. Response messages are answered
+  // from the interrupt, so keep the response handler short.
+  // Returns 0 if the transport can't call us from its interrupt.
+  uint8_t parseInInterrupt();
+
+  // How many messages were dropped because the queue was full
+  uint16_t droppedMessages();
+#endif
+
+#if MD_RESPONSE_TIMER
+  // Answer batch response messages on a schedule, timed by Timer1 (see DiscobusTimer.h),
+  // instead of counting the bytes of the nodes before us. Our turn starts
+  // responseSlotUs() * (address - 1) + guardTimeUs() after the header, whether or not
+  // the nodes before us answered, so publish responses ahead of time (see
+  // publishResponse and MD_PUBLISH_RESPONSES). The master has to use the same schedule and bus timing.
+  // Messages whose turns take longer than MD_SCHEDULE_MAX_US are answered in turn as usual.
+  // Returns 0 if the bus timing hasn't been set or we're not parsing in the interrupt.
+  uint8_t scheduleResponses(uint8_t enabled);
+#endif
+
   // Set to the function that will provide the proper
   // data for a response message. It is  best to keep
   // this function short and quick, because it will be
   // a blocking action.
   void setResponseHandler(DiscobusResponseFunction handler);
 
+#if MD_PUBLISH_RESPONSES
+  // Set the response to send to the next response message with `command`, ahead
+  // of time, so it goes out as soon as it's our turn, without waiting on the
+  // response handler. It's sent once, and the response handler is used if
+  // nothing's been published. Data past `len` is sent as zeros.
+  // This can be called while the previous response is being sent.
+  void publishResponse(uint8_t command, const uint8_t *data, uint8_t len);
+#endif
+
+  // Hand the data of messages longer than MD_MAX_DATA_LEN to `handler`, up to
+  // MD_MAX_DATA_LEN bytes at a time, as it arrives. Without this, the data
+  // is cut short. Nothing is known about the CRC until `endHandler` is called,
+  // so keep what you're given aside until then. read() still returns the message
+  // when it's valid, without any data. With parseInInterrupt, these are
+  // called from the interrupt.
+  void setDataHandler(DiscobusDataFunction handler, DiscobusDataEndFunction endHandler);
+
 private:
+  Transport *serial;
   DiscobusResponseFunction responseHandler;
+  DiscobusDataFunction dataHandler;
+  DiscobusDataEndFunction dataEndHandler;
 
   enum msg_state_t {
     NO_MESSAGE,
@@ -71,6 +147,8 @@ private:
     HEADER_SECTION,
     DATA_SECTION,
     END_SECTION,
+    SKIP_SECTION,    // Counting through a message for another node
+    SCHEDULE_SECTION,// Waiting out the response schedule
     MESSAGE_READY
   };
 
@@ -103,15 +181,73 @@ private:
           myAddress,
           dataIndex,
           lastAddr,
-          errCount;
+          errCount,
+          escapedFraming; // Master sends escaped messages, so ignore 0xFF 0xFF
 
   // Batch mode values
   uint16_t fullDataLength,  // Length of the entire data section for all nodes
            fullDataIndex,   // The actual index of the entire data section
            dataStartOffset; // Where this node's data starts.
 
+  uint16_t skipLeft;        // Bytes left in a message for another node
+
+  uint8_t streaming,        // The data is going to the data handler
+          streamOffset;     // Where the data in the buffer starts
+
+#if MD_PUBLISH_RESPONSES
+  // Published responses. One buffer is filled while the other waits to be sent.
+  uint8_t responseBuffers[2][MD_MAX_DATA_LEN],
+          responseFront,    // The buffer waiting to be sent
+          responseCommand;  // The command it's for
+  volatile uint8_t responseReady;
+#endif
+
   uint8_t dataBuffer[MD_MAX_DATA_LEN + 1];
 
+  // Bytes taken from the data stream that haven't been parsed yet
+  uint8_t rxChunk[MD_RX_CHUNK_LEN],
+          rxChunkPos,
+          rxChunkLen;
+
+  // Are there received bytes left to parse
+  uint8_t rxAvailable();
+
+#if MD_MSG_QUEUE_SIZE
+  // Messages parsed in the interrupt: flags, address, command, data length and data
+  RingBuffer<MD_MSG_QUEUE_SIZE> messageQueue;
+  uint8_t inInterrupt;
+  volatile uint16_t dropped;
+
+  // The message read() took off the queue
+  uint8_t queuedReady,
+          queuedFlags,
+          queuedAddress,
+          queuedCommand,
+          queuedLen,
+          queuedData[MD_MAX_DATA_LEN + 1];
+
+  // Parse a byte from the receive interrupt
+  static void receiveInInterrupt(void *slave, uint8_t b);
+
+  // Add the message that was just parsed to the queue
+  void queueMessage();
+
+  // Take the next message off the queue
+  uint8_t readQueued();
+#endif
+
+#if MD_RESPONSE_TIMER
+  DiscobusTimer responseTimer;
+  uint8_t scheduled;
+
+  // Time our turn in the response message whose header was just parsed.
+  // Returns 0 if it doesn't go on the schedule.
+  uint8_t startResponseTimer();
+
+  // Our turn to respond, or the end of the schedule, from the timer interrupt
+  static void onResponseTimer(void *slave, uint8_t event);
+#endif
+
   // Start a new message by resetting all values
   void startMessage();
 
@@ -124,14 +260,24 @@ private:
   // Process the data section of the message
   void processData(uint8_t);
 
-  // Process the addressing response part of the addressing message
-  void processAddressing(uint8_t);
+  // Tell the data handler the streamed message is over, if there is one
+  void endStream(uint8_t valid);
+
+  // Process the addressing response part of the addressing message.
+  // Returns the tentative address this node has to send, or 0 for none.
+  uint8_t processAddressing(uint8_t);
+
+  // Send a tentative address after the gap, for master to confirm
+  void sendAddress(uint8_t addr);
 
   // Finish the addressing message
   void doneAddressing();
 
-  // Send a response to a message
-  void sendResponse();
+  // Send a response to a message, after the guard time if `wait` is set
+  void sendResponse(uint8_t wait=1);
 };
 
+// Slave on any DiscobusData
+typedef DiscobusSlaveT<DiscobusData> DiscobusSlave;
+
 #endif
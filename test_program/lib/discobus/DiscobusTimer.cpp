@@ -0,0 +1,99 @@
+#include "DiscobusTimer.h"
+#include "Discobus.h"
+
+#if MD_RESPONSE_TIMER
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+////////////////////////////////////////////
+/// Macros
+////////////////////////////////////////////
+#define TIMER_CLOCK_64   ((1 << CS11) | (1 << CS10))
+#define TIMER_CLOCK_256  (1 << CS12)
+#define TIMER_CLOCK_1024 ((1 << CS12) | (1 << CS10))
+
+#define US_TO_CYCLES(us) ((us) * ((F_CPU) / 1000000UL))
+
+// The longest we can count, at F_CPU / 1024
+#define TIMER_MAX_US (0xFFFFUL * 1024 / ((F_CPU) / 1000000UL))
+
+#if MD_SCHEDULE_MAX_US > TIMER_MAX_US
+#error "MD_SCHEDULE_MAX_US is too long for Timer1 at this F_CPU"
+#endif
+
+////////////////////////////////////////////
+/// Globals
+////////////////////////////////////////////
+static DiscobusTimerFunction timer_handler;
+static void* timer_handler_context;
+
+////////////////////////////////////////////
+/// Class members
+////////////////////////////////////////////
+// Count from now
+uint8_t DiscobusTimer::start(uint32_t slotUs, uint32_t endUs, DiscobusTimerFunction handler, void *context) {
+  uint32_t slot = US_TO_CYCLES(slotUs),
+           end = US_TO_CYCLES(endUs);
+  uint8_t clock, shift;
+
+  if (slotUs > endUs || endUs > TIMER_MAX_US) {
+    return 0;
+  }
+
+  // The finest steps that reach the end
+  if ((end >> 6) <= 0xFFFF) {
+    clock = TIMER_CLOCK_64;
+    shift = 6;
+  } else if ((end >> 8) <= 0xFFFF) {
+    clock = TIMER_CLOCK_256;
+    shift = 8;
+  } else {
+    clock = TIMER_CLOCK_1024;
+    shift = 10;
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    TCCR1B = 0;
+    TCCR1A = 0;
+    TCNT1 = 0;
+    OCR1A = slot >> shift;
+    OCR1B = end >> shift;
+    TIFR1 = (1 << OCF1A) | (1 << OCF1B);
+
+    timer_handler = handler;
+    timer_handler_context = context;
+
+    TIMSK1 = (slotUs ? (1 << OCIE1A) : 0) | (1 << OCIE1B);
+    TCCR1B = clock;
+  }
+  return 1;
+}
+
+// Stop counting
+void DiscobusTimer::stop() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    TCCR1B = 0;
+    TIMSK1 &= ~((1 << OCIE1A) | (1 << OCIE1B));
+  }
+}
+
+////////////////////////////////////////////
+/// Interrupt Controls
+////////////////////////////////////////////
+
+// The node's turn
+ISR(TIMER1_COMPA_vect) {
+  TIMSK1 &= ~(1 << OCIE1A);
+  timer_handler(timer_handler_context, DiscobusTimer::SLOT);
+}
+
+// Every node's turn is over
+ISR(TIMER1_COMPB_vect) {
+  TCCR1B = 0;
+  TIMSK1 &= ~((1 << OCIE1A) | (1 << OCIE1B));
+  timer_handler(timer_handler_context, DiscobusTimer::END);
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef DiscobusTimer_H
+#define DiscobusTimer_H
+
+/************************************************************************************
+ *  Timer1 of Atmega8 chips, as a one-shot timer for the response schedule of
+ *  DiscobusSlaveT (see scheduleResponses). It's started at the end of a response
+ *  message's header, and calls its handler from the compare interrupts when the
+ *  node's turn comes and when every node's turn is over.
+ *
+ *  Timer1 can't be used for anything else while the schedule is on, so this is
+ *  only built when MD_RESPONSE_TIMER is set to 1.
+ *
+ ************************************************************************************/
+
+#include <stdint.h>
+
+#ifndef MD_RESPONSE_TIMER
+#define MD_RESPONSE_TIMER 0
+#endif
+
+// Called from the timer interrupts with DiscobusTimer::SLOT or DiscobusTimer::END
+typedef void (*DiscobusTimerFunction)(void *context, uint8_t event);
+
+class DiscobusTimer {
+public:
+  enum event_t {
+    SLOT,
+    END
+  };
+
+  // Start counting from now, and call `handler` with SLOT after `slotUs` microseconds
+  // (0 to leave it out) and END after `endUs`. Counts in steps of 64 CPU cycles,
+  // or 256 or 1024 when `endUs` needs them, up to 65535 steps (4.19s at 16MHz).
+  // Returns 0, without starting, if `endUs` is longer than that.
+  uint8_t start(uint32_t slotUs, uint32_t endUs, DiscobusTimerFunction handler, void *context);
+
+  // Stop counting, without calling the handler
+  void stop();
+};
+
+#endif
@@ -0,0 +1,388 @@
+
+#include "DiscobusUart.h"
+#include <util/crc16.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+////////////////////////////////////////////
+/// Prototypes
+////////////////////////////////////////////
+void uartReceive();
+void uartSendNextByte();
+void uartSendQueuedByte();
+void writeByteToRegister(uint8_t, uint8_t addressFrame=0);
+
+////////////////////////////////////////////
+/// Macros
+////////////////////////////////////////////
+#define UART0_UBRRH UBRR0H
+#define UART0_UBRRL UBRR0L
+#define UART0_UCSRA UCSR0A
+#define UART0_UCSRB UCSR0B
+#define UART0_UCSRC UCSR0C
+#define UART0_UDR   UDR0
+#define UART0_UDRE  UDRE0
+#define UART0_TXC   TXC0
+
+#define UART_BAUD_SELECT(baudRate)  (((F_CPU) + 8UL * (baudRate)) / (16UL * (baudRate)) -1UL)
+
+#define DISABLE_TX_INT() UART0_UCSRB &= ~(1 << UDRIE0);
+#define ENABLE_TX_INT() UART0_UCSRB |= (1 << UDRIE0)
+
+#define DISABLE_TXC_INT() UART0_UCSRB &= ~(1 << TXCIE0)
+#define ENABLE_TXC_INT() UART0_UCSRB |= (1 << TXCIE0)
+
+// UCSRA is written whole, because writing TXC back as 1 would clear it
+#define SET_MPCM() UART0_UCSRA = (UART0_UCSRA & (1 << U2X0)) | (1 << MPCM0)
+#define CLEAR_MPCM() UART0_UCSRA = (UART0_UCSRA & (1 << U2X0))
+#define CLEAR_TXC() UART0_UCSRA = (UART0_UCSRA & ((1 << U2X0) | (1 << MPCM0))) | (1 << UART0_TXC)
+
+////////////////////////////////////////////
+/// Globals
+////////////////////////////////////////////
+RingBuffer<UART0_RX_BUFFER_SIZE> uart0_rx_buffer;
+RingBuffer<UART0_TX_BUFFER_SIZE> uart0_tx_buffer;
+
+// Takes received bytes instead of the RX buffer (see onReceive)
+static DiscobusReceiveFunction rx_handler;
+static void* rx_handler_context;
+
+// Messages being sent in the background, oldest first
+static DiscobusMessage* volatile tx_queue_head;
+static DiscobusMessage* volatile tx_queue_tail;
+
+// A byte has been written to the TX register, and the TX complete
+// interrupt hasn't seen the line go idle since
+static volatile uint8_t tx_busy;
+
+// Driver enable pin to release when the line goes idle (see releaseWhenSent)
+static volatile uint8_t* tx_release_port;
+static uint8_t tx_release_mask;
+
+// Using 9-bit frames (see setMultiprocessorMode)
+static volatile uint8_t multiprocessor_mode;
+
+////////////////////////////////////////////
+/// Class members
+////////////////////////////////////////////
+// Hook into the UART and start receiving data
+void DiscobusUart::begin(uint32_t baud) {
+  UART0_UCSRA = 0;
+
+  // Endable TX/RX
+  UART0_UCSRB = (1<<TXEN0) | (1<<RXEN0);
+  UART0_UCSRB |= (1<<RXCIE0);  // RX Interrupt
+
+  // Frame format (8-bit, 1 stop bit)
+  UART0_UCSRC = 1<<UCSZ01 | 1<<UCSZ00;
+  if (multiprocessor_mode) {
+    UART0_UCSRB |= (1<<UCSZ02); // 9-bit
+  }
+
+  // Set baud
+  UART0_UBRRL =  (unsigned char)UART_BAUD_SELECT(baud);
+  UART0_UBRRH =  (unsigned char)(UART_BAUD_SELECT(baud) << 8);
+
+  // Enable interrupts
+  sei();
+}
+
+// Write something to the TX line
+void DiscobusUart::write(uint8_t c) {
+  waitForQueue();
+
+  // If buffer is empty and the register is ready to be written
+  // to, send it directly
+  if (uart0_tx_buffer.isEmpty() && (UART0_UCSRA & (1<<UART0_UDRE))) {
+    writeByteToRegister(c);
+    return;
+  }
+
+  // If TX buffer is full, we need to flush a byte out first
+  if (uart0_tx_buffer.isFull()) {
+    uartSendNextByte();
+  }
+
+  // Add to buffer and enable interrupt
+  uart0_tx_buffer.put(c);
+  ENABLE_TX_INT();
+}
+
+// Write several bytes to the TX line
+void DiscobusUart::write(const uint8_t *data, uint16_t len, uint16_t *crc) {
+  waitForQueue();
+  while (len) {
+
+    // Send the first byte directly, if we can
+    if (uart0_tx_buffer.isEmpty() && (UART0_UCSRA & (1<<UART0_UDRE))) {
+      if (crc) {
+        *crc = _crc16_update(*crc, *data);
+      }
+      writeByteToRegister(*data++);
+      len--;
+      continue;
+    }
+
+    // If TX buffer is full, we need to flush a byte out first
+    if (uart0_tx_buffer.isFull()) {
+      uartSendNextByte();
+    }
+
+    // Add as much as fits and enable interrupt
+    uint8_t n = uart0_tx_buffer.put(data, (len > 0xFF) ? 0xFF : len, crc);
+    data += n;
+    len -= n;
+    ENABLE_TX_INT();
+  }
+}
+
+// Bytes dropped because the RX buffer was full
+uint16_t DiscobusUart::overflows() {
+  uint16_t count;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    count = uart0_rx_buffer.getOverflows();
+  }
+  return count;
+}
+
+void DiscobusUart::resetOverflows() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    uart0_rx_buffer.resetOverflows();
+  }
+}
+
+// Hand received bytes straight to `handler`
+uint8_t DiscobusUart::onReceive(DiscobusReceiveFunction handler, void *context) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    rx_handler = handler;
+    rx_handler_context = context;
+  }
+  return 1;
+}
+
+// Send a whole message from the UDRE interrupt
+void DiscobusUart::queue(DiscobusMessage *message) {
+  message->rewind();
+  message->next = 0;
+  message->state = DiscobusMessage::QUEUED;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (tx_queue_tail) {
+      tx_queue_tail->next = message;
+    } else {
+      tx_queue_head = message;
+    }
+    tx_queue_tail = message;
+    ENABLE_TX_INT();
+  }
+}
+
+// 9-bit frames, where the 9th bit marks the start of a message
+uint8_t DiscobusUart::setMultiprocessorMode(uint8_t enabled) {
+  flush();
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    multiprocessor_mode = enabled;
+    if (enabled) {
+      UART0_UCSRB |= (1 << UCSZ02);
+    } else {
+      UART0_UCSRB &= ~((1 << UCSZ02) | (1 << TXB80));
+      CLEAR_MPCM();
+    }
+  }
+  return 1;
+}
+
+// Send the first byte of a message as an address frame
+void DiscobusUart::writeStart(uint8_t b) {
+  if (!multiprocessor_mode) {
+    write(b);
+    return;
+  }
+
+  // The 9th bit is set on the register, not the byte, so everything
+  // before it has to be out of the buffer first
+  waitForQueue();
+  while (!uart0_tx_buffer.isEmpty()) {
+    uartSendNextByte();
+  }
+  while(!(UART0_UCSRA & (1<<UART0_UDRE)));
+  writeByteToRegister(b, 1);
+}
+
+// Skip to the next address frame
+uint8_t DiscobusUart::skipMessage() {
+  uint8_t skipping = 0;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (multiprocessor_mode && uart0_rx_buffer.isEmpty()) {
+      SET_MPCM();
+      skipping = 1;
+    }
+  }
+  return skipping;
+}
+
+// Are messages still waiting to be sent
+uint8_t DiscobusUart::isQueueBusy() {
+  return tx_queue_head != 0;
+}
+
+// Wait for the queued messages to be handed to the hardware,
+// so nothing else is written in the middle of one
+void DiscobusUart::waitForQueue() {
+  while (tx_queue_head);
+}
+
+// Send everything in the TX buffer with blocking
+void DiscobusUart::flush() {
+  waitForQueue();
+  DISABLE_TX_INT();
+  while (!uart0_tx_buffer.isEmpty()) {
+    uartSendNextByte();
+  }
+  // Wait for the transmit to complete
+  // (the TX complete interrupt clears TXC if it's enabled, and tx_busy with it)
+  while (tx_busy && !(UART0_UCSRA & (1 << UART0_TXC)));
+}
+
+// Clear `mask` on `port` once the last byte has left the shift register
+void DiscobusUart::releaseWhenSent(volatile uint8_t* port, uint8_t mask) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+
+    // Already idle
+    if (uart0_tx_buffer.isEmpty() && !tx_queue_head && (!tx_busy || (UART0_UCSRA & (1 << UART0_TXC)))) {
+      tx_busy = 0;
+      *port &= ~mask;
+    }
+    // Let the TX complete interrupt do it
+    else {
+      tx_release_port = port;
+      tx_release_mask = mask;
+      ENABLE_TXC_INT();
+    }
+  }
+}
+
+// Forget about releasing the driver enable pin
+void DiscobusUart::cancelRelease() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    DISABLE_TXC_INT();
+    tx_release_port = 0;
+  }
+}
+
+////////////////////////////////////////////
+/// Interrupt Controls
+////////////////////////////////////////////
+
+// Receive the byte out of the RX register
+void uartReceive() {
+  // The start of a message, so stop skipping (the 9th bit has to be read first)
+  if (multiprocessor_mode && (UART0_UCSRB & (1 << RXB80))) {
+    CLEAR_MPCM();
+  }
+
+  // Always read the register, or the interrupt fires again right away.
+  // If the buffer is full, the byte is dropped and counted as an overflow.
+  uint8_t b = UART0_UDR;
+  if (rx_handler) {
+    rx_handler(rx_handler_context, b);
+  } else {
+    uart0_rx_buffer.put(b);
+  }
+}
+
+// Send the next byte off the TX buffer
+void uartSendNextByte() {
+  if (uart0_tx_buffer.isEmpty()) return;
+  DISABLE_TX_INT();
+
+  // Wait for TX to be ready
+  while(!(UART0_UCSRA & (1<<UART0_UDRE)));
+
+  // Send from tail and move tail forward
+  writeByteToRegister(uart0_tx_buffer.get());
+
+  // If buffer isn't empty, or there are messages to send, enable interrupt
+  if (!uart0_tx_buffer.isEmpty() || tx_queue_head) {
+    ENABLE_TX_INT();
+  }
+}
+
+// Send the next byte of the oldest queued message, moving on to the next
+// message when it's done
+void uartSendQueuedByte() {
+  DiscobusMessage *message = tx_queue_head;
+  uint8_t b, start = 0;
+
+  while (message) {
+    start = message->atStart();
+    if (message->nextByte(&b)) {
+      break;
+    }
+
+    tx_queue_head = message->next;
+    if (!tx_queue_head) {
+      tx_queue_tail = 0;
+    }
+    message->state = DiscobusMessage::SENT;
+    if (message->onSent) {
+      message->onSent(message);
+    }
+    message = tx_queue_head;
+  }
+
+  // Nothing left to send
+  if (!message) {
+    DISABLE_TX_INT();
+    return;
+  }
+  writeByteToRegister(b, start);
+}
+
+// Write a single byte to the TX register
+// this assumes you've made sure the register is empty
+// (so the last byte has moved on, and changing its 9th bit is safe)
+void writeByteToRegister(uint8_t b, uint8_t addressFrame) {
+  tx_busy = 1;
+  if (multiprocessor_mode) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      if (addressFrame) {
+        UART0_UCSRB |= (1 << TXB80);
+      } else {
+        UART0_UCSRB &= ~(1 << TXB80);
+      }
+    }
+  }
+  UART0_UDR = b;
+
+  // Reset transmit complete, without the RX interrupt changing MPCM in between
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    CLEAR_TXC();
+  }
+}
+
+// Received a byte from the RX line
+ISR(USART_RX_vect){
+  uartReceive();
+}
+
+// Ready to send a byte on the TX line
+ISR(USART_UDRE_vect) {
+  if (!uart0_tx_buffer.isEmpty()) {
+    uartSendNextByte();
+  } else {
+    uartSendQueuedByte();
+  }
+}
+
+// The last byte has left the shift register
+ISR(USART_TX_vect) {
+  if (!uart0_tx_buffer.isEmpty() || tx_queue_head) return;
+
+  tx_busy = 0;
+  if (tx_release_port) {
+    *tx_release_port &= ~tx_release_mask;
+    tx_release_port = 0;
+  }
+  DISABLE_TXC_INT();
+}
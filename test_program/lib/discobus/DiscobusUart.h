@@ -0,0 +1,118 @@
+#ifndef DiscobusUart_H
+#define DiscobusUart_H
+
+/************************************************************************************
+ *  The UART0 data stream of Atmega8 chips, without virtual methods, for the
+ *  DiscobusMasterT and DiscobusSlaveT templates. The methods called for every
+ *  received byte are defined here, so they're inlined into the parser.
+ *
+ *  DiscobusDataUart wraps this up as a DiscobusData.
+ *
+ ************************************************************************************/
+
+#include <avr/io.h>
+#include <stdint.h>
+#include "RingBuffer.h"
+#include "DiscobusMessage.h"
+
+// Buffer sizes have to be powers of two (see RingBuffer.h)
+#ifndef UART0_RX_BUFFER_SIZE
+#define UART0_RX_BUFFER_SIZE 128
+#endif
+
+#ifndef UART0_TX_BUFFER_SIZE
+#define UART0_TX_BUFFER_SIZE 64
+#endif
+
+// Filled and drained by the UART interrupts (in DiscobusUart.cpp)
+extern RingBuffer<UART0_RX_BUFFER_SIZE> uart0_rx_buffer;
+extern RingBuffer<UART0_TX_BUFFER_SIZE> uart0_tx_buffer;
+
+class DiscobusUart {
+public:
+  // Hook into the UART at `baud` and start receiving data
+  void begin(uint32_t baud);
+
+  // How many bytes are available in the RX buffer
+  uint8_t available() {
+    return uart0_rx_buffer.count();
+  }
+
+  // Read a byte from the RX buffer
+  uint8_t read() {
+    if (uart0_rx_buffer.isEmpty()) {
+      return -1;
+    }
+    return uart0_rx_buffer.get();
+  }
+
+  // Read several bytes from the RX buffer (see DiscobusData.h)
+  uint8_t read(uint8_t *buff, uint8_t max, uint16_t *crc=0) {
+    return uart0_rx_buffer.get(buff, max, crc);
+  }
+
+  // Write something to the TX line.
+  // (this waits for the queued messages to be sent first)
+  void write(uint8_t);
+
+  // Write several bytes to the TX line (see DiscobusData.h)
+  void write(const uint8_t *data, uint16_t len, uint16_t *crc=0);
+
+  // Hand each received byte to `handler` from the RX interrupt, instead of the
+  // RX buffer (0 to go back to the buffer). Always returns 1.
+  uint8_t onReceive(DiscobusReceiveFunction handler, void *context);
+
+  // Queue a whole message to be sent from the TX interrupt, and return right away
+  // (see DiscobusMessage.h). Messages are sent in the order they're queued.
+  void queue(DiscobusMessage *message);
+
+  // Are queued messages still being sent
+  uint8_t isQueueBusy();
+
+  // Switch to 9-bit frames, with the 9th bit set on the first byte of each
+  // message, so skipMessage() can leave the rest to the hardware (MPCM).
+  // Every node and the master have to use the same framing, and the bootloader
+  // doesn't, so switch back before jumping to it. Always returns 1.
+  uint8_t setMultiprocessorMode(uint8_t enabled);
+
+  // Write the first byte of a message, as an address frame in multiprocessor mode.
+  // (this waits for everything before it to be handed to the hardware)
+  void writeStart(uint8_t b);
+
+  // In multiprocessor mode, have the hardware drop everything until the next
+  // address frame, without interrupts. Returns 0 if not in multiprocessor mode,
+  // or if there are bytes in the RX buffer that were received before this call.
+  uint8_t skipMessage();
+
+  // Send everything in the TX buffer and return when the
+  // final frame has been transmitted out
+  void flush();
+
+  // Clears the RX buffer
+  void clear() {
+    uart0_rx_buffer.clear();
+  }
+
+  // How many received bytes have been dropped because the RX buffer was full.
+  // Raise UART0_RX_BUFFER_SIZE, or read more often, if this goes up.
+  uint16_t overflows();
+  void resetOverflows();
+
+  // Not needed without a transceiver
+  void enable_write() { }
+  void enable_read() { }
+
+protected:
+  // Wait for the queued messages to be handed to the hardware
+  void waitForQueue();
+
+  // Clear `mask` on `port` (a transceiver's driver enable) as soon as the last
+  // byte written has left the shift register, from the TX complete interrupt.
+  // Returns right away.
+  void releaseWhenSent(volatile uint8_t* port, uint8_t mask);
+
+  // Cancel a release that hasn't happened yet
+  void cancelRelease();
+};
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef RingBuffer_H
+#define RingBuffer_H
+
+/************************************************************************************
+ *  A byte ring buffer shared between an interrupt and the main program.
+ *
+ *  SIZE has to be a power of two (up to 256), so the indexes wrap with a mask
+ *  instead of a division, which the AVR doesn't have an instruction for. One
+ *  slot is always left empty, so a buffer holds SIZE - 1 bytes.
+ *
+ *  Only one side should add bytes and only the other should take them. Bytes
+ *  that don't fit are dropped and counted as overflows.
+ *
+ ************************************************************************************/
+
+#include <stdint.h>
+#include <util/crc16.h>
+
+template <uint16_t SIZE>
+class RingBuffer {
+public:
+  static const uint8_t MASK = SIZE - 1;
+
+  RingBuffer() : head(0), tail(0), overflows(0) { }
+
+  uint8_t isEmpty() {
+    return head == tail;
+  }
+
+  uint8_t isFull() {
+    return ((uint8_t)(head + 1) & MASK) == tail;
+  }
+
+  // How many bytes are in the buffer
+  uint8_t count() {
+    return (uint8_t)(head - tail) & MASK;
+  }
+
+  // Add a byte to the head of the buffer.
+  // Returns 0, and counts an overflow, if it's full.
+  uint8_t put(uint8_t b) {
+    uint8_t h = head,
+            next = (uint8_t)(h + 1) & MASK;
+
+    if (next == tail) {
+      overflows++;
+      return 0;
+    }
+    buffer[h] = b;
+    head = next;
+    return 1;
+  }
+
+  // Take a byte from the tail of the buffer (make sure it isn't empty first)
+  uint8_t get() {
+    uint8_t t = tail,
+            b = buffer[t];
+    tail = (uint8_t)(t + 1) & MASK;
+    return b;
+  }
+
+  // Take up to `max` bytes from the tail of the buffer, a contiguous run at a time,
+  // and return how many were taken. If `crc` is set, it's updated with each byte.
+  uint8_t get(uint8_t *buff, uint8_t max, uint16_t *crc=0) {
+    uint8_t t = tail,
+            n = (uint8_t)(head - t) & MASK,
+            left;
+
+    if (n > max) {
+      n = max;
+    }
+    left = n;
+    while (left) {
+      uint8_t run = (SIZE - t < left) ? SIZE - t : left;
+      volatile uint8_t *src = &buffer[t];
+
+      left -= run;
+      t = (uint8_t)(t + run) & MASK;
+      if (crc) {
+        uint16_t c = *crc;
+        while (run--) {
+          uint8_t b = *src++;
+          *buff++ = b;
+          c = _crc16_update(c, b);
+        }
+        *crc = c;
+      } else {
+        while (run--) {
+          *buff++ = *src++;
+        }
+      }
+    }
+    tail = t;
+    return n;
+  }
+
+  // Add as many of `len` bytes as there's room for, a contiguous run at a time,
+  // and return how many were added. If `crc` is set, it's updated with each byte added.
+  // (this doesn't count overflows, the caller decides what to do with the rest)
+  uint8_t put(const uint8_t *data, uint8_t len, uint16_t *crc=0) {
+    uint8_t h = head,
+            n = MASK - ((uint8_t)(h - tail) & MASK),
+            left;
+
+    if (n > len) {
+      n = len;
+    }
+    left = n;
+    while (left) {
+      uint8_t run = (SIZE - h < left) ? SIZE - h : left;
+      volatile uint8_t *dst = &buffer[h];
+
+      left -= run;
+      h = (uint8_t)(h + run) & MASK;
+      if (crc) {
+        uint16_t c = *crc;
+        while (run--) {
+          uint8_t b = *data++;
+          *dst++ = b;
+          c = _crc16_update(c, b);
+        }
+        *crc = c;
+      } else {
+        while (run--) {
+          *dst++ = *data++;
+        }
+      }
+    }
+    head = h;
+    return n;
+  }
+
+  // The byte at the tail of the buffer, without taking it
+  uint8_t peek() {
+    return buffer[tail];
+  }
+
+  // Throw away everything in the buffer
+  void clear() {
+    tail = head;
+  }
+
+  // Bytes dropped because the buffer was full
+  // (from the main program, read this with interrupts disabled)
+  uint16_t getOverflows() {
+    return overflows;
+  }
+
+  void resetOverflows() {
+    overflows = 0;
+  }
+
+private:
+  // Fails to compile if SIZE isn't a power of two
+  typedef char SizeIsPowerOfTwo[(SIZE >= 2 && SIZE <= 256 && (SIZE & (SIZE - 1)) == 0) ? 1 : -1];
+
+  volatile uint8_t buffer[SIZE];
+  volatile uint8_t head,
+                   tail;
+  volatile uint16_t overflows;
+};
+
+#endif
@@ -11,7 +11,7 @@
 #include <util/delay.h>
 
 #include "DiscobusSlave.h"
-#include "DiscobusData485.h"
+#include "DiscobusRS485.h"
 
 
 ////////////////////////////////////////////
@@ -21,17 +21,11 @@
 // Communication speed
 #define SERIAL_BAUD 115200
 
-// Firmware version
-#define VERSION_MAJOR 1
-#define VERSION_MINOR 0
-
 // Command that sends the program to the bootloader
 #define BOOTLOADER_CMD 0xF0
 
 // EEPROM addresses
 #define EEPROM_RUN_APP        (uint8_t*) 0x00
-#define EEPROM_VERSION_MAJOR  (uint8_t*) 0x01
-#define EEPROM_VERSION_MINOR  (uint8_t*) 0x02
 
 ////////////////////////////////////////////
 /// Prototypes
@@ -50,9 +44,13 @@ int main() {
   DDRD &= ~(1 << PD6);
 
 
-  DiscobusData485 rs485(PD2, &DDRD, &PORTD);
-  DiscobusSlave comm(&rs485);
+  DiscobusRS485 rs485(PD2, &DDRD, &PORTD);
+  DiscobusSlaveT<DiscobusRS485> comm(&rs485);
   rs485.begin(SERIAL_BAUD);
+  comm.setBusTiming(SERIAL_BAUD);
+
+  // Parse the bus in the background, so nothing is lost while we sleep
+  comm.parseInInterrupt();
 
   setOkay();
 
@@ -60,9 +58,10 @@ int main() {
   while(true) {
 
     // Reboot into bootloader when we receive the bootloader command
-    comm.read();
-    if (comm.hasNewMessage() && comm.isAddressedToMe() && comm.getCommand() == BOOTLOADER_CMD) {
-      rebootToBootloader();
+    while (comm.read()) {
+      if (comm.isAddressedToMe() && comm.getCommand() == BOOTLOADER_CMD) {
+        rebootToBootloader();
+      }
     }
 
     // Blink LED
@@ -80,8 +79,6 @@ int main() {
 // Set the EEPROM value to run the program on next start
 void setOkay() {
   eeprom_update_byte(EEPROM_RUN_APP, 1);
-  eeprom_update_byte(EEPROM_VERSION_MAJOR, VERSION_MAJOR);
-  eeprom_update_byte(EEPROM_VERSION_MINOR, VERSION_MINOR);
 }
 
 // Change EEPROM value to trigger bootloader then reboot
@@ -0,0 +1,67 @@
+/*****************************************************************************
+*
+* The trace ring for TRACE_MODE 2 (see trace.h).
+*
+* The dump is the number of events recorded (mod 256), the ring size and
+* then each entry (event code, timestamp low byte, timestamp high byte),
+* oldest first. Entries that were never used have the event code 0xFF.
+* Timestamps are Timer1 counts, so they wrap.
+*
+******************************************************************************/
+
+#include "hal.h"
+#include "config.h"
+#include "trace.h"
+
+#if TRACE_MODE == 2
+
+#if TRACE_DUMP == 1 && defined(SIMULATOR)
+#error "The simulator can't dump the trace to the UART, use TRACE_DUMP 0"
+#endif
+
+struct traceEntry traceRing[TRACE_RING_SIZE];
+uint8_t traceCount = 0;
+
+#if TRACE_DUMP == 0
+static uint8_t *dumpAddress;
+#endif
+
+void traceSetup() {
+  for (uint8_t i = 0; i < TRACE_RING_SIZE; i++) {
+    traceRing[i].event = 0xFF;
+  }
+
+  // Free running
+  TCCR1A = 0;
+  TCCR1B = TIMER1_CLOCK;
+}
+
+static void dumpByte(uint8_t b) {
+#if TRACE_DUMP == 1
+  while (!(UCSR0A & (1 << UDRE0)));
+  UDR0 = b;
+#else
+  eeprom_update_byte(dumpAddress++, b);
+#endif
+}
+
+void traceDump() {
+#if TRACE_DUMP == 1
+  UCSR0B |= (1 << TXEN0);
+#else
+  dumpAddress = TRACE_EEPROM_ADDR;
+#endif
+
+  uint8_t count = traceCount;
+  dumpByte(count);
+  dumpByte(TRACE_RING_SIZE);
+
+  for (uint8_t i = 0; i < TRACE_RING_SIZE; i++) {
+    struct traceEntry *entry = &traceRing[(count + i) & (TRACE_RING_SIZE - 1)];
+    dumpByte(entry->event);
+    dumpByte(entry->time & 0xFF);
+    dumpByte(entry->time >> 8);
+  }
+}
+
+#endif
@@ -0,0 +1,70 @@
+/*****************************************************************************
+*
+* Trace hooks for the receive loop, configured by TRACE_MODE in config.h.
+*
+* TRACE(event) marks a point in the bootloader. With TRACE_MODE 0 it
+* compiles to nothing, so the bootloader's timing is unchanged.
+*
+******************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+// Event codes
+#define TRACE_WAIT        0  // watchSerial() starts waiting for a message
+#define TRACE_MESSAGE     1  // start of message received
+#define TRACE_RECEIVED    2  // message data received, before the CRC
+#define TRACE_CRC_OK      3  // CRC matched, processing the message
+#define TRACE_CRC_ERROR   4  // CRC did not match
+#define TRACE_ERROR       5  // signal line enabled
+#define TRACE_PAGE_READY  6  // valid page, about to be written
+#define TRACE_ERASE       7  // erasing the page
+#define TRACE_FILL        8  // filling the page buffer
+#define TRACE_WRITE       9  // writing the page buffer to flash
+#define TRACE_WRITTEN     10 // page write complete
+#define TRACE_FINISHED    11 // programming finished
+#define TRACE_TIMEOUT     12 // gave up waiting for the rest of a message
+
+#if TRACE_MODE == 1
+
+// Toggle the debug pin (writing 1 to a PIN bit toggles the output)
+#define traceSetup() (TRACE_PIN_DDR |= (1 << TRACE_PIN_BIT))
+#define TRACE(event) do { \
+    if (TRACE_GPIO_EVENTS & (1 << (event))) TRACE_PIN_REG = (1 << TRACE_PIN_BIT); \
+  } while (0)
+#define traceDump()
+
+#elif TRACE_MODE == 2
+
+struct traceEntry {
+  uint8_t event;
+  uint16_t time;
+};
+
+// The last TRACE_RING_SIZE events, traceCount is the total mod 256
+extern struct traceEntry traceRing[TRACE_RING_SIZE];
+extern uint8_t traceCount;
+
+// Start Timer1 for the timestamps
+extern void traceSetup();
+
+// Write the ring out to EEPROM or the UART (see TRACE_DUMP)
+extern void traceDump();
+
+static inline void traceEvent(uint8_t event) {
+  struct traceEntry *entry = &traceRing[traceCount++ & (TRACE_RING_SIZE - 1)];
+  entry->time = TCNT1;
+  entry->event = event;
+}
+
+#define TRACE(event) traceEvent(event)
+
+#else
+
+#define traceSetup()
+#define TRACE(event)
+#define traceDump()
+
+#endif
+
+#endif